@@ -0,0 +1,854 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#include <core/arg_parse.h>
+#include <core/log.h>
+#include <core/thread_pool.h>
+#include <core/profiler.h>
+#include <core/layer_add.h>
+#include <core/layer_batch_norm.h>
+#include <core/layer_conv.h>
+#include <core/layer_dropout.h>
+#include <core/layer_eltwise_mult.h>
+#include <core/layer_eltwise_scale.h>
+#include <core/layer_embed.h>
+#include <core/layer_euclidean_loss.h>
+#include <core/layer_inner_product.h>
+#include <core/layer_lstm_cell.h>
+#include <core/layer_mult.h>
+#include <core/layer_pool_avg.h>
+#include <core/layer_pool_max.h>
+#include <core/layer_relu.h>
+#include <core/layer_scale.h>
+#include <core/layer_sigmoid.h>
+#include <core/layer_softmax_loss.h>
+#include <core/layer_tanh.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Bench
+ *  \brief  Layer micro-benchmark
+ *
+ * Each layer of the sandbox models is built at the exact shapes used by
+ * mnist, cifar10 and textgen (one timestep of the RNN and LSTM), for a given
+ * batch size. The layers are chained like in the models, so each one gets
+ * realistic inputs: the outputs of the previous one, starting from random
+ * data (fixed seed, the runs are reproducible).
+ *
+ * The forward and backward passes of a layer are timed separately: a few
+ * warmup calls, then the timed repetitions. The derivatives are cleared
+ * before each backward call (like a training step does), outside the timing.
+ * The results are a list of min/mean/median/p99/standard deviation times,
+ * with the throughput (see Layer::ForwardFlop and Layer::ForwardByte) based on
+ * the median, and can be written as JSON to be compared between commits.
+ */
+template <typename Dtype>
+class Bench {
+  // Public types
+ public:
+  typedef Dtype Type;
+
+
+  // Public structures
+ public:
+  /*!
+   *  \struct Result
+   *  \brief  Result of a benchmarked pass
+   */
+  struct Result {
+    std::string suite;       // Suite (model) name
+    std::string name;        // Layer name
+    uint32_t    batch_size;  // Batch size
+    uint32_t    size[4];     // First input size
+    const char* phase;       // Phase (forward or backward)
+    double      min;         // Min time (in seconds)
+    double      mean;        // Mean time
+    double      median;      // Median time
+    double      p99;         // 99th percentile time
+    double      std_dev;     // Standard deviation of the time
+    uint64_t    flop;        // Number of floating point operations per call
+    uint64_t    byte;        // Number of bytes moved per call
+  };
+
+
+  // Protected attributes
+ protected:
+  uint32_t            num_warmup_;  // Number of warmup calls
+  uint32_t            num_rep_;     // Number of timed calls
+  std::string         filter_;      // Layer filter (suite/layer substring)
+  std::mt19937        gen_;         // Random generator (fixed seed)
+  std::vector<Result> result_;      // Results
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get the statistics of a list of times.
+   *
+   *  \param[in]  time  : list of times
+   *  \param[out] result: result
+   */
+  static void Stat(std::vector<double> time, Result* result) {
+    result->min = result->mean = result->median = result->p99 =
+    result->std_dev = 0.;
+    if (time.empty()) {
+      return;
+    }
+    double total = 0.;
+    for (double t : time) {
+      total += t;
+    }
+    double var = 0.;
+    for (double t : time) {
+      var += (t - total / time.size()) * (t - total / time.size());
+    }
+    std::sort(time.begin(), time.end());
+    size_t rank     = (time.size() * 99 + 99) / 100;
+    result->min     = time[0];
+    result->mean    = total / time.size();
+    result->median  = time.size() & 1 ? time[time.size() / 2] :
+                      0.5 * (time[time.size() / 2 - 1] +
+                             time[time.size() / 2]);
+    result->p99     = time[std::min(rank, time.size()) - 1];
+    result->std_dev = std::sqrt(var / time.size());
+  }
+
+  /*!
+   * Fill a matrix with random values.
+   *
+   *  \param[in]  size: number of values
+   *  \param[in]  low : low boundary
+   *  \param[in]  high: high boundary
+   *  \param[out] data: values
+   */
+  void Fill(uint32_t size, Dtype low, Dtype high, Dtype* data) {
+    std::uniform_real_distribution<Dtype> dist(low, high);
+    for (uint32_t i = 0; i < size; ++i) {
+      data[i] = dist(gen_);
+    }
+  }
+
+  /*!
+   * Clear the derivatives of the inputs and weights of a layer.
+   *
+   *  \param[in]  layer: layer
+   */
+  static void ClearDeriv(const Layer<Dtype>& layer) {
+    const std::vector<std::shared_ptr<Mat<Dtype>>>& in = layer.Input();
+    for (size_t i = 0; i < in.size(); ++i) {
+      in[i]->ZeroDeriv();
+    }
+    std::vector<std::shared_ptr<Mat<Dtype>>> weight;
+    layer.GetWeight(&weight);
+    for (size_t i = 0; i < weight.size(); ++i) {
+      weight[i]->ZeroDeriv();
+    }
+  }
+
+  /*!
+   * Time a pass of a layer.
+   *
+   *  \param[in]  suite     : suite name
+   *  \param[in]  layer     : layer
+   *  \param[in]  batch_size: batch size
+   *  \param[in]  backward  : backward pass?
+   */
+  void Time(const char* suite, Layer<Dtype>* layer, uint32_t batch_size,
+            bool backward) {
+    State state(State::PHASE_TRAIN);
+
+    std::vector<double> time;
+    time.reserve(num_rep_);
+    for (uint32_t i = 0; i < num_warmup_ + num_rep_; ++i) {
+      if (backward) {
+        ClearDeriv(*layer);
+      }
+      double start = Profiler::Now();
+      if (backward) {
+        layer->Backward(state);
+      } else {
+        layer->Forward(state);
+      }
+      if (i >= num_warmup_) {
+        time.push_back(Profiler::Now() - start);
+      }
+    }
+
+    Result result;
+    result.suite      = suite;
+    result.name       = layer->Name();
+    result.batch_size = batch_size;
+    std::copy(layer->Input()[0]->size, layer->Input()[0]->size + 4,
+              result.size);
+    result.phase      = backward ? "backward" : "forward";
+    result.flop       = backward ? layer->BackwardFlop(state) :
+                                   layer->ForwardFlop(state);
+    result.byte       = backward ? layer->BackwardByte(state) :
+                                   layer->ForwardByte(state);
+    Stat(time, &result);
+    Print(result);
+    result_.push_back(result);
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  num_warmup: number of warmup calls
+   *  \param[in]  num_rep   : number of timed calls
+   *  \param[in]  filter    : only benchmark the layers whose "suite/layer"
+   *                          name contains this string, if any
+   */
+  Bench(uint32_t num_warmup, uint32_t num_rep, const char* filter) {
+    num_warmup_ = num_warmup;
+    num_rep_    = std::max(num_rep, 1u);
+    if (filter) {
+      filter_ = filter;
+    }
+    gen_.seed(0);
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~Bench() {}
+
+  /*!
+   * Create a random input.
+   *
+   *  \param[in]  n: matrix size (width)
+   *  \param[in]  m: matrix size (height)
+   *  \param[in]  d: matrix size (depth)
+   *  \param[in]  b: matrix size (batch size)
+   *
+   *  \return     Input
+   */
+  std::shared_ptr<Mat<Dtype>> Input(uint32_t n, uint32_t m, uint32_t d,
+                                    uint32_t b) {
+    std::shared_ptr<Mat<Dtype>> mat = std::make_shared<Mat<Dtype>>(n, m, d, b);
+    Fill(mat->Size(), Dtype(-1), Dtype(1), mat->Data());
+    return mat;
+  }
+
+  /*!
+   * Create random indices (labels or embedding indices), one per batch item.
+   *
+   *  \param[in]  batch_size: batch size
+   *  \param[in]  range     : number of indices
+   *
+   *  \return     Indices
+   */
+  std::shared_ptr<Mat<Dtype>> Index(uint32_t batch_size, uint32_t range) {
+    std::shared_ptr<Mat<Dtype>> mat = std::make_shared<Mat<Dtype>>(
+      1, 1, 1, batch_size, false);
+    std::uniform_int_distribution<uint32_t> dist(0, range - 1);
+    Dtype* data = mat->Data();
+    for (uint32_t i = 0; i < batch_size; ++i) {
+      data[i] = Dtype(dist(gen_));
+    }
+    return mat;
+  }
+
+  /*!
+   * Benchmark a layer: forward pass, then backward pass. A filtered out
+   * layer still runs a forward pass for the next layers to get valid inputs.
+   *
+   *  \param[in]  suite     : suite name
+   *  \param[in]  layer     : layer
+   *  \param[in]  batch_size: batch size
+   *
+   *  \return     Outputs of the layer
+   */
+  std::vector<std::shared_ptr<Mat<Dtype>>> Run(
+    const char* suite, const std::shared_ptr<Layer<Dtype>>& layer,
+    uint32_t batch_size) {
+    std::string name = std::string(suite) + "/" + layer->Name();
+    if (name.find(filter_) == std::string::npos) {
+      layer->Forward(State(State::PHASE_TRAIN));
+      return layer->Output();
+    }
+
+    Time(suite, layer.get(), batch_size, false);
+
+    // Random output derivatives, as if propagated back by the next layer
+    const std::vector<std::shared_ptr<Mat<Dtype>>>& out = layer->Output();
+    for (size_t i = 0; i < out.size(); ++i) {
+      if (out[i]->deriv) {
+        Fill(out[i]->Size(), Dtype(-1), Dtype(1), out[i]->DerivData());
+      }
+    }
+
+    Time(suite, layer.get(), batch_size, true);
+    return out;
+  }
+
+  /*!
+   * Benchmark the mnist model layers (see MnistModel), convolutional network
+   * with batch normalization then fully-connected network.
+   *
+   *  \param[in]  batch_size: batch size
+   */
+  void Mnist(uint32_t batch_size) {
+    // Conv layer parameters
+    Param conv_param;
+    conv_param.Add("num_output"   , 8);
+    conv_param.Add("filter_width" , 3);
+    conv_param.Add("filter_height", 3);
+    conv_param.Add("padding_x"    , 1);
+    conv_param.Add("padding_y"    , 1);
+    conv_param.Add("stride_x"     , 1);
+    conv_param.Add("stride_y"     , 1);
+
+    // Pool layer parameters
+    Param pool_param;
+    pool_param.Add("filter_width" , 3);
+    pool_param.Add("filter_height", 3);
+    pool_param.Add("padding_x"    , 1);
+    pool_param.Add("padding_y"    , 1);
+    pool_param.Add("stride_x"     , 2);
+    pool_param.Add("stride_y"     , 2);
+
+    // BN layer parameters
+    Param bn_param;
+    bn_param.Add("moving_avg_frac", 0.99f);
+    bn_param.Add("use_scale"      , 1);
+
+    // IP layer parameters
+    Param ip_param;
+    ip_param.Add("num_output", 10);
+    Param ip_hidden_param;
+    ip_hidden_param.Add("num_output", 64);
+
+    std::shared_ptr<Mat<Dtype>> in    = Input(28, 28, 1, batch_size);
+    std::shared_ptr<Mat<Dtype>> label = Index(batch_size, 10);
+    std::shared_ptr<Mat<Dtype>> out;
+
+    // Conv1, Relu1, Pool1, BN1
+    out = Run("mnist", std::make_shared<LayerConv<Dtype>>("conv1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{in}, conv_param),
+      batch_size)[0];
+    out = Run("mnist", std::make_shared<LayerRelu<Dtype>>("relu1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}),
+      batch_size)[0];
+    out = Run("mnist", std::make_shared<LayerPoolMax<Dtype>>("pool1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, pool_param),
+      batch_size)[0];
+    out = Run("mnist", std::make_shared<LayerBatchNorm<Dtype>>("bn1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, bn_param),
+      batch_size)[0];
+
+    // Conv2, Relu2, Pool2
+    conv_param.Add("num_output", 16);
+    out = Run("mnist", std::make_shared<LayerConv<Dtype>>("conv2",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, conv_param),
+      batch_size)[0];
+    out = Run("mnist", std::make_shared<LayerRelu<Dtype>>("relu2",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}),
+      batch_size)[0];
+    out = Run("mnist", std::make_shared<LayerPoolMax<Dtype>>("pool2",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, pool_param),
+      batch_size)[0];
+
+    // IP1, Loss
+    out = Run("mnist", std::make_shared<LayerInnerProduct<Dtype>>("ip1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, ip_param),
+      batch_size)[0];
+    Run("mnist", std::make_shared<LayerSoftMaxLoss<Dtype>>("loss",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out, label}),
+      batch_size);
+
+    // Fully-connected network (-fc)
+    out = Run("mnist_fc", std::make_shared<LayerInnerProduct<Dtype>>("ip1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{in},
+      ip_hidden_param), batch_size)[0];
+    out = Run("mnist_fc", std::make_shared<LayerRelu<Dtype>>("relu1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}),
+      batch_size)[0];
+    out = Run("mnist_fc", std::make_shared<LayerInnerProduct<Dtype>>("ip2",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out},
+      ip_hidden_param), batch_size)[0];
+    out = Run("mnist_fc", std::make_shared<LayerRelu<Dtype>>("relu2",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}),
+      batch_size)[0];
+    out = Run("mnist_fc", std::make_shared<LayerInnerProduct<Dtype>>("ip3",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, ip_param),
+      batch_size)[0];
+    Run("mnist_fc", std::make_shared<LayerSoftMaxLoss<Dtype>>("loss",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out, label}),
+      batch_size);
+  }
+
+  /*!
+   * Benchmark the cifar10 model layers (see Cifar10Model), color input with
+   * batch normalization.
+   *
+   *  \param[in]  batch_size: batch size
+   */
+  void Cifar10(uint32_t batch_size) {
+    // Conv layer parameters
+    Param conv_param;
+    conv_param.Add("num_output"   , 32);
+    conv_param.Add("filter_width" , 3);
+    conv_param.Add("filter_height", 3);
+    conv_param.Add("padding_x"    , 1);
+    conv_param.Add("padding_y"    , 1);
+    conv_param.Add("stride_x"     , 1);
+    conv_param.Add("stride_y"     , 1);
+
+    // Pool layer parameters
+    Param pool_param;
+    pool_param.Add("filter_width" , 3);
+    pool_param.Add("filter_height", 3);
+    pool_param.Add("padding_x"    , 1);
+    pool_param.Add("padding_y"    , 1);
+    pool_param.Add("stride_x"     , 2);
+    pool_param.Add("stride_y"     , 2);
+
+    // BN layer parameters
+    Param bn_param;
+    bn_param.Add("moving_avg_frac", 0.99f);
+    bn_param.Add("use_scale"      , 1);
+
+    // IP layer parameters
+    Param ip_param;
+    ip_param.Add("num_output", 10);
+
+    std::shared_ptr<Mat<Dtype>> out   = Input(32, 32, 3, batch_size);
+    std::shared_ptr<Mat<Dtype>> label = Index(batch_size, 10);
+
+    // Conv1, Pool1, Relu1, BN1
+    out = Run("cifar10", std::make_shared<LayerConv<Dtype>>("conv1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, conv_param),
+      batch_size)[0];
+    out = Run("cifar10", std::make_shared<LayerPoolMax<Dtype>>("pool1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, pool_param),
+      batch_size)[0];
+    out = Run("cifar10", std::make_shared<LayerRelu<Dtype>>("relu1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}),
+      batch_size)[0];
+    out = Run("cifar10", std::make_shared<LayerBatchNorm<Dtype>>("bn1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, bn_param),
+      batch_size)[0];
+
+    // Conv2, Relu2, Pool2, BN2
+    out = Run("cifar10", std::make_shared<LayerConv<Dtype>>("conv2",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, conv_param),
+      batch_size)[0];
+    out = Run("cifar10", std::make_shared<LayerRelu<Dtype>>("relu2",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}),
+      batch_size)[0];
+    out = Run("cifar10", std::make_shared<LayerPoolMax<Dtype>>("pool2",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, pool_param),
+      batch_size)[0];
+    out = Run("cifar10", std::make_shared<LayerBatchNorm<Dtype>>("bn2",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, bn_param),
+      batch_size)[0];
+
+    // Conv3, Relu3, Pool3
+    conv_param.Add("num_output", 64);
+    out = Run("cifar10", std::make_shared<LayerConv<Dtype>>("conv3",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, conv_param),
+      batch_size)[0];
+    out = Run("cifar10", std::make_shared<LayerRelu<Dtype>>("relu3",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}),
+      batch_size)[0];
+    out = Run("cifar10", std::make_shared<LayerPoolMax<Dtype>>("pool3",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, pool_param),
+      batch_size)[0];
+
+    // IP1, Loss
+    out = Run("cifar10", std::make_shared<LayerInnerProduct<Dtype>>("ip1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, ip_param),
+      batch_size)[0];
+    Run("cifar10", std::make_shared<LayerSoftMaxLoss<Dtype>>("loss",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out, label}),
+      batch_size);
+  }
+
+  /*!
+   * Benchmark one timestep of the textgen recurrent models (see Rnn, Lstm and
+   * TextgenModel), 2 hidden layers. The layers of the second hidden layer
+   * are suffixed with 2.
+   *
+   *  \param[in]  batch_size : batch size
+   *  \param[in]  vocab_size : vocabulary size (the dataset one, plus 1)
+   *  \param[in]  embed_size : embedding size
+   *  \param[in]  hidden_size: hidden state size
+   */
+  void Textgen(uint32_t batch_size, uint32_t vocab_size, uint32_t embed_size,
+               uint32_t hidden_size) {
+    // Scale (temperature) layer parameters
+    Param scale_param;
+    scale_param.Add("scale", 0.5f);
+
+    std::shared_ptr<Mat<Dtype>> index = Index(batch_size, vocab_size);
+    std::shared_ptr<Mat<Dtype>> label = Index(batch_size, vocab_size);
+    std::shared_ptr<Mat<Dtype>> wil   = Input(vocab_size, embed_size, 1, 1);
+    std::shared_ptr<Mat<Dtype>> whd   = Input(vocab_size, hidden_size, 1, 1);
+    std::shared_ptr<Mat<Dtype>> bd    = Input(vocab_size, 1, 1, 1);
+
+    // RNN
+    std::shared_ptr<Mat<Dtype>> x = Run("rnn",
+      std::make_shared<LayerEmbed<Dtype>>("embed",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{index, wil}),
+      batch_size)[0];
+    for (uint32_t d = 0; d < 2; ++d) {
+      std::string suffix = d ? "2" : "";
+      uint32_t size_prev = d ? hidden_size : embed_size;
+      std::shared_ptr<Mat<Dtype>> h0 = Run("rnn",
+        std::make_shared<LayerMult<Dtype>>(("wxh" + suffix).c_str(),
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+        Input(hidden_size, size_prev, 1, 1), x}), batch_size)[0];
+      std::shared_ptr<Mat<Dtype>> h1 = Run("rnn",
+        std::make_shared<LayerMult<Dtype>>(("whh" + suffix).c_str(),
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+        Input(hidden_size, hidden_size, 1, 1),
+        Input(hidden_size, 1, 1, batch_size)}), batch_size)[0];
+      std::shared_ptr<Mat<Dtype>> h01 = Run("rnn",
+        std::make_shared<LayerAdd<Dtype>>(("h01" + suffix).c_str(),
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{h0, h1}),
+        batch_size)[0];
+      std::shared_ptr<Mat<Dtype>> bias = Run("rnn",
+        std::make_shared<LayerAdd<Dtype>>(("bhh" + suffix).c_str(),
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{h01,
+        Input(hidden_size, 1, 1, 1)}), batch_size)[0];
+      x = Run("rnn", std::make_shared<LayerRelu<Dtype>>(
+        ("relu" + suffix).c_str(),
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{bias}),
+        batch_size)[0];
+    }
+    Decoder("rnn", x, whd, bd, label, scale_param, batch_size);
+
+    // LSTM
+    x = Run("lstm", std::make_shared<LayerEmbed<Dtype>>("embed",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{index, wil}),
+      batch_size)[0];
+    for (uint32_t d = 0; d < 2; ++d) {
+      std::string suffix = d ? "2" : "";
+      uint32_t size_prev = d ? hidden_size : embed_size;
+      x = Run("lstm", std::make_shared<LayerLstmCell<Dtype>>(
+        ("lstm" + suffix).c_str(),
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{x,
+        Input(hidden_size, 1, 1, batch_size),
+        Input(hidden_size, 1, 1, batch_size),
+        Input(4 * hidden_size, size_prev + hidden_size, 1, 1),
+        Input(4 * hidden_size, 1, 1, 1)}), batch_size)[0];
+    }
+    Decoder("lstm", x, whd, bd, label, scale_param, batch_size);
+  }
+
+  /*!
+   * Benchmark the decoder of a textgen recurrent model: decoder weights and
+   * bias, temperature and softmax.
+   *
+   *  \param[in]  suite      : suite name
+   *  \param[in]  hidden     : last hidden state
+   *  \param[in]  whd        : decoder weights
+   *  \param[in]  bd         : decoder bias
+   *  \param[in]  label      : labels
+   *  \param[in]  scale_param: scale (temperature) layer parameters
+   *  \param[in]  batch_size : batch size
+   */
+  void Decoder(const char* suite, const std::shared_ptr<Mat<Dtype>>& hidden,
+               const std::shared_ptr<Mat<Dtype>>& whd,
+               const std::shared_ptr<Mat<Dtype>>& bd,
+               const std::shared_ptr<Mat<Dtype>>& label,
+               const Param& scale_param, uint32_t batch_size) {
+    std::shared_ptr<Mat<Dtype>> out;
+    out = Run(suite, std::make_shared<LayerMult<Dtype>>("whd",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{whd, hidden}),
+      batch_size)[0];
+    out = Run(suite, std::make_shared<LayerAdd<Dtype>>("bd",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out, bd}),
+      batch_size)[0];
+    out = Run(suite, std::make_shared<EltwiseScaleLayer<Dtype>>("scale",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out}, scale_param),
+      batch_size)[0];
+    Run(suite, std::make_shared<LayerSoftMaxLoss<Dtype>>("softmax",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out, label}),
+      batch_size);
+  }
+
+  /*!
+   * Benchmark the core layers the sandbox models don't use, at the shape of
+   * the cifar10 first hidden layer (32x16x16).
+   *
+   *  \param[in]  batch_size: batch size
+   */
+  void Other(uint32_t batch_size) {
+    // Pool layer parameters
+    Param pool_param;
+    pool_param.Add("filter_width" , 3);
+    pool_param.Add("filter_height", 3);
+    pool_param.Add("padding_x"    , 1);
+    pool_param.Add("padding_y"    , 1);
+    pool_param.Add("stride_x"     , 2);
+    pool_param.Add("stride_y"     , 2);
+
+    // Dropout layer parameters
+    Param dropout_param;
+    dropout_param.Add("prob", 0.5f);
+
+    // Scale layer parameters
+    Param scale_param;
+
+    std::shared_ptr<Mat<Dtype>> in  = Input(16, 16, 32, batch_size);
+    std::shared_ptr<Mat<Dtype>> in2 = Input(16, 16, 32, batch_size);
+
+    Run("other", std::make_shared<LayerSigmoid<Dtype>>("sigmoid",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{in}), batch_size);
+    Run("other", std::make_shared<LayerTanh<Dtype>>("tanh",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{in}), batch_size);
+    Run("other", std::make_shared<LayerEltwiseMult<Dtype>>("eltwise_mult",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{in, in2}),
+      batch_size);
+    Run("other", std::make_shared<LayerScale<Dtype>>("scale",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{in}, scale_param),
+      batch_size);
+    Run("other", std::make_shared<LayerPoolAvg<Dtype>>("pool_avg",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{in}, pool_param),
+      batch_size);
+    Run("other", std::make_shared<LayerDropout<Dtype>>("dropout",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{in}, dropout_param),
+      batch_size);
+    Run("other", std::make_shared<LayerEuclideanLoss<Dtype>>("euclidean_loss",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{in, in2}),
+      batch_size);
+  }
+
+  /*!
+   * Check that the Winograd convolution gives the same outputs as the im2col
+   * one with the same weights, including after the weights are changed
+   * without a backward pass (the transformed filters are cached, see
+   * Layer::InvalidateCache).
+   *
+   *  \return     Outputs matching?
+   */
+  bool CheckConv() {
+    // 3x3, stride 1 conv layer parameters, with and without Winograd
+    Param conv_param;
+    conv_param.Add("num_output"   , 16);
+    conv_param.Add("filter_width" , 3);
+    conv_param.Add("filter_height", 3);
+    conv_param.Add("padding_x"    , 1);
+    conv_param.Add("padding_y"    , 1);
+    conv_param.Add("stride_x"     , 1);
+    conv_param.Add("stride_y"     , 1);
+    Param col_param = conv_param;
+    col_param.Add("use_winograd", 0);
+
+    std::shared_ptr<Mat<Dtype>> in = Input(16, 16, 8, 4);
+    LayerConv<Dtype> conv("conv", {in}, conv_param);
+    LayerConv<Dtype> col("conv_col", {in}, col_param);
+    std::vector<std::shared_ptr<Mat<Dtype>>> conv_weight, col_weight;
+    conv.GetWeight(&conv_weight);
+    col.GetWeight(&col_weight);
+
+    State state(State::PHASE_TEST);
+    Dtype diff = Dtype(0);
+    for (uint32_t step = 0; step < 2; ++step) {
+      // New weights, shared by both layers
+      for (size_t i = 0; i < conv_weight.size(); ++i) {
+        Fill(conv_weight[i]->Size(), Dtype(-1), Dtype(1),
+             conv_weight[i]->Data());
+        std::copy(conv_weight[i]->Data(),
+                  conv_weight[i]->Data() + conv_weight[i]->Size(),
+                  col_weight[i]->Data());
+      }
+      conv.InvalidateCache();
+      conv.Forward(state);
+      col.Forward(state);
+      const Dtype* conv_data = conv.Output()[0]->Data();
+      const Dtype* col_data  = col.Output()[0]->Data();
+      for (uint32_t i = 0; i < conv.Output()[0]->Size(); ++i) {
+        diff = std::max(diff, std::abs(conv_data[i] - col_data[i]));
+      }
+    }
+
+    Report(diff < Dtype(1e-3) ? kInfo : kError,
+           "Conv Winograd/im2col max difference: %f", diff);
+    return diff < Dtype(1e-3);
+  }
+
+  /*!
+   * Print the header of the results table.
+   */
+  static void PrintHeader() {
+    Report(kInfo, "%-24s %5s %-8s %9s %9s %9s %9s %8s %8s %8s",
+           "Layer", "Batch", "Phase", "Min (ms)", "Mean", "Median", "P99",
+           "StdDev", "GFLOP/s", "GB/s");
+  }
+
+  /*!
+   * Print a result.
+   *
+   *  \param[in]  result: result
+   */
+  static void Print(const Result& result) {
+    std::string name = result.suite + "/" + result.name;
+    Report(kInfo, "%-24s %5u %-8s %9.4f %9.4f %9.4f %9.4f %8.4f %8.2f %8.2f",
+           name.c_str(), result.batch_size, result.phase, result.min * 1e3,
+           result.mean * 1e3, result.median * 1e3, result.p99 * 1e3,
+           result.std_dev * 1e3,
+           result.median > 0. ? result.flop / result.median * 1e-9 : 0.,
+           result.median > 0. ? result.byte / result.median * 1e-9 : 0.);
+  }
+
+  /*!
+   * Write the results as JSON, one object per benchmarked pass (times in
+   * milliseconds).
+   *
+   *  \param[in]  file_name: file name
+   *
+   *  \return     Error?
+   */
+  bool Write(const char* file_name) const {
+    std::FILE* file = std::fopen(file_name, "wt");
+    if (!file) {
+      Report(kWarning, "Can't write the benchmark to '%s'", file_name);
+      return false;
+    }
+
+    std::fprintf(file, "{\n\"num_thread\": %u,\n\"num_warmup\": %u,\n"
+                 "\"num_rep\": %u,\n\"dtype_size\": %u,\n\"results\": [",
+                 ThreadPool::NumThread(), num_warmup_, num_rep_,
+                 uint32_t(sizeof(Dtype)));
+    for (size_t i = 0; i < result_.size(); ++i) {
+      const Result& result = result_[i];
+      std::fprintf(file, "%s\n{\"suite\": \"%s\", \"layer\": \"%s\", "
+                   "\"batch_size\": %u, \"input\": [%u, %u, %u, %u], "
+                   "\"phase\": \"%s\", \"min_ms\": %.6f, \"mean_ms\": %.6f, "
+                   "\"median_ms\": %.6f, \"p99_ms\": %.6f, "
+                   "\"std_dev_ms\": %.6f, \"flop\": %llu, \"byte\": %llu}",
+                   i ? "," : "", result.suite.c_str(), result.name.c_str(),
+                   result.batch_size, result.size[0], result.size[1],
+                   result.size[2], result.size[3], result.phase,
+                   result.min * 1e3, result.mean * 1e3, result.median * 1e3,
+                   result.p99 * 1e3, result.std_dev * 1e3,
+                   static_cast<unsigned long long>(result.flop),  // NOLINT
+                   static_cast<unsigned long long>(result.byte));  // NOLINT
+    }
+    std::fprintf(file, "\n]\n}\n");
+
+    std::fclose(file);
+    return true;
+  }
+};
+
+
+}  // namespace jik
+
+
+int main(int argc, char* argv[]) {
+  using namespace jik;  // NOLINT(build/namespaces)
+
+  // 32-bit float quantization
+  typedef float Dtype;
+
+  // Parameters
+  ArgParse arg(argc, argv);
+  const char* json_path  = arg.Arg("-json");
+  const char* filter     = arg.Arg("-filter");
+  const char* batch_list = arg.Arg("-batchsizes");
+  uint32_t num_warmup, num_rep, num_thread;
+  uint32_t vocab_size, embed_size, hs;
+  arg.Arg<uint32_t>("-warmup"   , 3 , &num_warmup);
+  arg.Arg<uint32_t>("-rep"      , 20, &num_rep);
+  arg.Arg<uint32_t>("-threads"  , 0 , &num_thread);
+  arg.Arg<uint32_t>("-vocabsize", 64, &vocab_size);
+  arg.Arg<uint32_t>("-embedsize", 5 , &embed_size);
+  arg.Arg<uint32_t>("-hs"       , 20, &hs);
+  bool check = arg.ArgExists("-check");
+
+  if (arg.ArgExists("-h")) {
+    Report(kInfo, "Usage: %s [-json <path/to/result.json>] "
+           "[-filter <suite/layer>] [-batchsizes <b0,b1,...>] [-warmup <n>] "
+           "[-rep <n>] [-threads <n>] [-check]", argv[0]);
+    return -1;
+  }
+
+  // Batch sizes to sweep (the sandbox models default to 128)
+  std::vector<uint32_t> batch_size;
+  if (!batch_list) {
+    batch_list = "1,32,128";
+  }
+  for (const char* str = batch_list; *str;) {
+    char* end;
+    uint32_t size = uint32_t(std::strtoul(str, &end, 10));
+    if (end == str || !size) {
+      Report(kError, "Invalid batch sizes '%s'", batch_list);
+      return -1;
+    }
+    batch_size.push_back(size);
+    str = *end == ',' ? end + 1 : end;
+  }
+
+  // Printing parameters
+  Report(kInfo, "Warmup calls            : %d", num_warmup);
+  Report(kInfo, "Timed calls             : %d", num_rep);
+  Report(kInfo, "Batch sizes             : %s", batch_list);
+  Report(kInfo, "Vocabulary size         : %d", vocab_size);
+  Report(kInfo, "Embedding size          : %d", embed_size);
+  Report(kInfo, "Hidden size             : %d", hs);
+
+  // Threads
+  if (num_thread) {
+    ThreadPool::SetNumThread(num_thread);
+  }
+  Report(kInfo, "Number of threads       : %d", ThreadPool::NumThread());
+
+  // Benchmark the layers of each suite, for each batch size
+  // Or only check the layers consistency
+  Bench<Dtype> bench(num_warmup, num_rep, filter);
+  if (check) {
+    return bench.CheckConv() ? 0 : -1;
+  }
+  Bench<Dtype>::PrintHeader();
+  for (size_t i = 0; i < batch_size.size(); ++i) {
+    bench.Mnist(batch_size[i]);
+    bench.Cifar10(batch_size[i]);
+    bench.Textgen(batch_size[i], vocab_size, embed_size, hs);
+    bench.Other(batch_size[i]);
+  }
+
+  if (json_path && !bench.Write(json_path)) {
+    return -1;
+  }
+
+  return 0;
+}
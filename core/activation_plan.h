@@ -0,0 +1,286 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_ACTIVATION_PLAN_H_
+#define CORE_ACTIVATION_PLAN_H_
+
+
+#include <core/layer.h>
+#include <core/layer_data.h>
+#include <core/mat.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  ActivationPlan
+ *  \brief  Activations memory planner (forward pass only)
+ *
+ * The lifetime of each activation (output of a layer) is calculated over
+ * the list of layers: it is live from the layer producing it to the last
+ * layer reading it. Activations whose lifetimes don't overlap share the same
+ * buffer of a small arena, so a forward pass only holds the live
+ * activations at once.
+ *
+ * The activations are not stored in between: an activation gets its buffer
+ * right before the layer producing it runs and gives it back right after
+ * its last reader ran. The outputs of the data layers, the activations no
+ * layer reads (outputs of the graph) and the ones to keep (e.g. model
+ * input/output) are not planned and keep their own storage. The outputs
+ * being views of an input (see Layer::ViewOf) extend the lifetime of this
+ * input instead and lose their own storage.
+ *
+ * Since the activations are gone after the forward pass, there's no
+ * backward pass once planned.
+ */
+template <typename Dtype>
+class ActivationPlan {
+  // Public types
+ public:
+  typedef Dtype Type;
+
+
+  // Protected types
+ protected:
+  typedef typename Mat<Dtype>::Storage Storage;
+
+  /*!
+   * Planned activation.
+   */
+  struct Tensor {
+    std::shared_ptr<Mat<Dtype>> mat;   // Activation
+    size_t                      size;  // Size (number of elements)
+    size_t                      def;   // Layer producing it
+    size_t                      last;  // Last layer reading it
+    size_t                      slot;  // Arena buffer
+  };
+
+
+  // Protected attributes
+ protected:
+  std::vector<Tensor>                tensor_;   // Planned activations
+  std::vector<std::shared_ptr<Mat<Dtype>>>
+                                     view_;     // Activations being views
+  std::vector<std::vector<size_t>>   acquire_;  // Activations per producer
+  std::vector<std::vector<size_t>>   release_;  // Activations per last reader
+  std::vector<Storage>               slot_;     // Arena buffers
+  size_t                             size_;     // Planned activations size
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  ActivationPlan() {
+    size_ = 0;
+  }
+
+  /*!
+   * Create the plan of a list of layers (run in order) and release the
+   * storage of the planned activations.
+   *
+   *  \param[in]  layer: layers
+   *  \param[in]  keep : activations to keep
+   */
+  void Create(const std::vector<std::shared_ptr<Layer<Dtype>>>& layer,
+              const std::vector<std::shared_ptr<Mat<Dtype>>>& keep) {
+    tensor_.clear();
+    view_.clear();
+    size_ = 0;
+
+    // Lifetimes
+    std::map<const Mat<Dtype>*, size_t> index;
+    for (size_t i = 0; i < layer.size(); ++i) {
+      for (const std::shared_ptr<Mat<Dtype>>& in : layer[i]->Input()) {
+        auto it = index.find(in.get());
+        if (it != index.end()) {
+          tensor_[it->second].last = i;
+        }
+      }
+      if (std::dynamic_pointer_cast<LayerData<Dtype>>(layer[i])) {
+        continue;
+      }
+      const std::vector<std::shared_ptr<Mat<Dtype>>>& out =
+        layer[i]->Output();
+      for (size_t o = 0; o < out.size(); ++o) {
+        if (index.count(out[o].get()) ||
+            std::find(keep.begin(), keep.end(), out[o]) != keep.end()) {
+          continue;
+        }
+
+        // A view of an input: reading it is reading the input, its own
+        // storage is never used
+        int view = layer[i]->ViewOf(o);
+        if (view >= 0) {
+          auto it = index.find(layer[i]->Input()[view].get());
+          if (it != index.end()) {
+            index[out[o].get()] = it->second;
+          }
+          view_.push_back(out[o]);
+          continue;
+        }
+
+        index[out[o].get()] = tensor_.size();
+        tensor_.push_back({out[o], out[o]->ShapeSize(), i, i, 0});
+      }
+    }
+
+    // Activations nobody reads are outputs of the graph: not planned
+    tensor_.erase(std::remove_if(tensor_.begin(), tensor_.end(),
+                                 [](const Tensor& t) {
+      return t.last == t.def;
+    }), tensor_.end());
+
+    acquire_.assign(layer.size(), std::vector<size_t>());
+    release_.assign(layer.size(), std::vector<size_t>());
+    for (size_t t = 0; t < tensor_.size(); ++t) {
+      acquire_[tensor_[t].def].push_back(t);
+      release_[tensor_[t].last].push_back(t);
+    }
+
+    // Assign the buffers, in order: the outputs of a layer get a free
+    // buffer (the smallest one big enough, or the biggest one to grow it),
+    // then the inputs it was the last reader of free theirs
+    std::vector<size_t> capacity;
+    std::vector<size_t> free_slot;
+    for (size_t i = 0; i < layer.size(); ++i) {
+      for (size_t t : acquire_[i]) {
+        Tensor& tensor = tensor_[t];
+        size_t best    = free_slot.size();
+        for (size_t f = 0; f < free_slot.size(); ++f) {
+          if (best == free_slot.size()) {
+            best = f;
+            continue;
+          }
+          size_t cap      = capacity[free_slot[f]];
+          size_t best_cap = capacity[free_slot[best]];
+          if (cap >= tensor.size ? best_cap < tensor.size || cap < best_cap :
+                                   best_cap < tensor.size && cap > best_cap) {
+            best = f;
+          }
+        }
+        if (best == free_slot.size()) {
+          tensor.slot = capacity.size();
+          capacity.push_back(tensor.size);
+        } else {
+          tensor.slot = free_slot[best];
+          free_slot.erase(free_slot.begin() + best);
+          capacity[tensor.slot] = std::max(capacity[tensor.slot],
+                                           tensor.size);
+        }
+      }
+      for (size_t t : release_[i]) {
+        free_slot.push_back(tensor_[t].slot);
+      }
+    }
+
+    // Release the activations storage (back to the pool) and create the
+    // arena (reusing the capacity of the previous one, if any, e.g. when
+    // the batch size changes)
+    for (Tensor& tensor : tensor_) {
+      size_ += tensor.size;
+      Storage().swap(tensor.mat->data);
+    }
+    for (const std::shared_ptr<Mat<Dtype>>& mat : view_) {
+      size_ += mat->ShapeSize();
+      Storage().swap(mat->data);
+    }
+    slot_.resize(capacity.size());
+    for (size_t s = 0; s < slot_.size(); ++s) {
+      slot_[s].reserve(capacity[s]);
+    }
+  }
+
+  /*!
+   * Check if the plan is empty.
+   *
+   *  \return Empty?
+   */
+  bool Empty() const {
+    return tensor_.empty() && view_.empty();
+  }
+
+  /*!
+   * Get the memory size of the planned activations (if they were stored).
+   *
+   *  \return Memory size (in bytes)
+   */
+  size_t ActivationSize() const {
+    return size_ * sizeof(Dtype);
+  }
+
+  /*!
+   * Get the memory size of the arena.
+   *
+   *  \return Memory size (in bytes)
+   */
+  size_t ArenaSize() const {
+    size_t size = 0;
+    for (const Storage& slot : slot_) {
+      size += slot.capacity();
+    }
+    return size * sizeof(Dtype);
+  }
+
+  /*!
+   * Give their buffers to the outputs of a layer, before running it.
+   *
+   *  \param[in]  i: layer index
+   */
+  void Acquire(size_t i) {
+    for (size_t t : acquire_[i]) {
+      Tensor& tensor = tensor_[t];
+      tensor.mat->data.swap(slot_[tensor.slot]);
+      tensor.mat->data.resize(tensor.size);
+    }
+  }
+
+  /*!
+   * Take back the buffers of the activations a layer was the last reader
+   * of, after running it.
+   *
+   *  \param[in]  i: layer index
+   */
+  void Release(size_t i) {
+    for (size_t t : release_[i]) {
+      Tensor& tensor = tensor_[t];
+      tensor.mat->data.swap(slot_[tensor.slot]);
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_ACTIVATION_PLAN_H_
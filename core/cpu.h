@@ -0,0 +1,172 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_CPU_H_
+#define CORE_CPU_H_
+
+
+#include <core/log.h>
+#include <cstdlib>
+#include <cstring>
+
+
+// Compiler support for per-function instruction sets (x86 GCC/Clang):
+// the kernels are compiled for each instruction set and the best one
+// supported by the CPU is picked at runtime
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define JIK_CPU_DISPATCH
+#define JIK_INLINE         inline __attribute__((always_inline))
+#ifdef __clang__
+#define JIK_TARGET_AVX2    __attribute__((target("avx2,fma")))
+#define JIK_TARGET_AVX512  __attribute__((target("avx512f,avx2,fma")))
+#else
+#define JIK_TARGET_AVX2    __attribute__((target("avx2,fma")))
+#define JIK_TARGET_AVX512  \
+  __attribute__((target("avx512f,avx2,fma,prefer-vector-width=512")))
+#endif
+#else
+#define JIK_INLINE         inline
+#define JIK_TARGET_AVX2
+#define JIK_TARGET_AVX512
+#endif
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Cpu
+ *  \brief  CPU features detection
+ *
+ * The instruction set is detected once (cpuid). It can be forced with the
+ * JIK_ISA environment variable ("sse", "avx2" or "avx512"), e.g. to
+ * benchmark each level; an instruction set the CPU does not support is
+ * ignored.
+ */
+class Cpu {
+  // Public types
+ public:
+  /*!
+   *  \enum   Isa
+   *  \brief  Instruction sets, ordered from the least to the most capable
+   */
+  enum Isa {
+    ISA_SSE = 0,  // Compilation flags (SSE 4.2)
+    ISA_AVX2,     // AVX2 + FMA, 256-bit vectors
+    ISA_AVX512    // AVX-512F, 512-bit vectors
+  };
+
+
+  // Public methods
+ public:
+  /*!
+   * Get the instruction set to use.
+   *
+   *  \return Instruction set
+   */
+  static Isa GetIsa() {
+    static const Isa isa = SelectIsa();
+    return isa;
+  }
+
+  /*!
+   * Get the best instruction set supported by the CPU.
+   *
+   *  \return Instruction set
+   */
+  static Isa DetectIsa() {
+#ifdef JIK_CPU_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      return ISA_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      return ISA_AVX2;
+    }
+#endif  // JIK_CPU_DISPATCH
+    return ISA_SSE;
+  }
+
+  /*!
+   * Get an instruction set name.
+   *
+   *  \param[in]  isa: instruction set
+   *
+   *  \return     Instruction set name
+   */
+  static const char* IsaName(Isa isa) {
+    switch (isa) {
+      case ISA_AVX512: {
+        return "avx512";
+      }
+      case ISA_AVX2: {
+        return "avx2";
+      }
+      default: {
+        return "sse";
+      }
+    }
+  }
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Select the instruction set: the detected one, unless overridden by
+   * the JIK_ISA environment variable.
+   *
+   *  \return Instruction set
+   */
+  static Isa SelectIsa() {
+    Isa isa = DetectIsa();
+
+    const char* env = std::getenv("JIK_ISA");
+    if (!env || !*env) {
+      return isa;
+    }
+
+    for (int i = ISA_SSE; i <= ISA_AVX512; ++i) {
+      if (!std::strcmp(env, IsaName(Isa(i)))) {
+        if (i > isa) {
+          Report(kWarning, "Instruction set '%s' not supported, using '%s'",
+                 env, IsaName(isa));
+          return isa;
+        }
+        return Isa(i);
+      }
+    }
+
+    Report(kWarning, "Unknown instruction set '%s', using '%s'",
+           env, IsaName(isa));
+    return isa;
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_CPU_H_
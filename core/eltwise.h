@@ -0,0 +1,585 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+#ifndef CORE_ELTWISE_H_
+#define CORE_ELTWISE_H_
+
+
+#include <core/cpu.h>
+#include <core/thread_pool.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+
+
+namespace jik {
+
+
+/*!
+ * Element-wise kernels.
+ *
+ * Every kernel is a loop over a contiguous range with size_t indexing,
+ * written so the compiler vectorizes it. The loops are compiled for each
+ * instruction set (see Cpu) and the best variant is picked at runtime.
+ *
+ * The exp/log/tanh/sigmoid approximations below are branchless so they
+ * vectorize too. They are specialized for float; other types use the
+ * standard library. The error bounds were measured against the double
+ * precision standard library on a dense sweep of the range, with the
+ * release flags (-ffast-math).
+ */
+
+
+// Minimum number of elements per thread of the element-wise operations
+const size_t kEltwiseGrain = 0x8000;
+
+
+/*!
+ * Reinterpret the bits of a float as an integer (and the other way).
+ */
+JIK_INLINE int32_t FloatAsInt(float x) {
+  int32_t i;
+  std::memcpy(&i, &x, sizeof(i));
+  return i;
+}
+
+JIK_INLINE float IntAsFloat(int32_t i) {
+  float x;
+  std::memcpy(&x, &i, sizeof(x));
+  return x;
+}
+
+
+/*!
+ * Exponential approximation.
+ * Range reduction exp(x) = 2^n * exp(r) with |r| <= ln(2) / 2, then a
+ * degree 6 polynomial for exp(r) (Cephes coefficients).
+ * The input is clamped to [-87.3, 88]: there is no overflow to infinity
+ * and no denormal result.
+ *
+ * Error bound (float): relative error < 1.5e-7 (~1 ulp) over the whole
+ * clamped range.
+ *
+ *  \param[in]  x: value
+ *
+ *  \return     exp(x)
+ */
+template <typename Dtype>
+JIK_INLINE Dtype ExpApprox(Dtype x) {
+  return std::exp(x);
+}
+
+template <>
+JIK_INLINE float ExpApprox(float x) {
+  x = std::min(std::max(x, -87.3f), 88.0f);
+
+  // x = n * ln(2) + r
+  // ln(2) is split in 2 constants (Cody-Waite): n * c1 is exact, and so is
+  // x - n * c1. The min (a no-op, |x - n * c1| < 1) keeps -ffast-math from
+  // reordering the 2 subtractions, which would lose the precision of x
+  float   n  = std::floor(x * 1.44269504088896341f + 0.5f);
+  int32_t ni = int32_t(n);
+  float   r  = std::min(x - n * 0.693359375f, 1.0f) + n * 2.12194440e-4f;
+
+  // exp(r)
+  float p = 1.9875691500e-4f;
+  p = p * r + 1.3981999507e-3f;
+  p = p * r + 8.3334519073e-3f;
+  p = p * r + 4.1665795894e-2f;
+  p = p * r + 1.6666665459e-1f;
+  p = p * r + 5.0000001201e-1f;
+  p = p * r * r + r + 1.0f;
+
+  // 2^n * exp(r)
+  return p * IntAsFloat((ni + 127) << 23);
+}
+
+
+/*!
+ * Natural logarithm approximation.
+ * Decomposition log(x) = e * ln(2) + log(m) with m in [sqrt(0.5), sqrt(2)[,
+ * then a degree 9 polynomial for log(m).
+ * The input is clamped to the smallest normal float: log(0) returns
+ * about -87.3 instead of -infinity.
+ *
+ * Error bound (float): absolute error < 1e-7 for x in [0.5, 2],
+ * relative error < 3e-7 elsewhere.
+ *
+ *  \param[in]  x: value (> 0)
+ *
+ *  \return     log(x)
+ */
+template <typename Dtype>
+JIK_INLINE Dtype LogApprox(Dtype x) {
+  return std::log(x);
+}
+
+template <>
+JIK_INLINE float LogApprox(float x) {
+  x = std::max(x, 1.17549435e-38f);
+
+  // x = 2^e * m with m in [0.5, 1[
+  int32_t i = FloatAsInt(x);
+  float   e = float(((i >> 23) & 0xff) - 126);
+  float   m = IntAsFloat((i & 0x007fffff) | 0x3f000000);
+
+  // m in [sqrt(0.5), sqrt(2)[, minus 1
+  bool small = m < 0.707106781186547524f;
+  e = small ? e - 1.0f : e;
+  m = small ? m + m - 1.0f : m - 1.0f;
+
+  // log(1 + m)
+  float z = m * m;
+  float p = 7.0376836292e-2f;
+  p = p * m - 1.1514610310e-1f;
+  p = p * m + 1.1676998740e-1f;
+  p = p * m - 1.2420140846e-1f;
+  p = p * m + 1.4249322787e-1f;
+  p = p * m - 1.6668057665e-1f;
+  p = p * m + 2.0000714765e-1f;
+  p = p * m - 2.4999993993e-1f;
+  p = p * m + 3.3333331174e-1f;
+  p = p * m * z;
+  p = p - e * 2.12194440e-4f - 0.5f * z;
+
+  // e * ln(2) + log(1 + m)
+  return m + p + e * 0.693359375f;
+}
+
+
+/*!
+ * Hyperbolic tangent approximation.
+ * A degree 9 odd polynomial for |x| < 0.625, and
+ * 1 - 2 / (exp(2 * |x|) + 1) (with the sign of x) otherwise.
+ *
+ * Error bound (float): absolute error < 1e-7, relative error < 2e-7.
+ *
+ *  \param[in]  x: value
+ *
+ *  \return     tanh(x)
+ */
+template <typename Dtype>
+JIK_INLINE Dtype TanhApprox(Dtype x) {
+  return std::tanh(x);
+}
+
+template <>
+JIK_INLINE float TanhApprox(float x) {
+  float a = std::fabs(x);
+
+  // Small values: polynomial
+  float z = x * x;
+  float p = -5.70498872745e-3f;
+  p = p * z + 2.06390887954e-2f;
+  p = p * z - 5.37397155531e-2f;
+  p = p * z + 1.33314422036e-1f;
+  p = p * z - 3.33332819422e-1f;
+  p = p * z * x + x;
+
+  // Large values: exponential
+  float t = 1.0f - 2.0f / (ExpApprox(a + a) + 1.0f);
+  t = (x < 0.0f) ? -t : t;
+
+  return (a < 0.625f) ? p : t;
+}
+
+
+/*!
+ * Sigmoid approximation: 1 / (1 + exp(-x)), using ExpApprox.
+ *
+ * Error bound (float): relative error < 2e-7.
+ *
+ *  \param[in]  x: value
+ *
+ *  \return     sigmoid(x)
+ */
+template <typename Dtype>
+JIK_INLINE Dtype SigmoidApprox(Dtype x) {
+  return Dtype(1) / (Dtype(1) + ExpApprox(-x));
+}
+
+
+/*!
+ * Loop over a range: op(i) for i in [0, n[.
+ * This is inlined in each instruction set variant below, so the loop
+ * (and op, when it is inlined) is vectorized for that instruction set.
+ * The variants take op by value: the pointers it captures are then local
+ * to the variant and stay in registers. Through a reference, they would be
+ * reloaded after each store (-fno-strict-aliasing), which prevents the
+ * vectorization.
+ *
+ *  \param[in]  n : range size
+ *  \param[in]  op: operation on index i
+ */
+template <class Op>
+JIK_INLINE void EltwiseLoop(size_t n, const Op& op) {
+  for (size_t i = 0; i < n; ++i) {
+    op(i);
+  }
+}
+
+template <class Op>
+void EltwiseLoopSse(size_t n, Op op) {
+  EltwiseLoop(n, op);
+}
+
+template <class Op>
+JIK_TARGET_AVX2 void EltwiseLoopAvx2(size_t n, Op op) {
+  EltwiseLoop(n, op);
+}
+
+template <class Op>
+JIK_TARGET_AVX512 void EltwiseLoopAvx512(size_t n, Op op) {
+  EltwiseLoop(n, op);
+}
+
+
+/*!
+ * Reduction over a range: sum of op(i) for i in [0, n[.
+ * Same per instruction set variants as EltwiseLoop.
+ *
+ *  \param[in]  n : range size
+ *  \param[in]  op: operation on index i
+ *
+ *  \return     Sum
+ */
+template <typename Dtype, class Op>
+JIK_INLINE Dtype EltwiseReduceLoop(size_t n, const Op& op) {
+  Dtype sum = Dtype(0);
+  for (size_t i = 0; i < n; ++i) {
+    sum += op(i);
+  }
+  return sum;
+}
+
+template <typename Dtype, class Op>
+Dtype EltwiseReduceSse(size_t n, Op op) {
+  return EltwiseReduceLoop<Dtype>(n, op);
+}
+
+template <typename Dtype, class Op>
+JIK_TARGET_AVX2 Dtype EltwiseReduceAvx2(size_t n, Op op) {
+  return EltwiseReduceLoop<Dtype>(n, op);
+}
+
+template <typename Dtype, class Op>
+JIK_TARGET_AVX512 Dtype EltwiseReduceAvx512(size_t n, Op op) {
+  return EltwiseReduceLoop<Dtype>(n, op);
+}
+
+
+/*!
+ * Double reduction over a range: sums of op1(i) and op2(i) for i in [0, n[,
+ * in a single pass. Same per instruction set variants as EltwiseLoop.
+ *
+ *  \param[in]  n   : range size
+ *  \param[in]  op1 : first operation on index i
+ *  \param[in]  op2 : second operation on index i
+ *
+ *  \param[out] sum1: first sum
+ *  \param[out] sum2: second sum
+ */
+template <typename Dtype, class Op1, class Op2>
+JIK_INLINE void EltwiseReduce2Loop(size_t n, const Op1& op1, const Op2& op2,
+                                   Dtype* sum1, Dtype* sum2) {
+  Dtype s1 = Dtype(0);
+  Dtype s2 = Dtype(0);
+  for (size_t i = 0; i < n; ++i) {
+    s1 += op1(i);
+    s2 += op2(i);
+  }
+  *sum1 = s1;
+  *sum2 = s2;
+}
+
+template <typename Dtype, class Op1, class Op2>
+void EltwiseReduce2Sse(size_t n, Op1 op1, Op2 op2, Dtype* sum1, Dtype* sum2) {
+  EltwiseReduce2Loop(n, op1, op2, sum1, sum2);
+}
+
+template <typename Dtype, class Op1, class Op2>
+JIK_TARGET_AVX2 void EltwiseReduce2Avx2(size_t n, Op1 op1, Op2 op2,
+                                        Dtype* sum1, Dtype* sum2) {
+  EltwiseReduce2Loop(n, op1, op2, sum1, sum2);
+}
+
+template <typename Dtype, class Op1, class Op2>
+JIK_TARGET_AVX512 void EltwiseReduce2Avx512(size_t n, Op1 op1, Op2 op2,
+                                            Dtype* sum1, Dtype* sum2) {
+  EltwiseReduce2Loop(n, op1, op2, sum1, sum2);
+}
+
+
+/*!
+ * Run an element-wise operation: op(i) for i in [0, n[, using the
+ * variant matching the CPU instruction set.
+ * Large ranges are split into sub-ranges of at least kEltwiseGrain
+ * indices run in parallel (see ParallelRange).
+ *
+ *  \param[in]  n : range size
+ *  \param[in]  op: operation on index i
+ */
+template <class Op>
+void EltwiseFor(size_t n, const Op& op) {
+  ParallelRange(0, n, kEltwiseGrain, [&op](size_t begin, size_t end) {
+    auto op_range = [op, begin](size_t i) {
+      op(begin + i);
+    };
+    switch (Cpu::GetIsa()) {
+      case Cpu::ISA_AVX512: {
+        EltwiseLoopAvx512(end - begin, op_range);
+        break;
+      }
+      case Cpu::ISA_AVX2: {
+        EltwiseLoopAvx2(end - begin, op_range);
+        break;
+      }
+      default: {
+        EltwiseLoopSse(end - begin, op_range);
+        break;
+      }
+    }
+  });
+}
+
+
+/*!
+ * Run a reduction: sum of op(i) for i in [0, n[, using the variant
+ * matching the CPU instruction set.
+ *
+ *  \param[in]  n : range size
+ *  \param[in]  op: operation on index i
+ *
+ *  \return     Sum
+ */
+template <typename Dtype, class Op>
+Dtype EltwiseReduce(size_t n, const Op& op) {
+  switch (Cpu::GetIsa()) {
+    case Cpu::ISA_AVX512: {
+      return EltwiseReduceAvx512<Dtype>(n, op);
+    }
+    case Cpu::ISA_AVX2: {
+      return EltwiseReduceAvx2<Dtype>(n, op);
+    }
+    default: {
+      return EltwiseReduceSse<Dtype>(n, op);
+    }
+  }
+}
+
+
+/*!
+ * Run a double reduction: sums of op1(i) and op2(i) for i in [0, n[, in a
+ * single pass, using the variant matching the CPU instruction set.
+ *
+ *  \param[in]  n   : range size
+ *  \param[in]  op1 : first operation on index i
+ *  \param[in]  op2 : second operation on index i
+ *
+ *  \param[out] sum1: first sum
+ *  \param[out] sum2: second sum
+ */
+template <typename Dtype, class Op1, class Op2>
+void EltwiseReduce2(size_t n, const Op1& op1, const Op2& op2,
+                    Dtype* sum1, Dtype* sum2) {
+  switch (Cpu::GetIsa()) {
+    case Cpu::ISA_AVX512: {
+      EltwiseReduce2Avx512(n, op1, op2, sum1, sum2);
+      break;
+    }
+    case Cpu::ISA_AVX2: {
+      EltwiseReduce2Avx2(n, op1, op2, sum1, sum2);
+      break;
+    }
+    default: {
+      EltwiseReduce2Sse(n, op1, op2, sum1, sum2);
+      break;
+    }
+  }
+}
+
+
+/*!
+ * Map: out = op(in).
+ *
+ *  \param[in]  n  : size
+ *  \param[in]  in : input
+ *  \param[in]  op : unary operation
+ *
+ *  \param[out] out: output (can be the input)
+ */
+template <typename Dtype, class Op>
+void EltwiseMap(size_t n, const Dtype* in, Dtype* out, const Op& op) {
+  EltwiseFor(n, [=](size_t i) {
+    out[i] = op(in[i]);
+  });
+}
+
+
+/*!
+ * Binary operation: out = op(in1, in2).
+ *
+ *  \param[in]  n  : size
+ *  \param[in]  in1: first input
+ *  \param[in]  in2: second input
+ *  \param[in]  op : binary operation
+ *
+ *  \param[out] out: output (can be one of the inputs)
+ */
+template <typename Dtype, class Op>
+void EltwiseBinary(size_t n, const Dtype* in1, const Dtype* in2,
+                   Dtype* out, const Op& op) {
+  EltwiseFor(n, [=](size_t i) {
+    out[i] = op(in1[i], in2[i]);
+  });
+}
+
+
+/*!
+ * Ternary operation: out = op(in1, in2, in3).
+ * Typically used to accumulate derivatives: in_deriv = op(out, out_deriv,
+ * in_deriv).
+ *
+ *  \param[in]  n  : size
+ *  \param[in]  in1: first input
+ *  \param[in]  in2: second input
+ *  \param[in]  in3: third input
+ *  \param[in]  op : ternary operation
+ *
+ *  \param[out] out: output (can be one of the inputs)
+ */
+template <typename Dtype, class Op>
+void EltwiseTernary(size_t n, const Dtype* in1, const Dtype* in2,
+                    const Dtype* in3, Dtype* out, const Op& op) {
+  EltwiseFor(n, [=](size_t i) {
+    out[i] = op(in1[i], in2[i], in3[i]);
+  });
+}
+
+
+/*!
+ * Fused multiply-add: out = in1 * in2 + in3.
+ *
+ *  \param[in]  n  : size
+ *  \param[in]  in1: first input
+ *  \param[in]  in2: second input
+ *  \param[in]  in3: third input
+ *
+ *  \param[out] out: output (can be one of the inputs)
+ */
+template <typename Dtype>
+void EltwiseFma(size_t n, const Dtype* in1, const Dtype* in2,
+                const Dtype* in3, Dtype* out) {
+  EltwiseFor(n, [=](size_t i) {
+    out[i] = in1[i] * in2[i] + in3[i];
+  });
+}
+
+
+/*!
+ * Scaled accumulation: out += alpha * in.
+ *
+ *  \param[in]  n    : size
+ *  \param[in]  alpha: scale
+ *  \param[in]  in   : input
+ *
+ *  \param[out] out  : output (accumulated)
+ */
+template <typename Dtype>
+void EltwiseAxpy(size_t n, Dtype alpha, const Dtype* in, Dtype* out) {
+  EltwiseFor(n, [=](size_t i) {
+    out[i] += alpha * in[i];
+  });
+}
+
+
+/*!
+ * Per channel broadcast: out = in * scale[channel] + bias[channel]
+ * for each (batch, channel) slice of size elements.
+ *
+ *  \param[in]  batch_size : batch size
+ *  \param[in]  num_channel: number of channels
+ *  \param[in]  size       : slice size
+ *  \param[in]  in         : input
+ *  \param[in]  scale      : scale per channel
+ *  \param[in]  bias       : bias per channel (nullptr: no bias)
+ *
+ *  \param[out] out        : output (can be the input)
+ */
+template <typename Dtype>
+void EltwiseChannel(size_t batch_size, size_t num_channel, size_t size,
+                    const Dtype* in, const Dtype* scale, const Dtype* bias,
+                    Dtype* out) {
+  ParallelFor(0, batch_size * num_channel, [=](size_t slice) {
+    size_t       channel = slice % num_channel;
+    const Dtype* src     = in  + slice * size;
+    Dtype*       dst     = out + slice * size;
+    Dtype        s       = scale[channel];
+    Dtype        b       = bias ? bias[channel] : Dtype(0);
+    EltwiseFor(size, [=](size_t i) {
+      dst[i] = src[i] * s + b;
+    });
+  });
+}
+
+
+/*!
+ * Sum: sum of in.
+ *
+ *  \param[in]  n : size
+ *  \param[in]  in: input
+ *
+ *  \return     Sum
+ */
+template <typename Dtype>
+Dtype EltwiseSum(size_t n, const Dtype* in) {
+  return EltwiseReduce<Dtype>(n, [=](size_t i) {
+    return in[i];
+  });
+}
+
+
+/*!
+ * Dot product: sum of in1 * in2.
+ *
+ *  \param[in]  n  : size
+ *  \param[in]  in1: first input
+ *  \param[in]  in2: second input
+ *
+ *  \return     Dot product
+ */
+template <typename Dtype>
+Dtype EltwiseDot(size_t n, const Dtype* in1, const Dtype* in2) {
+  return EltwiseReduce<Dtype>(n, [=](size_t i) {
+    return in1[i] * in2[i];
+  });
+}
+
+
+}  // namespace jik
+
+
+#endif  // CORE_ELTWISE_H_
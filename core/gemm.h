@@ -0,0 +1,512 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_GEMM_H_
+#define CORE_GEMM_H_
+
+
+#include <core/cpu.h>
+#include <core/thread_pool.h>
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  GemmBlock
+ *  \brief  Matrix multiplication blocking sizes
+ *
+ * The matrices are split into blocks that fit the caches:
+ * - a kc*nc block of op(b) is packed once and stays in the L3/L2 cache
+ * - a mc*kc block of op(a) is packed once and stays in the L2 cache
+ * - the micro-kernel computes a mr*nr block of c kept in registers,
+ *   streaming a kc*nr sliver of op(b) through the L1 cache
+ * A micro-kernel row is 2 vector registers wide, so the 6 rows use
+ * 12 registers whatever the vector size.
+ */
+template <typename Dtype, uint32_t kVecSize>
+struct GemmBlock {
+  typedef Dtype Vec __attribute__((vector_size(kVecSize)));  // Vector
+
+  static const uint32_t kMr = 6;                              // Rows
+  static const uint32_t kNr = 2 * kVecSize / sizeof(Dtype);  // Columns
+  static const uint32_t kMc = 20 * kMr;  // Rows of a packed op(a) block
+  static const uint32_t kKc = 256;       // Depth of packed blocks
+  static const uint32_t kNc = 2048;      // Columns of a packed op(b) block
+};
+
+
+/*!
+ * Scale a matrix: c = beta * c.
+ *
+ *  \param[in]  m   : number of rows
+ *  \param[in]  n   : number of columns
+ *  \param[in]  beta: scale
+ *
+ *  \param[out] c   : matrix c
+ *  \param[in]  ldc : leading dimension (row stride) of c
+ */
+template <typename Dtype>
+void GemmScale(uint32_t m, uint32_t n, Dtype beta, Dtype* c, uint32_t ldc) {
+  if (beta == Dtype(1)) {
+    return;
+  }
+  for (size_t i = 0; i < m; ++i) {
+    Dtype* c_row = c + i * ldc;
+    if (beta == Dtype(0)) {
+      for (size_t j = 0; j < n; ++j) {
+        c_row[j] = Dtype(0);
+      }
+    } else {
+      for (size_t j = 0; j < n; ++j) {
+        c_row[j] *= beta;
+      }
+    }
+  }
+}
+
+
+/*!
+ * Unblocked matrix multiplication: c += alpha * op(a) * op(b).
+ * Used for small matrices (e.g. matrix-vector products) where packing the
+ * operands would cost more than it saves.
+ * The loops are ordered so the innermost one walks contiguous memory.
+ *
+ *  \param[in]  trans_a: use a transposed?
+ *  \param[in]  trans_b: use b transposed?
+ *  \param[in]  m      : number of rows of op(a) and c
+ *  \param[in]  n      : number of columns of op(b) and c
+ *  \param[in]  k      : number of columns of op(a) and rows of op(b)
+ *  \param[in]  alpha  : scale applied to op(a) * op(b)
+ *  \param[in]  a      : matrix a
+ *  \param[in]  lda    : leading dimension (row stride) of a
+ *  \param[in]  b      : matrix b
+ *  \param[in]  ldb    : leading dimension (row stride) of b
+ *
+ *  \param[out] c      : matrix c
+ *  \param[in]  ldc    : leading dimension (row stride) of c
+ */
+template <typename Dtype>
+JIK_INLINE void GemmSmall(bool trans_a, bool trans_b,
+                          uint32_t m, uint32_t n, uint32_t k,
+                          Dtype alpha, const Dtype* a, uint32_t lda,
+                          const Dtype* b, uint32_t ldb,
+                          Dtype* c, uint32_t ldc) {
+  if (!trans_b) {
+    // c += alpha * op(a) * b
+    // We broadcast one element of op(a) over a contiguous row of b
+    for (size_t i = 0; i < m; ++i) {
+      Dtype* c_row = c + i * ldc;
+      for (size_t l = 0; l < k; ++l) {
+        Dtype val = alpha * (trans_a ? a[l * lda + i] : a[i * lda + l]);
+        const Dtype* b_row = b + l * ldb;
+        for (size_t j = 0; j < n; ++j) {
+          c_row[j] += val * b_row[j];
+        }
+      }
+    }
+  } else {
+    // c += alpha * op(a) * b^T
+    // The rows of b are contiguous: this is a dot product
+    for (size_t i = 0; i < m; ++i) {
+      Dtype* c_row = c + i * ldc;
+      for (size_t j = 0; j < n; ++j) {
+        const Dtype* b_row = b + j * ldb;
+        Dtype val = Dtype(0);
+        if (trans_a) {
+          for (size_t l = 0; l < k; ++l) {
+            val += a[l * lda + i] * b_row[l];
+          }
+        } else {
+          const Dtype* a_row = a + i * lda;
+          for (size_t l = 0; l < k; ++l) {
+            val += a_row[l] * b_row[l];
+          }
+        }
+        c_row[j] += alpha * val;
+      }
+    }
+  }
+}
+
+
+/*!
+ * Pack a mc*kc block of op(a) into panels of kMr rows.
+ * Each panel is stored column by column (kMr values per column) so the
+ * micro-kernel reads it sequentially. The last panel is padded with 0.
+ *
+ *  \param[in]  trans_a: use a transposed?
+ *  \param[in]  mc     : number of rows of the block
+ *  \param[in]  kc     : number of columns of the block
+ *  \param[in]  a      : top-left corner of the block in op(a)
+ *  \param[in]  lda    : leading dimension (row stride) of a
+ *
+ *  \param[out] pack   : packed block
+ */
+template <class Block, typename Dtype>
+JIK_INLINE void GemmPackA(bool trans_a, uint32_t mc, uint32_t kc,
+                          const Dtype* a, uint32_t lda, Dtype* pack) {
+  const uint32_t mr = Block::kMr;
+  for (uint32_t i = 0; i < mc; i += mr) {
+    uint32_t rows = std::min(mr, mc - i);
+    for (uint32_t l = 0; l < kc; ++l, pack += mr) {
+      for (uint32_t r = 0; r < rows; ++r) {
+        pack[r] = trans_a ? a[size_t(l) * lda + i + r] :
+                            a[size_t(i + r) * lda + l];
+      }
+      for (uint32_t r = rows; r < mr; ++r) {
+        pack[r] = Dtype(0);
+      }
+    }
+  }
+}
+
+
+/*!
+ * Pack a kc*nc block of op(b) into panels of kNr columns.
+ * Each panel is stored row by row (kNr values per row) so the
+ * micro-kernel reads it sequentially. The last panel is padded with 0.
+ *
+ *  \param[in]  trans_b: use b transposed?
+ *  \param[in]  kc     : number of rows of the block
+ *  \param[in]  nc     : number of columns of the block
+ *  \param[in]  b      : top-left corner of the block in op(b)
+ *  \param[in]  ldb    : leading dimension (row stride) of b
+ *
+ *  \param[out] pack   : packed block
+ */
+template <class Block, typename Dtype>
+JIK_INLINE void GemmPackB(bool trans_b, uint32_t kc, uint32_t nc,
+                          const Dtype* b, uint32_t ldb, Dtype* pack) {
+  const uint32_t nr = Block::kNr;
+  for (uint32_t j = 0; j < nc; j += nr) {
+    uint32_t cols = std::min(nr, nc - j);
+    for (uint32_t l = 0; l < kc; ++l, pack += nr) {
+      for (uint32_t c = 0; c < cols; ++c) {
+        pack[c] = trans_b ? b[size_t(j + c) * ldb + l] :
+                            b[size_t(l) * ldb + j + c];
+      }
+      for (uint32_t c = cols; c < nr; ++c) {
+        pack[c] = Dtype(0);
+      }
+    }
+  }
+}
+
+
+/*!
+ * Micro-kernel: c += alpha * pack_a * pack_b on a kMr*kNr block.
+ * The block of c is accumulated in 2 vectors per row, kept in registers:
+ * each step broadcasts one value of pack_a and multiplies it with one
+ * row of pack_b. Only the valid rows * cols part is written back.
+ *
+ *  \param[in]  kc    : depth
+ *  \param[in]  alpha : scale applied to pack_a * pack_b
+ *  \param[in]  pack_a: packed panel of op(a) (kc*kMr)
+ *  \param[in]  pack_b: packed panel of op(b) (kc*kNr)
+ *  \param[in]  rows  : number of valid rows
+ *  \param[in]  cols  : number of valid columns
+ *
+ *  \param[out] c     : top-left corner of the block in c
+ *  \param[in]  ldc   : leading dimension (row stride) of c
+ */
+template <class Block, typename Dtype>
+JIK_INLINE void GemmKernel(uint32_t kc, Dtype alpha,
+                           const Dtype* pack_a, const Dtype* pack_b,
+                           uint32_t rows, uint32_t cols,
+                           Dtype* c, uint32_t ldc) {
+  typedef typename Block::Vec Vec;
+  const uint32_t mr = Block::kMr;
+  const uint32_t nr = Block::kNr;
+  const uint32_t nv = nr / 2;
+
+  Vec acc[mr][2] = {};
+  for (uint32_t l = 0; l < kc; ++l, pack_a += mr, pack_b += nr) {
+    Vec b0, b1;
+    std::memcpy(&b0, pack_b     , sizeof(Vec));
+    std::memcpy(&b1, pack_b + nv, sizeof(Vec));
+    for (uint32_t r = 0; r < mr; ++r) {
+      Vec val = Vec{} + pack_a[r];
+      acc[r][0] += val * b0;
+      acc[r][1] += val * b1;
+    }
+  }
+
+  Dtype res[mr][nr];
+  std::memcpy(res, acc, sizeof(res));
+  if (rows == mr && cols == nr) {
+    for (uint32_t r = 0; r < mr; ++r, c += ldc) {
+      for (uint32_t j = 0; j < nr; ++j) {
+        c[j] += alpha * res[r][j];
+      }
+    }
+  } else {
+    for (uint32_t r = 0; r < rows; ++r, c += ldc) {
+      for (uint32_t j = 0; j < cols; ++j) {
+        c[j] += alpha * res[r][j];
+      }
+    }
+  }
+}
+
+
+/*!
+ * Blocked matrix multiplication: c += alpha * op(a) * op(b).
+ * Both operands are packed block by block into contiguous panels (the
+ * transposition is handled by the packing), then a register-tiled
+ * micro-kernel computes c block by block. Small products fall back to
+ * simple loops.
+ * This is inlined in each instruction set variant below, so it is
+ * compiled for that instruction set and vector size.
+ *
+ *  \param[in]  trans_a: use a transposed?
+ *  \param[in]  trans_b: use b transposed?
+ *  \param[in]  m      : number of rows of op(a) and c
+ *  \param[in]  n      : number of columns of op(b) and c
+ *  \param[in]  k      : number of columns of op(a) and rows of op(b)
+ *  \param[in]  alpha  : scale applied to op(a) * op(b)
+ *  \param[in]  a      : matrix a
+ *  \param[in]  lda    : leading dimension (row stride) of a
+ *  \param[in]  b      : matrix b
+ *  \param[in]  ldb    : leading dimension (row stride) of b
+ *
+ *  \param[out] c      : matrix c
+ *  \param[in]  ldc    : leading dimension (row stride) of c
+ */
+template <class Block, typename Dtype>
+JIK_INLINE void GemmBlocked(bool trans_a, bool trans_b,
+                            uint32_t m, uint32_t n, uint32_t k,
+                            Dtype alpha, const Dtype* a, uint32_t lda,
+                            const Dtype* b, uint32_t ldb,
+                            Dtype* c, uint32_t ldc) {
+  const uint32_t mr = Block::kMr;
+  const uint32_t nr = Block::kNr;
+  const uint32_t mc = Block::kMc;
+  const uint32_t kc = Block::kKc;
+  const uint32_t nc = Block::kNc;
+
+  // Small matrices: packing is not worth it
+  if (m < mr || n < nr || uint64_t(m) * n * k < 16 * 1024) {
+    GemmSmall(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, c, ldc);
+    return;
+  }
+
+  // Packing buffers, allocated once per thread
+  static thread_local std::vector<Dtype> pack_a, pack_b;
+  pack_a.resize(size_t(mc + mr) * kc);
+  pack_b.resize(size_t(nc + nr) * kc);
+
+  for (uint32_t jc = 0; jc < n; jc += nc) {
+    uint32_t ncb = std::min(nc, n - jc);
+    for (uint32_t pc = 0; pc < k; pc += kc) {
+      uint32_t kcb = std::min(kc, k - pc);
+      GemmPackB<Block>(trans_b, kcb, ncb,
+                       trans_b ? b + size_t(jc) * ldb + pc :
+                                 b + size_t(pc) * ldb + jc,
+                       ldb, &pack_b[0]);
+      for (uint32_t ic = 0; ic < m; ic += mc) {
+        uint32_t mcb = std::min(mc, m - ic);
+        GemmPackA<Block>(trans_a, mcb, kcb,
+                         trans_a ? a + size_t(pc) * lda + ic :
+                                   a + size_t(ic) * lda + pc,
+                         lda, &pack_a[0]);
+        for (uint32_t jr = 0; jr < ncb; jr += nr) {
+          for (uint32_t ir = 0; ir < mcb; ir += mr) {
+            GemmKernel<Block>(kcb, alpha,
+                              &pack_a[size_t(ir) * kcb],
+                              &pack_b[size_t(jr) * kcb],
+                              std::min(mr, mcb - ir), std::min(nr, ncb - jr),
+                              c + size_t(ic + ir) * ldc + jc + jr, ldc);
+          }
+        }
+      }
+    }
+  }
+}
+
+
+/*!
+ * Blocked matrix multiplication, one variant per instruction set
+ * (see GemmBlocked).
+ */
+template <typename Dtype>
+void GemmSse(bool trans_a, bool trans_b, uint32_t m, uint32_t n, uint32_t k,
+             Dtype alpha, const Dtype* a, uint32_t lda,
+             const Dtype* b, uint32_t ldb, Dtype* c, uint32_t ldc) {
+  GemmBlocked<GemmBlock<Dtype, 16>>(trans_a, trans_b, m, n, k,
+                                    alpha, a, lda, b, ldb, c, ldc);
+}
+
+template <typename Dtype>
+JIK_TARGET_AVX2
+void GemmAvx2(bool trans_a, bool trans_b, uint32_t m, uint32_t n, uint32_t k,
+              Dtype alpha, const Dtype* a, uint32_t lda,
+              const Dtype* b, uint32_t ldb, Dtype* c, uint32_t ldc) {
+  GemmBlocked<GemmBlock<Dtype, 32>>(trans_a, trans_b, m, n, k,
+                                    alpha, a, lda, b, ldb, c, ldc);
+}
+
+template <typename Dtype>
+JIK_TARGET_AVX512
+void GemmAvx512(bool trans_a, bool trans_b, uint32_t m, uint32_t n, uint32_t k,
+                Dtype alpha, const Dtype* a, uint32_t lda,
+                const Dtype* b, uint32_t ldb, Dtype* c, uint32_t ldc) {
+  GemmBlocked<GemmBlock<Dtype, 64>>(trans_a, trans_b, m, n, k,
+                                    alpha, a, lda, b, ldb, c, ldc);
+}
+
+
+/*!
+ * Split a matrix multiplication into a grid of blocks of c, one task per
+ * block, for the threads of the pool.
+ * Each block packs its own rows of op(a) and columns of op(b): among the
+ * grids with the most blocks (at most one per thread, each worth at least
+ * kMinWork multiply-adds), we pick the one packing the least data.
+ *
+ *  \param[in]  m         : number of rows of c
+ *  \param[in]  n         : number of columns of c
+ *  \param[in]  k         : depth
+ *  \param[in]  num_thread: number of threads
+ *
+ *  \param[out] grid_m    : number of blocks along the rows
+ *  \param[out] grid_n    : number of blocks along the columns
+ */
+void GemmGrid(uint32_t m, uint32_t n, uint32_t k, uint32_t num_thread,
+              uint32_t* grid_m, uint32_t* grid_n) {
+  const uint64_t kMinWork = 0x80000;
+  const uint32_t kMinRows = 16;
+  const uint32_t kMinCols = 32;
+
+  uint64_t num_block = std::min(uint64_t(num_thread),
+                                std::max(uint64_t(m) * n * k / kMinWork,
+                                         uint64_t(1)));
+  *grid_m = 1;
+  *grid_n = 1;
+  uint64_t best_size = 1, best_pack = uint64_t(m) + n;
+  for (uint32_t gm = 1; gm <= num_block && gm <= std::max(m / kMinRows, 1u);
+    ++gm) {
+    uint32_t gn = uint32_t(std::min(num_block / gm,
+                                    uint64_t(std::max(n / kMinCols, 1u))));
+    uint64_t size = uint64_t(gm) * gn;
+    uint64_t pack = uint64_t(gn) * m + uint64_t(gm) * n;
+    if (size > best_size || (size == best_size && pack < best_pack)) {
+      *grid_m   = gm;
+      *grid_n   = gn;
+      best_size = size;
+      best_pack = pack;
+    }
+  }
+}
+
+
+/*!
+ * General matrix multiplication.
+ * All the matrices are stored row-major:
+ *   c = alpha * op(a) * op(b) + beta * c
+ * with op(a) of size m*k, op(b) of size k*n and c of size m*n.
+ *
+ * The variant matching the CPU instruction set is used (see Cpu). Large
+ * products are split into blocks of c computed in parallel (see GemmGrid).
+ *
+ *  \param[in]  trans_a: use a transposed?
+ *  \param[in]  trans_b: use b transposed?
+ *  \param[in]  m      : number of rows of op(a) and c
+ *  \param[in]  n      : number of columns of op(b) and c
+ *  \param[in]  k      : number of columns of op(a) and rows of op(b)
+ *  \param[in]  alpha  : scale applied to op(a) * op(b)
+ *  \param[in]  a      : matrix a
+ *  \param[in]  lda    : leading dimension (row stride) of a
+ *  \param[in]  b      : matrix b
+ *  \param[in]  ldb    : leading dimension (row stride) of b
+ *  \param[in]  beta   : scale applied to c before accumulating
+ *
+ *  \param[out] c      : matrix c
+ *  \param[in]  ldc    : leading dimension (row stride) of c
+ */
+template <typename Dtype>
+void Gemm(bool trans_a, bool trans_b, uint32_t m, uint32_t n, uint32_t k,
+          Dtype alpha, const Dtype* a, uint32_t lda,
+          const Dtype* b, uint32_t ldb,
+          Dtype beta, Dtype* c, uint32_t ldc) {
+  if (!m || !n) {
+    return;
+  }
+  if (alpha == Dtype(0)) {
+    k = 0;
+  }
+
+  // Variant matching the CPU instruction set
+  void (*gemm)(bool, bool, uint32_t, uint32_t, uint32_t,
+               Dtype, const Dtype*, uint32_t, const Dtype*, uint32_t,
+               Dtype*, uint32_t);
+  switch (Cpu::GetIsa()) {
+    case Cpu::ISA_AVX512: {
+      gemm = &GemmAvx512<Dtype>;
+      break;
+    }
+    case Cpu::ISA_AVX2: {
+      gemm = &GemmAvx2<Dtype>;
+      break;
+    }
+    default: {
+      gemm = &GemmSse<Dtype>;
+      break;
+    }
+  }
+
+  uint32_t grid_m, grid_n;
+  GemmGrid(m, n, k, ThreadPool::NumThread(), &grid_m, &grid_n);
+  ParallelFor(0, size_t(grid_m) * grid_n, [&](size_t block) {
+    uint32_t row = uint32_t(block / grid_n);
+    uint32_t col = uint32_t(block % grid_n);
+    uint32_t i0  = uint32_t(uint64_t(m) *  row      / grid_m);
+    uint32_t i1  = uint32_t(uint64_t(m) * (row + 1) / grid_m);
+    uint32_t j0  = uint32_t(uint64_t(n) *  col      / grid_n);
+    uint32_t j1  = uint32_t(uint64_t(n) * (col + 1) / grid_n);
+    Dtype*   c_block = c + size_t(i0) * ldc + j0;
+
+    // c = beta * c
+    GemmScale(i1 - i0, j1 - j0, beta, c_block, ldc);
+    if (!k) {
+      return;
+    }
+
+    // c += alpha * op(a) * op(b)
+    gemm(trans_a, trans_b, i1 - i0, j1 - j0, k, alpha,
+         trans_a ? a + i0 : a + size_t(i0) * lda, lda,
+         trans_b ? b + size_t(j0) * ldb : b + j0, ldb, c_block, ldc);
+  });
+}
+
+
+}  // namespace jik
+
+
+#endif  // CORE_GEMM_H_
@@ -75,6 +75,25 @@ class Layer {
   std::vector<std::shared_ptr<Mat<Dtype>>> weight_;   // Weights
 
 
+  // Protected methods
+ protected:
+  /*!
+   * Get the number of elements of a list of matrices (of their shapes).
+   *
+   *  \param[in]  mat: list of matrices
+   *
+   *  \return     Number of elements
+   */
+  static uint64_t NumElement(
+    const std::vector<std::shared_ptr<Mat<Dtype>>>& mat) {
+    uint64_t num_element = 0;
+    for (size_t i = 0; i < mat.size(); ++i) {
+      num_element += mat[i]->ShapeSize();
+    }
+    return num_element;
+  }
+
+
   // Public methods
  public:
   /*!
@@ -122,16 +141,15 @@ class Layer {
   }
 
   /*!
-   * Set the batch size.
+   * Set the batch size: the outputs are resized (see Mat::SetBatchSize).
+   * The inputs belong to the layers producing them (or to the model) and
+   * the weights don't depend on the batch size.
    *
    *  \param[in]  batch_size: batch size
    */
-  void SetBatchSize(uint32_t batch_size) {
-    for (size_t i = 0; i < in_.size(); ++i) {
-      in_[i]->size[3] = batch_size;
-    }
+  virtual void SetBatchSize(uint32_t batch_size) {
     for (size_t i = 0; i < out_.size(); ++i) {
-      out_[i]->size[3] = batch_size;
+      out_[i]->SetBatchSize(batch_size);
     }
   }
 
@@ -150,6 +168,53 @@ class Layer {
     }
   }
 
+  /*!
+   * Get the input an output is a view of (see Mat::SetView), if any: the
+   * layer doesn't copy this input to this output (identity) but shares its
+   * storage.
+   *
+   *  \param[in]  i: output index
+   *
+   *  \return     Input index, -1 if the output has its own storage
+   */
+  virtual int ViewOf(size_t i) const {
+    return -1;
+  }
+
+  /*!
+   * Charge the matrices of the layer to a tracker, unless they already are
+   * charged to a model (see Mat::Adopt).
+   *
+   *  \param[in]  tracker: tracker
+   */
+  void Adopt(MemTracker* tracker) const {
+    for (size_t i = 0; i < in_.size(); ++i) {
+      in_[i]->Adopt(tracker);
+    }
+    for (size_t i = 0; i < out_.size(); ++i) {
+      out_[i]->Adopt(tracker);
+    }
+    for (size_t i = 0; i < weight_.size(); ++i) {
+      weight_[i]->Adopt(tracker);
+    }
+  }
+
+  /*!
+   * Release the derivatives (inference only): the layer can't run the
+   * backward pass afterwards.
+   */
+  virtual void ReleaseDeriv() {
+    for (size_t i = 0; i < in_.size(); ++i) {
+      in_[i]->ReleaseDeriv();
+    }
+    for (size_t i = 0; i < out_.size(); ++i) {
+      out_[i]->ReleaseDeriv();
+    }
+    for (size_t i = 0; i < weight_.size(); ++i) {
+      weight_[i]->ReleaseDeriv();
+    }
+  }
+
   /*!
    * Get the weights.
    *
@@ -162,6 +227,77 @@ class Layer {
     }
   }
 
+  /*!
+   * Get the weights updated by the forward pass (e.g. running statistics),
+   * not only by the solver. The replicas of a model can't share them (see
+   * Solver::Train).
+   *
+   *  \param[out] weight: list of weights
+   */
+  virtual void GetForwardWeight(
+    std::vector<std::shared_ptr<Mat<Dtype>>>* weight) const {}
+
+  /*!
+   * Invalidate the values the layer caches from its weights (e.g. transformed
+   * filters): the weights were changed outside of its passes (solver update,
+   * model loading).
+   */
+  virtual void InvalidateCache() {}
+
+  /*!
+   * Get the number of floating point operations of the forward pass, for
+   * the current shapes (analytic count: a multiply-add is 2 operations, a
+   * transcendental function 1). The layers not doing any arithmetic worth
+   * counting report 0.
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    return 0;
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    return 0;
+  }
+
+  /*!
+   * Get the number of bytes moved by the forward pass, for the current
+   * shapes: the inputs and weights are read and the outputs written once
+   * (a lower bound, ignoring the caches and scratch buffers).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of bytes
+   */
+  virtual uint64_t ForwardByte(const State& state) const {
+    return (NumElement(in_) + NumElement(weight_) + NumElement(out_)) *
+           sizeof(Dtype);
+  }
+
+  /*!
+   * Get the number of bytes moved by the backward pass (see ForwardByte):
+   * the inputs, weights and outputs derivatives are read and the inputs and
+   * weights derivatives accumulated (read and written).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of bytes
+   */
+  virtual uint64_t BackwardByte(const State& state) const {
+    return (3 * (NumElement(in_) + NumElement(weight_)) + NumElement(out_)) *
+           sizeof(Dtype);
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
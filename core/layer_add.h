@@ -29,6 +29,8 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/eltwise.h>
+#include <core/thread_pool.h>
 #include <memory>
 #include <vector>
 
@@ -39,6 +41,9 @@ namespace jik {
 /*!
  *  \class  LayerAdd
  *  \brief  Matrices addition
+ *
+ * The second matrix can have a batch size of 1 (e.g. a shared bias): it is
+ * then broadcast to all the batch items of the first one.
  */
 template <typename Dtype>
 class LayerAdd: public Layer<Dtype> {
@@ -60,9 +65,13 @@ class LayerAdd: public Layer<Dtype> {
            const std::vector<std::shared_ptr<Mat<Dtype>>>& in):
     Parent(name, in) {
     // Make sure we have 2 inputs and they have the same size
+    // (or the same size per batch item, to broadcast the second one)
     Check(Parent::in_.size() == 2, "Layer '%s' must have 2 inputs",
           Parent::Name());
-    Check(Parent::in_[0]->Size() == Parent::in_[1]->Size(),
+    Check(Parent::in_[0]->Size() == Parent::in_[1]->Size() ||
+          (Parent::in_[1]->size[3] == 1 &&
+           Parent::in_[0]->Size() ==
+           Parent::in_[1]->Size() * Parent::in_[0]->size[3]),
           "Layer '%s' inputs must have the same size", Parent::Name());
 
     // Create 1 output, same size as the inputs
@@ -75,6 +84,31 @@ class LayerAdd: public Layer<Dtype> {
    */
   virtual ~LayerAdd() {}
 
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    return Parent::out_[0]->ShapeSize();
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    // Both input derivatives are accumulated
+    return 2 * Parent::out_[0]->ShapeSize();
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -87,10 +121,24 @@ class LayerAdd: public Layer<Dtype> {
     const Dtype* in1_data = Parent::in_[0]->Data();
     const Dtype* in2_data = Parent::in_[1]->Data();
 
-    // out = in1 + in2
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      out_data[i] = in1_data[i] + in2_data[i];
+    uint32_t batch_size = Parent::out_[0]->size[3];
+    if (Parent::in_[1]->size[3] != batch_size) {
+      // out = in1 + in2, in2 being broadcast to each batch item
+      size_t item_size = Parent::in_[1]->Size();
+      ParallelFor(0, batch_size, [&](size_t b) {
+        EltwiseBinary(item_size, in1_data + b * item_size, in2_data,
+                      out_data + b * item_size, [](Dtype in1, Dtype in2) {
+          return in1 + in2;
+        });
+      });
+      return;
     }
+
+    // out = in1 + in2
+    EltwiseBinary(Parent::out_[0]->Size(), in1_data, in2_data, out_data,
+                  [](Dtype in1, Dtype in2) {
+      return in1 + in2;
+    });
   }
 
   /*!
@@ -106,12 +154,23 @@ class LayerAdd: public Layer<Dtype> {
     Dtype*       in2_deriv_data = Parent::in_[1]->DerivData();
 
     // in1_deriv = out_deriv
-    // in2_deriv = out_deriv
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      Dtype dv           = out_deriv_data[i];
-      in1_deriv_data[i] += dv;
-      in2_deriv_data[i] += dv;
+    EltwiseAxpy(Parent::out_[0]->Size(), Dtype(1),
+                out_deriv_data, in1_deriv_data);
+
+    uint32_t batch_size = Parent::out_[0]->size[3];
+    if (Parent::in_[1]->size[3] != batch_size) {
+      // in2_deriv = sum of out_deriv over the batch
+      size_t item_size = Parent::in_[1]->Size();
+      for (uint32_t b = 0; b < batch_size; ++b) {
+        EltwiseAxpy(item_size, Dtype(1), out_deriv_data + b * item_size,
+                    in2_deriv_data);
+      }
+      return;
     }
+
+    // in2_deriv = out_deriv
+    EltwiseAxpy(Parent::out_[0]->Size(), Dtype(1),
+                out_deriv_data, in2_deriv_data);
   }
 };
 
@@ -29,6 +29,9 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/eltwise.h>
+#include <core/thread_pool.h>
+#include <algorithm>
 #include <memory>
 #include <cmath>
 #include <limits>
@@ -56,6 +59,7 @@ class LayerBatchNorm: public Layer<Dtype> {
   std::shared_ptr<Mat<Dtype>> std_dev_cur_;      // Current standard deviation
   Dtype                       moving_avg_;       // Moving average
   Dtype                       moving_avg_frac_;  // Moving average fraction
+  bool                        use_scale_;        // Fused scale (and bias)?
 
 
   // Public methods
@@ -80,14 +84,34 @@ class LayerBatchNorm: public Layer<Dtype> {
     moving_avg_ = Dtype(1);
     param.Get("moving_avg_frac", Dtype(0.99), &moving_avg_frac_);
 
+    // The scale layer usually following the batch normalization can be fused
+    // in this layer: it saves one pass over the data, forward and backward
+    bool use_bias;
+    param.Get("use_scale", false, &use_scale_);
+    param.Get("use_bias" , true , &use_bias);
+
     // Create 2 weights: mean and standard deviation
     // The standard deviation is actually stored as its inverse for efficiency
     // We learn 1 mean and standard deviation per channel
-    Parent::weight_.resize(2);
+    // With the fused scale, we add the scale and bias weights (same order as
+    // a separate scale layer)
+    Parent::weight_.resize(use_scale_ ? (use_bias ? 4 : 3) : 2);
     Parent::weight_[0] = std::make_shared<Mat<Dtype>>(
       1, 1, Parent::in_[0]->size[2]);
     Parent::weight_[1] = std::make_shared<Mat<Dtype>>(
       1, 1, Parent::in_[0]->size[2]);
+    if (use_scale_) {
+      // Create the scale and initialize it to 1
+      Parent::weight_[2] = std::make_shared<Mat<Dtype>>(
+        1, 1, Parent::in_[0]->size[2]);
+      Parent::weight_[2]->Set(Dtype(1));
+
+      // Create the bias and initialize it to 0
+      if (use_bias) {
+        Parent::weight_[3] = std::make_shared<Mat<Dtype>>(
+          1, 1, Parent::in_[0]->size[2]);
+      }
+    }
 
     // Temporary matrices for the current mean and standard deviation values
     // No derivative needed
@@ -107,7 +131,23 @@ class LayerBatchNorm: public Layer<Dtype> {
   virtual ~LayerBatchNorm() {}
 
   /*!
-   * Calculate the mean and variance of a dataset.
+   * Get the weights updated by the forward pass: the mean and standard
+   * deviation moving averages (see Layer::GetForwardWeight).
+   *
+   *  \param[out] weight: list of weights
+   */
+  virtual void GetForwardWeight(
+    std::vector<std::shared_ptr<Mat<Dtype>>>* weight) const {
+    weight->push_back(Parent::weight_[0]);
+    weight->push_back(Parent::weight_[1]);
+  }
+
+  /*!
+   * Calculate the mean and variance of a dataset, in a single pass.
+   * The dataset is processed by blocks: the sums of each block are
+   * calculated relative to its first value (shifted data, to avoid
+   * cancellation), and the blocks statistics are merged with the parallel
+   * variance algorithm (Chan et al.).
    *
    *  \param[in]  data     : dataset
    *  \param[in]  data_size: dataset size
@@ -117,38 +157,71 @@ class LayerBatchNorm: public Layer<Dtype> {
    */
   static void MeanVariance(const Dtype* data, uint32_t data_size,
                            Dtype* mean, Dtype* variance) {
-    if (!data || !data_size) {
-      if (mean) {
-        *mean = Dtype(0);
-      }
-      if (variance) {
-        *variance = Dtype(0);
-      }
-      return;
-    }
+    const uint32_t kBlockSize = 256;
 
-    // Calculate the mean
     Dtype mean_val = Dtype(0);
-    for (uint32_t i = 0; i < data_size; ++i) {
-      mean_val += data[i];
+    Dtype m2_val   = Dtype(0);
+    for (uint32_t start = 0; data && start < data_size; start += kBlockSize) {
+      uint32_t     size  = std::min(kBlockSize, data_size - start);
+      const Dtype* block = data + start;
+      Dtype        shift = block[0];
+
+      // Block sums of (x - shift) and (x - shift)^2
+      Dtype sum, sum2;
+      EltwiseReduce2(size, [=](size_t i) {
+        return block[i] - shift;
+      }, [=](size_t i) {
+        Dtype dx = block[i] - shift;
+        return dx * dx;
+      }, &sum, &sum2);
+
+      // Block mean and sum of squared differences from the mean
+      Dtype block_mean = sum / size;
+      Dtype block_m2   = std::max(sum2 - sum * block_mean, Dtype(0));
+      block_mean      += shift;
+
+      // Merge with the previous blocks
+      Dtype delta = block_mean - mean_val;
+      Dtype frac  = Dtype(size) / (start + size);
+      mean_val   += delta * frac;
+      m2_val     += block_m2 + delta * delta * start * frac;
     }
-    mean_val /= data_size;
+
     if (mean) {
       *mean = mean_val;
     }
-
     if (variance) {
-      // Calculate the variance
-      Dtype variance_val = Dtype(0);
-      for (uint32_t i = 0; i < data_size; ++i) {
-        Dtype dx      = data[i] - mean_val;
-        variance_val += dx * dx;
-      }
-      variance_val /= data_size;
-      *variance = variance_val;
+      *variance = data_size ? m2_val / data_size : Dtype(0);
     }
   }
 
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    // Mean and variance (training only), then 1 multiply-add per element
+    uint64_t num_out = Parent::out_[0]->ShapeSize();
+    return (state.phase == State::PHASE_TRAIN ? 5 : 2) * num_out;
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    // 2 passes: the sums, then the input derivatives
+    return 11 * Parent::out_[0]->ShapeSize();
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -161,6 +234,10 @@ class LayerBatchNorm: public Layer<Dtype> {
     const Dtype* in_data          = Parent::in_[0]->Data();
     Dtype*       mean_data        = Parent::weight_[0]->Data();
     Dtype*       std_dev_data     = Parent::weight_[1]->Data();
+    const Dtype* scale_data       = use_scale_ ?
+                                    Parent::weight_[2]->Data() : nullptr;
+    const Dtype* bias_data        = (Parent::weight_.size() > 3) ?
+                                    Parent::weight_[3]->Data() : nullptr;
     Dtype*       mean_cur_data    = mean_cur_->Data();
     Dtype*       std_dev_cur_data = std_dev_cur_->Data();
 
@@ -171,17 +248,19 @@ class LayerBatchNorm: public Layer<Dtype> {
       return;
     }
     Dtype inv_batch_size = Dtype(1) / batch_size;
-
-    if (state.phase == State::PHASE_TRAIN) {
-      // Calculate the mean and variance for each channel across all batches
-      // We only do this during the training phase
-      // During testing, we only use the precomputed
-      // global mean and standard deviation
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
+    bool  train          = state.phase == State::PHASE_TRAIN;
+
+    // Each channel is processed independently, in parallel
+    ParallelFor(0, num_channel, [&](size_t channel) {
+      if (train) {
+        // Calculate the mean and variance for each channel across all batches
+        // We only do this during the training phase
+        // During testing, we only use the precomputed
+        // global mean and standard deviation
         mean_cur_data[channel]    = Dtype(0);
         std_dev_cur_data[channel] = Dtype(0);
         for (uint32_t batch = 0; batch < batch_size; ++batch) {
-          uint32_t offset = (batch * num_channel + channel) * data_size;
+          size_t offset = (size_t(batch) * num_channel + channel) * data_size;
           Dtype mean_val, variance_val;
           MeanVariance(in_data + offset, data_size, &mean_val, &variance_val);
           mean_cur_data[channel]    += mean_val     * inv_batch_size;
@@ -203,20 +282,25 @@ class LayerBatchNorm: public Layer<Dtype> {
           moving_avg_ * std_dev_cur_data[channel];
       }
 
-      // Update the moving average
-      moving_avg_ *= moving_avg_frac_;
-    }
-
-    // Normalize each value with the mean and variance
-    // out = (in - mean) / sqrt(var(in) + eps)
-    for (uint32_t channel = 0; channel < num_channel; ++channel) {
+      // Normalize each value with the mean and variance (and scale it)
+      // out = (in - mean) / sqrt(var(in) + eps) * scale + bias
+      //     = in * a + b
+      Dtype a = std_dev_data[channel] * (scale_data ? scale_data[channel] :
+                                                      Dtype(1));
+      Dtype b = (bias_data ? bias_data[channel] : Dtype(0)) -
+                mean_data[channel] * a;
       for (uint32_t batch = 0; batch < batch_size; ++batch) {
-        uint32_t offset = (batch * num_channel + channel) * data_size;
-        for (uint32_t i = 0; i < data_size; ++i) {
-          out_data[offset + i] = (in_data[offset + i] - mean_data[channel]) *
-                                 std_dev_data[channel];
-        }
+        size_t offset = (size_t(batch) * num_channel + channel) * data_size;
+        EltwiseMap(data_size, in_data + offset, out_data + offset,
+                   [=](Dtype in) {
+          return in * a + b;
+        });
       }
+    });
+
+    // Update the moving average
+    if (train) {
+      moving_avg_ *= moving_avg_frac_;
     }
   }
 
@@ -228,47 +312,87 @@ class LayerBatchNorm: public Layer<Dtype> {
    *  \param[in]  state: state
    */
   virtual void Backward(const State& state) {
-    const Dtype* out_data       = Parent::out_[0]->Data();
-    const Dtype* out_deriv_data = Parent::out_[0]->DerivData();
-    Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
-    const Dtype* std_dev_data   = Parent::weight_[1]->Data();
+    const Dtype* out_data         = Parent::out_[0]->Data();
+    const Dtype* out_deriv_data   = Parent::out_[0]->DerivData();
+    const Dtype* in_data          = Parent::in_[0]->Data();
+    Dtype*       in_deriv_data    = Parent::in_[0]->DerivData();
+    const Dtype* mean_data        = Parent::weight_[0]->Data();
+    const Dtype* std_dev_data     = Parent::weight_[1]->Data();
+    const Dtype* scale_data       = use_scale_ ?
+                                    Parent::weight_[2]->Data() : nullptr;
+    Dtype*       scale_deriv_data = use_scale_ ?
+                                    Parent::weight_[2]->DerivData() : nullptr;
+    Dtype*       bias_deriv_data  = (Parent::weight_.size() > 3) ?
+                                    Parent::weight_[3]->DerivData() : nullptr;
 
     uint32_t data_size   = Parent::out_[0]->size[0] * Parent::out_[0]->size[1];
     uint32_t num_channel = Parent::out_[0]->size[2];
     uint32_t batch_size  = Parent::out_[0]->size[3];
-
-    // Temporary array to save "out_deriv . out" element-wise product
-    std::vector<Dtype> out_deriv_data_dot_out_data(data_size);
-
-    // in_deriv = (out_deriv - mean(out_deriv) -
-    //            mean(out_deriv . out) . out) / sqrt(var(in) + eps)
-    for (uint32_t channel = 0; channel < num_channel; ++channel) {
+    if (!data_size) {
+      return;
+    }
+    Dtype inv_data_size = Dtype(1) / data_size;
+
+    // norm = (in - mean) / sqrt(var(in) + eps) (= out without fused scale)
+    // norm_deriv = out_deriv * scale
+    // in_deriv = (norm_deriv - mean(norm_deriv) -
+    //            mean(norm_deriv . norm) . norm) / sqrt(var(in) + eps)
+    // scale_deriv = norm . out_deriv
+    // bias_deriv  = out_deriv
+    // Each channel is processed independently, in parallel
+    ParallelFor(0, num_channel, [&](size_t channel) {
+      Dtype mean    = mean_data[channel];
+      Dtype std_dev = std_dev_data[channel];
+      Dtype scale   = scale_data ? scale_data[channel] : Dtype(1);
       for (uint32_t batch = 0; batch < batch_size; ++batch) {
-        uint32_t offset = (batch * num_channel + channel) * data_size;
-        // mean(out_deriv)
-        Dtype mean_out_deriv_data;
-        MeanVariance(out_deriv_data + offset, data_size,
-                     &mean_out_deriv_data, nullptr);
-        // out_deriv . out
-        for (uint32_t i = 0; i < data_size; ++i) {
-          out_deriv_data_dot_out_data[i] = out_deriv_data[offset + i] *
-                                           out_data[offset + i];
+        size_t       offset    = (size_t(batch) * num_channel + channel) *
+                                 data_size;
+        const Dtype* out_deriv = out_deriv_data + offset;
+        const Dtype* out       = out_data       + offset;
+        const Dtype* in        = in_data        + offset;
+        Dtype*       in_deriv  = in_deriv_data  + offset;
+
+        // First pass: sum(out_deriv) and sum(out_deriv . norm)
+        Dtype sum_out_deriv, sum_out_deriv_dot_norm;
+        if (scale_data) {
+          EltwiseReduce2(data_size, [=](size_t i) {
+            return out_deriv[i];
+          }, [=](size_t i) {
+            return out_deriv[i] * (in[i] - mean) * std_dev;
+          }, &sum_out_deriv, &sum_out_deriv_dot_norm);
+          scale_deriv_data[channel] += sum_out_deriv_dot_norm;
+          if (bias_deriv_data) {
+            bias_deriv_data[channel] += sum_out_deriv;
+          }
+        } else {
+          EltwiseReduce2(data_size, [=](size_t i) {
+            return out_deriv[i];
+          }, [=](size_t i) {
+            return out_deriv[i] * out[i];
+          }, &sum_out_deriv, &sum_out_deriv_dot_norm);
         }
-        // mean(out_deriv . out)
-        Dtype mean_out_deriv_data_dot_out_data;
-        MeanVariance(&out_deriv_data_dot_out_data[0], data_size,
-                     &mean_out_deriv_data_dot_out_data, nullptr);
-        // (out_deriv - mean(out_deriv) - mean(out_deriv . out) . out) /
-        // sqrt(var(in) + eps)
+
+        // Second pass: in_deriv
         // We re-use 1 / sqrt(var(in) + eps) calculated during the forward pass
-        for (uint32_t i = 0; i < data_size; ++i) {
-          in_deriv_data[offset + i] +=
-            (out_deriv_data[offset + i] - mean_out_deriv_data -
-            mean_out_deriv_data_dot_out_data * out_data[offset + i]) *
-            std_dev_data[channel];
+        Dtype mean_norm_deriv          = sum_out_deriv * scale * inv_data_size;
+        Dtype mean_norm_deriv_dot_norm = sum_out_deriv_dot_norm * scale *
+                                         inv_data_size;
+        Dtype a = scale * std_dev;
+        Dtype b = mean_norm_deriv_dot_norm * std_dev;
+        Dtype c = mean_norm_deriv * std_dev;
+        if (scale_data) {
+          EltwiseTernary(data_size, out_deriv, in, in_deriv, in_deriv,
+                         [=](Dtype dy, Dtype x, Dtype dx) {
+            return dx + dy * a - c - b * (x - mean) * std_dev;
+          });
+        } else {
+          EltwiseTernary(data_size, out_deriv, out, in_deriv, in_deriv,
+                         [=](Dtype dy, Dtype y, Dtype dx) {
+            return dx + dy * a - c - b * y;
+          });
         }
       }
-    }
+    });
   }
 };
 
@@ -30,6 +30,9 @@
 #include <core/layer.h>
 #include <core/log.h>
 #include <core/rand.h>
+#include <core/gemm.h>
+#include <core/thread_pool.h>
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <cmath>
@@ -61,6 +64,299 @@ class LayerConv: public Layer<Dtype> {
   uint32_t stride_y_;       // Column stride
   uint32_t out_width_;      // Output width
   uint32_t out_height_;     // Output height
+  std::vector<Dtype> col_;      // Unfolded input patches (im2col)
+  std::vector<Dtype> out_col_;  // Output (or its derivatives), channel first
+  bool               winograd_;        // Use the Winograd algorithm?
+  bool               winograd_dirty_;  // Transformed filters out of date?
+  std::vector<Dtype> winograd_u_;      // Transformed filters
+  std::vector<Dtype> winograd_v_;      // Transformed input tiles
+  std::vector<Dtype> winograd_m_;      // Transformed output tiles
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Unfold the input patches into a column matrix (im2col).
+   * Each row is a (input channel, filter y, filter x) triplet and each
+   * column a (batch, output y, output x) triplet.
+   * Out-of-bounds (padded) values are set to 0.
+   *
+   *  \param[in]  in_data   : input activations
+   *  \param[in]  batch_size: batch size
+   *
+   *  \param[out] col_data  : column matrix
+   */
+  void Im2Col(const Dtype* in_data, uint32_t batch_size,
+              Dtype* col_data) const {
+    uint32_t in_width  = Parent::in_[0]->size[0];
+    uint32_t in_height = Parent::in_[0]->size[1];
+    uint32_t num_input = Parent::in_[0]->size[2];
+    uint32_t out_size  = out_width_ * out_height_;
+    size_t   col_width = size_t(out_size) * batch_size;
+
+    // One row per task
+    uint32_t filter_size = filter_width_ * filter_height_;
+    ParallelFor(0, size_t(num_input) * filter_size, [&](size_t row) {
+      uint32_t in_channel = uint32_t(row / filter_size);
+      uint32_t y          = uint32_t(row % filter_size) / filter_width_;
+      uint32_t x          = uint32_t(row % filter_size) % filter_width_;
+      for (uint32_t batch = 0; batch < batch_size; ++batch) {
+        const Dtype* in_plane = in_data +
+          (size_t(batch) * num_input + in_channel) * in_width * in_height;
+        Dtype* col = col_data + row * col_width + size_t(batch) * out_size;
+        int32_t in_y = int32_t(y) - int32_t(padding_y_);
+        for (uint32_t out_y = 0; out_y < out_height_;
+          in_y += stride_y_, ++out_y, col += out_width_) {
+          if (in_y < 0 || uint32_t(in_y) >= in_height) {
+            std::fill(col, col + out_width_, Dtype(0));
+            continue;
+          }
+          const Dtype* in_row = in_plane + size_t(in_y) * in_width;
+          int32_t in_x = int32_t(x) - int32_t(padding_x_);
+          for (uint32_t out_x = 0; out_x < out_width_;
+            in_x += stride_x_, ++out_x) {
+            col[out_x] = (in_x < 0 || uint32_t(in_x) >= in_width) ?
+                         Dtype(0) : in_row[in_x];
+          }
+        }
+      }
+    });
+  }
+
+  /*!
+   * Fold a column matrix back onto the input (col2im).
+   * This is the transpose of Im2Col: values are accumulated.
+   *
+   *  \param[in]  col_data  : column matrix
+   *  \param[in]  batch_size: batch size
+   *
+   *  \param[out] in_data   : input (accumulated)
+   */
+  void Col2Im(const Dtype* col_data, uint32_t batch_size,
+              Dtype* in_data) const {
+    uint32_t in_width  = Parent::in_[0]->size[0];
+    uint32_t in_height = Parent::in_[0]->size[1];
+    uint32_t num_input = Parent::in_[0]->size[2];
+    uint32_t out_size  = out_width_ * out_height_;
+    size_t   col_width = size_t(out_size) * batch_size;
+
+    // One input plane per task: the planes are accumulated independently
+    ParallelFor(0, size_t(batch_size) * num_input, [&](size_t plane) {
+      uint32_t batch      = uint32_t(plane / num_input);
+      uint32_t in_channel = uint32_t(plane % num_input);
+      Dtype*   in_plane   = in_data + plane * in_width * in_height;
+      for (uint32_t y = 0; y < filter_height_; ++y) {
+        for (uint32_t x = 0; x < filter_width_; ++x) {
+          size_t row = (size_t(in_channel) * filter_height_ + y) *
+                       filter_width_ + x;
+          const Dtype* col = col_data + row * col_width +
+                             size_t(batch) * out_size;
+          int32_t in_y = int32_t(y) - int32_t(padding_y_);
+          for (uint32_t out_y = 0; out_y < out_height_;
+            in_y += stride_y_, ++out_y, col += out_width_) {
+            if (in_y < 0 || uint32_t(in_y) >= in_height) {
+              continue;
+            }
+            Dtype* in_row = in_plane + size_t(in_y) * in_width;
+            int32_t in_x = int32_t(x) - int32_t(padding_x_);
+            for (uint32_t out_x = 0; out_x < out_width_;
+              in_x += stride_x_, ++out_x) {
+              if (in_x >= 0 && uint32_t(in_x) < in_width) {
+                in_row[in_x] += col[out_x];
+              }
+            }
+          }
+        }
+      }
+    });
+  }
+
+
+  /*!
+   * Transform the 3x3 filters for the Winograd F(2x2, 3x3) algorithm:
+   *   U = G * g * G^T
+   * The 4x4 transformed filters are stored as 16 matrices of
+   * num_row * num_col values, one per element of the 4x4 tile.
+   * For the forward pass, the rows are the output channels and the columns
+   * the input channels. For the backward pass (rotate), the filters are
+   * rotated by 180 degrees and the rows are the input channels.
+   *
+   *  \param[in]  filter_data: filters
+   *  \param[in]  num_input  : number of input channels
+   *  \param[in]  rotate     : rotate and transpose the filters?
+   *
+   *  \param[out] u          : transformed filters
+   */
+  void WinogradFilter(const Dtype* filter_data, uint32_t num_input,
+                      bool rotate, std::vector<Dtype>* u) const {
+    uint32_t num_row = rotate ? num_input : num_output_;
+    uint32_t num_col = rotate ? num_output_ : num_input;
+    size_t   stride  = size_t(num_row) * num_col;
+    u->resize(16 * stride);
+
+    ParallelFor(0, num_output_, [&](size_t out_channel) {
+      for (uint32_t in_channel = 0; in_channel < num_input; ++in_channel) {
+        const Dtype* f = filter_data +
+                         (size_t(out_channel) * num_input + in_channel) * 9;
+        Dtype g[9];
+        for (uint32_t i = 0; i < 9; ++i) {
+          g[i] = rotate ? f[8 - i] : f[i];
+        }
+
+        // t = G * g
+        Dtype t[12];
+        for (uint32_t x = 0; x < 3; ++x) {
+          t[x    ] = g[x];
+          t[x + 3] = Dtype(0.5) * (g[x] + g[x + 3] + g[x + 6]);
+          t[x + 6] = Dtype(0.5) * (g[x] - g[x + 3] + g[x + 6]);
+          t[x + 9] = g[x + 6];
+        }
+
+        // U = t * G^T
+        size_t offset = rotate ?
+                        size_t(in_channel)  * num_col + out_channel :
+                        size_t(out_channel) * num_col + in_channel;
+        Dtype* dst = &(*u)[offset];
+        for (uint32_t y = 0; y < 4; ++y) {
+          const Dtype* r = &t[y * 3];
+          dst[(y * 4    ) * stride] = r[0];
+          dst[(y * 4 + 1) * stride] = Dtype(0.5) * (r[0] + r[1] + r[2]);
+          dst[(y * 4 + 2) * stride] = Dtype(0.5) * (r[0] - r[1] + r[2]);
+          dst[(y * 4 + 3) * stride] = r[2];
+        }
+      }
+    });
+  }
+
+  /*!
+   * 3x3, stride 1 convolution of one image with the Winograd F(2x2, 3x3)
+   * algorithm. Each 2x2 output tile is computed from a 4x4 input tile:
+   *   Y = A^T * [U . (B^T * d * B)] * A
+   * The element-wise products of all the tiles are batched as 16 matrix
+   * multiplications (one per element of the 4x4 tile), which uses
+   * 16 multiplications per tile instead of 36.
+   *
+   *  \param[in]  in_data   : input image
+   *  \param[in]  num_input : number of input channels
+   *  \param[in]  in_width  : input width
+   *  \param[in]  in_height : input height
+   *  \param[in]  padding_x : row padding
+   *  \param[in]  padding_y : column padding
+   *  \param[in]  u         : transformed filters (see WinogradFilter)
+   *  \param[in]  num_output: number of output channels
+   *  \param[in]  out_width : output width
+   *  \param[in]  out_height: output height
+   *  \param[in]  accumulate: accumulate into the output?
+   *
+   *  \param[out] out_data  : output image
+   */
+  void WinogradConv(const Dtype* in_data, uint32_t num_input,
+                    uint32_t in_width, uint32_t in_height,
+                    uint32_t padding_x, uint32_t padding_y,
+                    const Dtype* u, uint32_t num_output,
+                    uint32_t out_width, uint32_t out_height,
+                    bool accumulate, Dtype* out_data) {
+    uint32_t tile_width  = (out_width  + 1) / 2;
+    uint32_t tile_height = (out_height + 1) / 2;
+    uint32_t num_tile    = tile_width * tile_height;
+    size_t   v_stride    = size_t(num_input)  * num_tile;
+    size_t   m_stride    = size_t(num_output) * num_tile;
+    winograd_v_.resize(16 * v_stride);
+    winograd_m_.resize(16 * m_stride);
+
+    // V = B^T * d * B
+    ParallelFor(0, num_input, [&](size_t in_channel) {
+      const Dtype* in_plane = in_data +
+                              size_t(in_channel) * in_width * in_height;
+      Dtype* v = &winograd_v_[size_t(in_channel) * num_tile];
+      for (uint32_t ty = 0, tile = 0; ty < tile_height; ++ty) {
+        for (uint32_t tx = 0; tx < tile_width; ++tx, ++tile) {
+          // Load the 4x4 input tile (0 outside of the image)
+          Dtype d[16];
+          int32_t y0 = int32_t(ty * 2) - int32_t(padding_y);
+          int32_t x0 = int32_t(tx * 2) - int32_t(padding_x);
+          for (int32_t y = 0; y < 4; ++y) {
+            int32_t in_y = y0 + y;
+            bool    in_h = in_y >= 0 && uint32_t(in_y) < in_height;
+            for (int32_t x = 0; x < 4; ++x) {
+              int32_t in_x = x0 + x;
+              d[y * 4 + x] = (in_h && in_x >= 0 &&
+                              uint32_t(in_x) < in_width) ?
+                             in_plane[size_t(in_y) * in_width + in_x] :
+                             Dtype(0);
+            }
+          }
+
+          // t = B^T * d
+          Dtype t[16];
+          for (uint32_t x = 0; x < 4; ++x) {
+            t[x     ] = d[x    ] - d[x + 8];
+            t[x +  4] = d[x + 4] + d[x + 8];
+            t[x +  8] = d[x + 8] - d[x + 4];
+            t[x + 12] = d[x + 4] - d[x + 12];
+          }
+
+          // V = t * B
+          for (uint32_t y = 0; y < 4; ++y) {
+            const Dtype* r = &t[y * 4];
+            v[(y * 4    ) * v_stride + tile] = r[0] - r[2];
+            v[(y * 4 + 1) * v_stride + tile] = r[1] + r[2];
+            v[(y * 4 + 2) * v_stride + tile] = r[2] - r[1];
+            v[(y * 4 + 3) * v_stride + tile] = r[1] - r[3];
+          }
+        }
+      }
+    });
+
+    // M = U * V
+    ParallelFor(0, 16, [&](size_t xi) {
+      Gemm(false, false, num_output, num_tile, num_input,
+           Dtype(1), u + xi * size_t(num_output) * num_input, num_input,
+           &winograd_v_[xi * v_stride], num_tile,
+           Dtype(0), &winograd_m_[xi * m_stride], num_tile);
+    });
+
+    // Y = A^T * M * A
+    ParallelFor(0, num_output, [&](size_t out_channel) {
+      Dtype* out_plane = out_data +
+                         size_t(out_channel) * out_width * out_height;
+      const Dtype* m = &winograd_m_[size_t(out_channel) * num_tile];
+      for (uint32_t ty = 0, tile = 0; ty < tile_height; ++ty) {
+        for (uint32_t tx = 0; tx < tile_width; ++tx, ++tile) {
+          // t = A^T * M
+          Dtype t[8];
+          for (uint32_t x = 0; x < 4; ++x) {
+            Dtype m0 = m[(x     ) * m_stride + tile];
+            Dtype m1 = m[(x +  4) * m_stride + tile];
+            Dtype m2 = m[(x +  8) * m_stride + tile];
+            Dtype m3 = m[(x + 12) * m_stride + tile];
+            t[x    ] = m0 + m1 + m2;
+            t[x + 4] = m1 - m2 - m3;
+          }
+
+          // Y = t * A
+          Dtype y[4] = {
+            t[0] + t[1] + t[2], t[1] - t[2] - t[3],
+            t[4] + t[5] + t[6], t[5] - t[6] - t[7]
+          };
+          for (uint32_t dy = 0; dy < 2; ++dy) {
+            uint32_t out_y = ty * 2 + dy;
+            if (out_y >= out_height) {
+              break;
+            }
+            for (uint32_t dx = 0; dx < 2; ++dx) {
+              uint32_t out_x = tx * 2 + dx;
+              if (out_x >= out_width) {
+                break;
+              }
+              Dtype& dst = out_plane[size_t(out_y) * out_width + out_x];
+              dst = accumulate ? dst + y[dy * 2 + dx] : y[dy * 2 + dx];
+            }
+          }
+        }
+      }
+    });
+  }
 
 
   // Public methods
@@ -90,6 +386,7 @@ class LayerConv: public Layer<Dtype> {
     param.Get("padding_y"    , &padding_y_);
     param.Get("stride_x"     , &stride_x_);
     param.Get("stride_y"     , &stride_y_);
+    param.Get("use_winograd" , true, &winograd_);
 
     // Calculate the output width and height based on padding and stride
     out_width_ = (Parent::in_[0]->size[0] +
@@ -97,6 +394,14 @@ class LayerConv: public Layer<Dtype> {
     out_height_ = (Parent::in_[0]->size[1] +
                   2 * padding_y_ - filter_height_) / stride_y_ + 1;
 
+    // The Winograd algorithm only handles 3x3 filters with a stride of 1.
+    // The padding is limited to 2 so the backward pass (a convolution
+    // padded by 2 - padding) can use it too.
+    winograd_       = winograd_ && filter_width_ == 3 && filter_height_ == 3 &&
+                      stride_x_ == 1 && stride_y_ == 1 &&
+                      padding_x_ <= 2 && padding_y_ <= 2;
+    winograd_dirty_ = true;
+
     // Number of inputs
     uint32_t num_input = Parent::in_[0]->size[2];
 
@@ -125,6 +430,46 @@ class LayerConv: public Layer<Dtype> {
    */
   virtual ~LayerConv() {}
 
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    // Direct convolution count, whatever the algorithm (Winograd)
+    // 1 multiply-add per filter tap and output, plus the bias
+    uint64_t num_out = Parent::out_[0]->ShapeSize();
+    uint64_t flop    = 2 * num_out * filter_width_ * filter_height_ *
+                       Parent::in_[0]->size[2];
+    return flop + (Parent::weight_.size() > 1 ? num_out : 0);
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    // Filter and input derivatives, plus the bias derivative
+    uint64_t num_out = Parent::out_[0]->ShapeSize();
+    uint64_t flop    = 4 * num_out * filter_width_ * filter_height_ *
+                       Parent::in_[0]->size[2];
+    return flop + (Parent::weight_.size() > 1 ? num_out : 0);
+  }
+
+  /*!
+   * Invalidate the transformed filters (see Layer::InvalidateCache).
+   */
+  virtual void InvalidateCache() {
+    winograd_dirty_ = true;
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -139,66 +484,70 @@ class LayerConv: public Layer<Dtype> {
     const Dtype* bias_data   = (Parent::weight_.size() > 1) ?
                                Parent::weight_[1]->Data() : nullptr;
 
-    uint32_t in_width   = Parent::in_[0]->size[0];
-    uint32_t in_height  = Parent::in_[0]->size[1];
     uint32_t num_input  = Parent::in_[0]->size[2];
     uint32_t batch_size = Parent::in_[0]->size[3];
+    uint32_t out_size   = out_width_ * out_height_;
+    uint32_t col_height = num_input * filter_height_ * filter_width_;
+    uint32_t col_width  = out_size * batch_size;
+    if (!col_width) {
+      return;
+    }
 
     // out = filter * in + bias
-    // Notes: This is a fairly non-optimized way to perform convolution
-    //        One trick is to linearize all the images of the mini-batch into a
-    //        big 2D matrix (down from a 4D matrix), effectively converting one
-    //        images into a 1D column, each row storing a different image from
-    //        the mini-batch
-    //        We also should be using a good linear algebra library (BLAS,
-    //        Eigen, etc.) to perform the matrix multiplication: it will be
-    //        much faster and padding/stride will be handled more efficiently
-    //        All these optimizations are beyond the scope of this project but
-    //        would be welcome additions
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      uint32_t in_offset  = in_width   * in_height   * num_input   * batch;
-      uint32_t out_offset = out_width_ * out_height_ * num_output_ * batch;
-      for (uint32_t channel = 0; channel < num_output_; ++channel) {
-        int32_t start_x = -padding_x_;
-        for (uint32_t out_x = 0; out_x < out_width_; start_x += stride_x_,
-          ++out_x) {
-          int32_t start_y = -padding_y_;
-          for (uint32_t out_y = 0; out_y < out_height_; start_y += stride_y_,
-            ++out_y) {
-            Dtype val = Dtype(0);
-            for (uint32_t x = 0; x < filter_width_; ++x) {
-              int32_t in_x = start_x + x;
-              if (in_x < 0 || uint32_t(in_x) >= in_width) {
-                continue;
-              }
-              for (uint32_t y = 0; y < filter_height_; ++y) {
-                int32_t in_y = start_y + y;
-                if (in_y < 0 || uint32_t(in_y) >= in_height) {
-                  continue;
-                }
-                for (uint32_t in_channel = 0; in_channel < num_input;
-                  ++in_channel) {
-                  uint32_t filter_index =
-                    ((channel * num_input + in_channel) * filter_height_ + y) *
-                    filter_width_ + x;
-                  uint32_t in_index =
-                    in_offset + (in_channel * in_height + in_y) * in_width +
-                    in_x;
-                  val += in_data[in_index] * filter_data[filter_index];
-                }
-              }
-            }
-            uint32_t out_index =
-              out_offset + (channel * out_height_ + out_y) * out_width_ +
-              out_x;
-            if (bias_data) {
-              val += bias_data[channel];
+    // 3x3, stride 1 filters: Winograd algorithm, image by image.
+    // The filters are transformed once after each weights update (see
+    // InvalidateCache).
+    if (winograd_) {
+      uint32_t in_width  = Parent::in_[0]->size[0];
+      uint32_t in_height = Parent::in_[0]->size[1];
+      size_t   in_size   = size_t(in_width) * in_height * num_input;
+      if (winograd_dirty_) {
+        WinogradFilter(filter_data, num_input, false, &winograd_u_);
+        winograd_dirty_ = false;
+      }
+      for (uint32_t batch = 0; batch < batch_size; ++batch) {
+        Dtype* out = out_data + size_t(batch) * num_output_ * out_size;
+        WinogradConv(in_data + batch * in_size, num_input, in_width, in_height,
+                     padding_x_, padding_y_, &winograd_u_[0], num_output_,
+                     out_width_, out_height_, false, out);
+        if (bias_data) {
+          ParallelFor(0, num_output_, [&](size_t channel) {
+            Dtype* dst = out + channel * out_size;
+            for (uint32_t i = 0; i < out_size; ++i) {
+              dst[i] += bias_data[channel];
             }
-            out_data[out_index] = val;
-          }
+          });
         }
       }
+      return;
     }
+
+    // Other filters: the convolution is lowered to a matrix multiplication
+    // (im2col): we unfold every filter-sized patch of every image of the
+    // mini-batch into one column of a big 2D matrix, so the convolution
+    // becomes a single matrix multiplication between the filter matrix
+    // (num_output * col_height) and the column matrix
+    // (col_height * col_width)
+    col_.resize(size_t(col_height) * col_width);
+    out_col_.resize(size_t(num_output_) * col_width);
+    Im2Col(in_data, batch_size, &col_[0]);
+    Gemm(false, false, num_output_, col_width, col_height,
+         Dtype(1), filter_data, col_height, &col_[0], col_width,
+         Dtype(0), &out_col_[0], col_width);
+
+    // The matrix multiplication output is ordered channel first: reorder it
+    // (batch first) while adding the bias
+    ParallelFor(0, size_t(batch_size) * num_output_, [&](size_t slice) {
+      uint32_t     batch   = uint32_t(slice / num_output_);
+      uint32_t     channel = uint32_t(slice % num_output_);
+      const Dtype* src     = &out_col_[size_t(channel) * col_width +
+                                       size_t(batch) * out_size];
+      Dtype*       dst     = out_data + slice * out_size;
+      Dtype bias = bias_data ? bias_data[channel] : Dtype(0);
+      for (uint32_t i = 0; i < out_size; ++i) {
+        dst[i] = src[i] + bias;
+      }
+    });
   }
 
   /*!
@@ -210,64 +559,91 @@ class LayerConv: public Layer<Dtype> {
    */
   virtual void Backward(const State& state) {
     const Dtype* out_deriv_data    = Parent::out_[0]->DerivData();
-    const Dtype* in_data           = Parent::in_[0]->Data();
     Dtype*       in_deriv_data     = Parent::in_[0]->DerivData();
     const Dtype* filter_data       = Parent::weight_[0]->Data();
     Dtype*       filter_deriv_data = Parent::weight_[0]->DerivData();
     Dtype*       bias_deriv_data   = (Parent::weight_.size() > 1) ?
                                      Parent::weight_[1]->DerivData() : nullptr;
 
-    uint32_t in_width   = Parent::in_[0]->size[0];
-    uint32_t in_height  = Parent::in_[0]->size[1];
     uint32_t num_input  = Parent::in_[0]->size[2];
     uint32_t batch_size = Parent::in_[0]->size[3];
+    uint32_t out_size   = out_width_ * out_height_;
+    uint32_t col_height = num_input * filter_height_ * filter_width_;
+    uint32_t col_width  = out_size * batch_size;
+    if (!col_width) {
+      return;
+    }
 
-    // in_deriv     = filter * out_deriv
-    // filter_deriv = in * out_deriv
-    // bias_deriv   = out_deriv
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      uint32_t in_offset  = in_width   * in_height   * num_input   * batch;
-      uint32_t out_offset = out_width_ * out_height_ * num_output_ * batch;
-      for (uint32_t channel = 0; channel < num_output_; ++channel) {
-        int32_t start_x = -padding_x_;
-        for (uint32_t out_x = 0; out_x < out_width_; start_x += stride_x_,
-          ++out_x) {
-          int32_t start_y = -padding_y_;
-          for (uint32_t out_y = 0; out_y < out_height_; start_y += stride_y_,
-            ++out_y) {
-            uint32_t deriv_index = out_offset +
-              (channel * out_height_ + out_y) * out_width_ + out_x;
-            Dtype dv = out_deriv_data[deriv_index];
-            for (uint32_t x = 0; x < filter_width_; ++x) {
-              int32_t in_x = start_x + x;
-              if (in_x < 0 || uint32_t(in_x) >= in_width) {
-                continue;
-              }
-              for (uint32_t y = 0; y < filter_height_; ++y) {
-                int32_t in_y = start_y + y;
-                if (in_y < 0 || uint32_t(in_y) >= in_height) {
-                  continue;
-                }
-                for (uint32_t in_channel = 0; in_channel < num_input;
-                  ++in_channel) {
-                  uint32_t filter_index =
-                    ((channel * num_input + in_channel) * filter_height_ + y) *
-                    filter_width_ + x;
-                  uint32_t in_index =
-                    in_offset + (in_channel * in_height + in_y) * in_width +
-                    in_x;
-                  in_deriv_data[in_index] += filter_data[filter_index] * dv;
-                  filter_deriv_data[filter_index] += in_data[in_index] * dv;
-                }
-              }
-            }
-            if (bias_deriv_data) {
-              bias_deriv_data[channel] += dv;
-            }
-          }
+    // The Winograd forward pass does not unfold the input: we need it
+    // for the filter derivatives
+    col_.resize(size_t(col_height) * col_width);
+    out_col_.resize(size_t(num_output_) * col_width);
+    if (winograd_) {
+      Im2Col(Parent::in_[0]->Data(), batch_size, &col_[0]);
+    }
+
+    // Reorder the output derivatives channel first (same layout as the
+    // forward matrix multiplication output)
+    // bias_deriv = out_deriv
+    // One channel per task: each channel sums its own bias derivative
+    ParallelFor(0, num_output_, [&](size_t channel) {
+      Dtype sum = Dtype(0);
+      for (uint32_t batch = 0; batch < batch_size; ++batch) {
+        const Dtype* src = out_deriv_data +
+                           (size_t(batch) * num_output_ + channel) * out_size;
+        Dtype*       dst = &out_col_[channel * col_width +
+                                     size_t(batch) * out_size];
+        for (uint32_t i = 0; i < out_size; ++i) {
+          dst[i] = src[i];
+          sum   += src[i];
         }
       }
+      if (bias_deriv_data) {
+        bias_deriv_data[channel] += sum;
+      }
+    });
+
+    // filter_deriv = out_deriv * in
+    // The column matrix still holds the unfolded input from the forward pass
+    auto filter_deriv = [&]() {
+      Gemm(false, true, num_output_, col_height, col_width,
+           Dtype(1), &out_col_[0], col_width, &col_[0], col_width,
+           Dtype(1), filter_deriv_data, col_height);
+    };
+
+    // in_deriv = filter * out_deriv
+    // With 3x3, stride 1 filters, this is a convolution of the output
+    // derivatives with the rotated filters, padded by 2 - padding:
+    // we use the Winograd algorithm. The weights are about to be updated,
+    // so the forward transformed filters can be overwritten.
+    // It does not touch the column matrix, so it runs in parallel with the
+    // filter derivatives.
+    if (winograd_) {
+      uint32_t in_width  = Parent::in_[0]->size[0];
+      uint32_t in_height = Parent::in_[0]->size[1];
+      size_t   in_size   = size_t(in_width) * in_height * num_input;
+      TaskGroup group;
+      group.Run(filter_deriv);
+      WinogradFilter(filter_data, num_input, true, &winograd_u_);
+      winograd_dirty_ = true;
+      for (uint32_t batch = 0; batch < batch_size; ++batch) {
+        WinogradConv(out_deriv_data + size_t(batch) * num_output_ * out_size,
+                     num_output_, out_width_, out_height_,
+                     2 - padding_x_, 2 - padding_y_, &winograd_u_[0],
+                     num_input, in_width, in_height, true,
+                     in_deriv_data + batch * in_size);
+      }
+      group.Wait();
+      return;
     }
+    filter_deriv();
+
+    // Other filters: we calculate the derivatives of the column matrix
+    // (re-using its storage) and fold them back onto the input
+    Gemm(true, false, col_height, col_width, num_output_,
+         Dtype(1), filter_data, col_height, &out_col_[0], col_width,
+         Dtype(0), &col_[0], col_width);
+    Col2Im(&col_[0], batch_size, in_deriv_data);
   }
 };
 
@@ -29,6 +29,8 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/eltwise.h>
+#include <core/thread_pool.h>
 #include <memory>
 #include <limits>
 #include <random>
@@ -75,9 +77,6 @@ class LayerDropout: public Layer<Dtype> {
     // Probability to drop
     param.Get("prob", &prob_);
 
-    // Create the mask and initialize it to 0
-    Parent::out_[1] = std::make_shared<Mat<Dtype>>(Parent::in_[0]->size);
-
     // Create 2 outputs, same size as the input
     // The first input is the result of the dropout, the second is the mask
     // There's no derivative for the mask as we don't try to learn it
@@ -92,6 +91,18 @@ class LayerDropout: public Layer<Dtype> {
    */
   virtual ~LayerDropout() {}
 
+  /*!
+   * Get the input an output is a view of: the output is the input itself
+   * when nothing is dropped (e.g. testing).
+   *
+   *  \param[in]  i: output index
+   *
+   *  \return     Input index, -1 if the output has its own storage
+   */
+  virtual int ViewOf(size_t i) const {
+    return i ? -1 : 0;
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -101,40 +112,55 @@ class LayerDropout: public Layer<Dtype> {
    */
   virtual void Forward(const State& state) {
     if (state.phase != State::PHASE_TRAIN) {
-      // Dropout only during the training phase
-      Parent::out_[0]->data = Parent::in_[0]->data;
+      // Dropout only during the training phase: the output is a view of
+      // the input (no copy)
+      Parent::out_[0]->SetView(Parent::in_[0]->View());
       return;
     }
 
     // out = mask * in
     if (prob_ < std::numeric_limits<Dtype>::epsilon()) {
-      // Nothing to drop: just copy the input to the output
-      Parent::out_[0]->data = Parent::in_[0]->data;
+      // Nothing to drop: the output is a view of the input
+      Parent::out_[0]->SetView(Parent::in_[0]->View());
       Parent::out_[1]->Set(Dtype(1));
-    } else if (prob_ > Dtype(1) - std::numeric_limits<Dtype>::epsilon()) {
+      return;
+    }
+    Parent::out_[0]->ClearView();
+    if (prob_ > Dtype(1) - std::numeric_limits<Dtype>::epsilon()) {
       // Drop everything: zero out the data
       Parent::out_[0]->Zero();
       Parent::out_[1]->Zero();
     } else {
+      // One random generator per batch, seeded sequentially, so the mask
+      // can be generated in parallel
       std::random_device rd;
-      std::mt19937 gen(rd());
-      std::uniform_real_distribution<Dtype> dist(Dtype(0), Dtype(1));
-
-      Dtype* mask_data = Parent::out_[1]->Data();
-      Dtype scale = Dtype(1) / (Dtype(1) - prob_);
-      for (uint32_t i = 0; i < Parent::out_[1]->Size(); ++i) {
-        if (dist(gen) < prob_) {
-          mask_data[i] = Dtype(0);
-        } else {
-          mask_data[i] = scale;
+      uint32_t seed = rd();
+
+      Dtype*   mask_data  = Parent::out_[1]->Data();
+      Dtype    scale      = Dtype(1) / (Dtype(1) - prob_);
+      Dtype    prob       = prob_;
+      uint32_t batch_size = Parent::out_[1]->size[3];
+      size_t   data_size  = batch_size ?
+                            Parent::out_[1]->Size() / batch_size : 0;
+      ParallelFor(0, batch_size, [&](size_t batch) {
+        std::mt19937 gen(seed + uint32_t(batch));
+        std::uniform_real_distribution<Dtype> dist(Dtype(0), Dtype(1));
+        Dtype* mask = mask_data + batch * data_size;
+        for (size_t i = 0; i < data_size; ++i) {
+          if (dist(gen) < prob) {
+            mask[i] = Dtype(0);
+          } else {
+            mask[i] = scale;
+          }
         }
-      }
+      });
 
       Dtype*       out_data = Parent::out_[0]->Data();
       const Dtype* in_data  = Parent::in_[0]->Data();
-      for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-        out_data[i] = mask_data[i] * in_data[i];
-      }
+      EltwiseBinary(Parent::out_[0]->Size(), mask_data, in_data, out_data,
+                    [](Dtype mask, Dtype in) {
+        return mask * in;
+      });
     }
   }
 
@@ -151,9 +177,11 @@ class LayerDropout: public Layer<Dtype> {
     Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
 
     // in_deriv = mask * out_deriv
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      in_deriv_data[i] += mask_data[i] * out_deriv_data[i];
-    }
+    EltwiseTernary(Parent::out_[0]->Size(),
+                   mask_data, out_deriv_data, in_deriv_data, in_deriv_data,
+                   [](Dtype mask, Dtype out_deriv, Dtype in_deriv) {
+      return in_deriv + mask * out_deriv;
+    });
   }
 };
 
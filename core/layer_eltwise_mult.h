@@ -29,6 +29,7 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/eltwise.h>
 #include <memory>
 #include <vector>
 
@@ -70,6 +71,31 @@ class LayerEltwiseMult: public Layer<Dtype> {
     Parent::out_[0] = std::make_shared<Mat<Dtype>>(Parent::in_[0]->size);
   }
 
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    return Parent::out_[0]->ShapeSize();
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    // 1 multiply-add per element for each input derivative
+    return 4 * Parent::out_[0]->ShapeSize();
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -83,9 +109,10 @@ class LayerEltwiseMult: public Layer<Dtype> {
     const Dtype* in2_data = Parent::in_[1]->Data();
 
     // out = in1 . in2 ("." = Hadamard product)
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      out_data[i] = in1_data[i] * in2_data[i];
-    }
+    EltwiseBinary(Parent::out_[0]->Size(), in1_data, in2_data, out_data,
+                  [](Dtype in1, Dtype in2) {
+      return in1 * in2;
+    });
   }
 
   /*!
@@ -104,11 +131,10 @@ class LayerEltwiseMult: public Layer<Dtype> {
 
     // in1_deriv = in2 * out_deriv
     // in2_deriv = in1 * out_deriv
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      Dtype dv           = out_deriv_data[i];
-      in1_deriv_data[i] += in2_data[i] * dv;
-      in2_deriv_data[i] += in1_data[i] * dv;
-    }
+    EltwiseFma(Parent::out_[0]->Size(),
+               in2_data, out_deriv_data, in1_deriv_data, in1_deriv_data);
+    EltwiseFma(Parent::out_[0]->Size(),
+               in1_data, out_deriv_data, in2_deriv_data, in2_deriv_data);
   }
 };
 
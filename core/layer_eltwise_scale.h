@@ -29,6 +29,7 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/eltwise.h>
 #include <memory>
 #include <vector>
 
@@ -85,6 +86,30 @@ class EltwiseScaleLayer: public Layer<Dtype> {
    */
   virtual ~EltwiseScaleLayer() {}
 
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    return 2 * Parent::out_[0]->ShapeSize();
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    return 2 * Parent::out_[0]->ShapeSize();
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -97,9 +122,11 @@ class EltwiseScaleLayer: public Layer<Dtype> {
     const Dtype* in_data  = Parent::in_[0]->Data();
 
     // out = in * scale + bias
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      out_data[i] = in_data[i] * scale_ + bias_;
-    }
+    Dtype scale = scale_;
+    Dtype bias  = bias_;
+    EltwiseMap(Parent::out_[0]->Size(), in_data, out_data, [=](Dtype in) {
+      return in * scale + bias;
+    });
   }
 
   /*!
@@ -114,9 +141,7 @@ class EltwiseScaleLayer: public Layer<Dtype> {
     Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
 
     // in_deriv = out_deriv * scale
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      in_deriv_data[i] += out_deriv_data[i] * scale_;
-    }
+    EltwiseAxpy(Parent::out_[0]->Size(), scale_, out_deriv_data, in_deriv_data);
   }
 };
 
@@ -0,0 +1,150 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_LAYER_EMBED_H_
+#define CORE_LAYER_EMBED_H_
+
+
+#include <core/layer.h>
+#include <core/log.h>
+#include <core/eltwise.h>
+#include <core/thread_pool.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  LayerEmbed
+ *  \brief  Embedding lookup
+ *
+ * Each batch item of the first input is an index in the embedding table
+ * (second input, one embedding vector per row): the output is the row at
+ * this index (same as multiplying the table by a one-hot vector, without
+ * the multiplication).
+ * The table gets row-sparse derivatives: only the rows looked up have
+ * derivatives (see Mat::SetSparseDeriv).
+ */
+template <typename Dtype>
+class LayerEmbed: public Layer<Dtype> {
+  // Public types
+ public:
+  typedef Dtype         Type;
+  typedef Layer<Dtype>  Parent;
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name: layer name
+   *  \param[in]  in  : indices and embedding table
+   */
+  LayerEmbed(const char*                                     name,
+             const std::vector<std::shared_ptr<Mat<Dtype>>>& in):
+    Parent(name, in) {
+    // Make sure we have 2 inputs and they have compatible sizes
+    Check(Parent::in_.size() == 2, "Layer '%s' must have 2 inputs",
+          Parent::Name());
+    Check(Parent::in_[0]->size[0] == 1 && Parent::in_[0]->size[1] == 1 &&
+          Parent::in_[0]->size[2] == 1,
+          "Layer '%s' indices input must have a size 1x1x1xBatchSize",
+          Parent::Name());
+    Check(Parent::in_[1]->size[2] == 1 && Parent::in_[1]->size[3] == 1,
+          "Layer '%s' table input must have a size NxMx1x1",
+          Parent::Name());
+
+    // The table derivatives are row-sparse
+    Parent::in_[1]->SetSparseDeriv();
+
+    // Create 1 output, one row of the table per index
+    Parent::out_.resize(1);
+    Parent::out_[0] = std::make_shared<Mat<Dtype>>(
+      Parent::in_[1]->size[1], 1, 1, Parent::in_[0]->size[3]);
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~LayerEmbed() {}
+
+  /*!
+   * Forward pass.
+   * The forward pass calculates the outputs activations
+   * in regard to the inputs activations and weights.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {
+    Dtype*       out_data   = Parent::out_[0]->Data();
+    const Dtype* index_data = Parent::in_[0]->Data();
+    const Dtype* table_data = Parent::in_[1]->Data();
+
+    uint32_t size       = Parent::out_[0]->size[0];
+    uint32_t batch_size = Parent::out_[0]->size[3];
+
+    // out = table[index]
+    ParallelFor(0, batch_size, [&](size_t batch) {
+      const Dtype* row = table_data + uint32_t(index_data[batch]) * size;
+      std::copy(row, row + size, out_data + batch * size);
+    });
+  }
+
+  /*!
+   * Backward pass.
+   * The backward pass calculates the inputs activations and weights
+   * derivatives in regard to the outputs activations derivatives.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Backward(const State& state) {
+    const Dtype* out_deriv_data   = Parent::out_[0]->DerivData();
+    const Dtype* index_data       = Parent::in_[0]->Data();
+    Dtype*       table_deriv_data = Parent::in_[1]->DerivData();
+
+    uint32_t size       = Parent::out_[0]->size[0];
+    uint32_t batch_size = Parent::out_[0]->size[3];
+
+    // table_deriv[index] += out_deriv
+    // Sequential: several batch items can share the same index
+    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+      uint32_t index = uint32_t(index_data[batch]);
+      Parent::in_[1]->AddDerivRow(index);
+      EltwiseAxpy(size, Dtype(1), out_deriv_data + batch * size,
+                  table_deriv_data + index * size);
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_LAYER_EMBED_H_
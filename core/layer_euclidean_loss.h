@@ -28,6 +28,7 @@
 
 
 #include <core/layer_loss.h>
+#include <core/eltwise.h>
 #include <memory>
 #include <cmath>
 #include <vector>
@@ -98,12 +99,12 @@ class LayerEuclideanLoss: public LayerLoss<Dtype> {
 
     // out0 = sum((in1 - in2) * (in1 - in2))
     // out1 = (in1 - in2) * (in1 - in2)
-    Dtype inv_size = Dtype(1) / Parent::in_[0]->Size();
-    for (uint32_t i = 0; i < Parent::in_[0]->Size(); ++i) {
-      out_data[i]   = (in1_data[i] - in2_data[i]) *
-                      (in1_data[i] - in2_data[i]);
-      loss_data[0] += out_data[i] * inv_size;
-    }
+    EltwiseBinary(Parent::in_[0]->Size(), in1_data, in2_data, out_data,
+                  [](Dtype in1, Dtype in2) {
+      return (in1 - in2) * (in1 - in2);
+    });
+    loss_data[0] = EltwiseSum(Parent::in_[0]->Size(), out_data) /
+                   Parent::in_[0]->Size();
   }
 
   /*!
@@ -114,9 +115,8 @@ class LayerEuclideanLoss: public LayerLoss<Dtype> {
    *  \param[in]  state: state
    */
   virtual void Backward(const State& state) {
-    for (uint32_t i = 0; i < Parent::in_[0]->Size(); ++i) {
-      Parent::in_[0]->deriv->data[i] -= Parent::out_[1]->data[i];
-    }
+    EltwiseAxpy(Parent::in_[0]->Size(), Dtype(-1),
+                Parent::out_[1]->Data(), Parent::in_[0]->DerivData());
   }
 };
 
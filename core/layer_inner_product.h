@@ -30,6 +30,8 @@
 #include <core/layer.h>
 #include <core/log.h>
 #include <core/rand.h>
+#include <core/gemm.h>
+#include <core/thread_pool.h>
 #include <memory>
 #include <vector>
 #include <cmath>
@@ -100,6 +102,36 @@ class LayerInnerProduct: public Layer<Dtype> {
    */
   virtual ~LayerInnerProduct() {}
 
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    // 1 multiply-add per weight and batch item, plus the bias
+    uint64_t num_out = Parent::out_[0]->ShapeSize();
+    uint64_t flop    = 2 * num_out * Parent::weight_[0]->size[0];
+    return flop + (Parent::weight_.size() > 1 ? num_out : 0);
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    // Weight and input derivatives, plus the bias derivative
+    uint64_t num_out = Parent::out_[0]->ShapeSize();
+    uint64_t flop    = 4 * num_out * Parent::weight_[0]->size[0];
+    return flop + (Parent::weight_.size() > 1 ? num_out : 0);
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -118,21 +150,17 @@ class LayerInnerProduct: public Layer<Dtype> {
     uint32_t num_in    = Parent::weight_[0]->size[0];
     uint32_t num_batch = Parent::in_[0]->size[3];
 
-    // out = filter * in + bias
-    for (uint32_t batch = 0; batch < num_batch; ++batch) {
-      uint32_t in_offset  = num_in * batch;
-      uint32_t out_offset = num_out * batch;
-      for (uint32_t i = 0; i < num_out; ++i) {
-        Dtype ip = Dtype(0);
-        for (uint32_t j = 0; j < num_in; ++j) {
-          uint32_t filter_index = num_in * i + j;
-          ip += in_data[in_offset + j] * filter_data[filter_index];
-        }
-        out_data[out_offset + i] = ip;
-        if (bias_data) {
-          out_data[out_offset + i] += bias_data[i];
+    // out = in * filter^T + bias
+    Gemm(false, true, num_batch, num_out, num_in,
+         Dtype(1), in_data, num_in, filter_data, num_in,
+         Dtype(0), out_data, num_out);
+    if (bias_data) {
+      ParallelFor(0, num_batch, [&](size_t batch) {
+        Dtype* out = out_data + num_out * batch;
+        for (uint32_t i = 0; i < num_out; ++i) {
+          out[i] += bias_data[i];
         }
-      }
+      });
     }
   }
 
@@ -156,24 +184,33 @@ class LayerInnerProduct: public Layer<Dtype> {
     uint32_t num_in    = Parent::weight_[0]->size[0];
     uint32_t num_batch = Parent::in_[0]->size[3];
 
-    // in_deriv     = filter * out_deriv
-    // filter_deriv = in * out_deriv
+    // in_deriv     = out_deriv * filter
+    // filter_deriv = out_deriv^T * in
     // bias_deriv   = out_deriv
-    for (uint32_t batch = 0; batch < num_batch; ++batch) {
-      uint32_t in_offset  = num_in  * batch;
-      uint32_t out_offset = num_out * batch;
-      for (uint32_t i = 0; i < num_out; ++i) {
-        Dtype dv = out_deriv_data[out_offset + i];
-        for (uint32_t j = 0; j < num_in; ++j) {
-          uint32_t filter_index            = num_in * i + j;
-          in_deriv_data[in_offset + j]    += dv * filter_data[filter_index];
-          filter_deriv_data[filter_index] += dv * in_data[in_offset + j];
-        }
-        if (bias_deriv_data) {
-          bias_deriv_data[i] += dv;
+    // The 3 are independent: the filter and bias derivatives are computed
+    // in parallel with the input derivatives
+    auto filter_deriv = [&]() {
+      Gemm(true, false, num_out, num_in, num_batch,
+           Dtype(1), out_deriv_data, num_out, in_data, num_in,
+           Dtype(1), filter_deriv_data, num_in);
+    };
+    auto bias_deriv = [&]() {
+      for (uint32_t batch = 0; batch < num_batch; ++batch) {
+        const Dtype* out_deriv = out_deriv_data + size_t(num_out) * batch;
+        for (uint32_t i = 0; i < num_out; ++i) {
+          bias_deriv_data[i] += out_deriv[i];
         }
       }
+    };
+    TaskGroup group;
+    group.Run(filter_deriv);
+    if (bias_deriv_data) {
+      group.Run(bias_deriv);
     }
+    Gemm(false, false, num_batch, num_in, num_out,
+         Dtype(1), out_deriv_data, num_out, filter_data, num_in,
+         Dtype(1), in_deriv_data, num_in);
+    group.Wait();
   }
 };
 
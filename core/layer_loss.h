@@ -74,6 +74,17 @@ class LayerLoss: public Layer<Dtype> {
    */
   virtual ~LayerLoss() {}
 
+  /*!
+   * Set the batch size: the loss itself stays a scalar.
+   *
+   *  \param[in]  batch_size: batch size
+   */
+  virtual void SetBatchSize(uint32_t batch_size) {
+    for (size_t i = 1; i < Parent::out_.size(); ++i) {
+      Parent::out_[i]->SetBatchSize(batch_size);
+    }
+  }
+
   /*!
    * Get the loss value.
    *
@@ -0,0 +1,374 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_LAYER_LSTM_CELL_H_
+#define CORE_LAYER_LSTM_CELL_H_
+
+
+#include <core/layer.h>
+#include <core/log.h>
+#include <core/eltwise.h>
+#include <core/gemm.h>
+#include <core/thread_pool.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  LayerLstmCell
+ *  \brief  LSTM cell (one timestep of one LSTM layer)
+ *
+ * The 4 gates (input, forget, output and cell write) are stacked in a single
+ * [4H x (X+H)] weight matrix applied to the concatenation of the input (X)
+ * and the previous hidden state (H), so the cell runs one matrix
+ * multiplication and one pass for all the gates nonlinearities and the cell
+ * update (and the same for the backward pass).
+ *
+ * Inputs : input [X], previous hidden state [H], previous cell [H],
+ *          weights [4H x (X+H)] and bias [4H] (gates rows i, f, o, g);
+ *          the weights and bias are either shared by the batch (batch size of
+ *          1) or one per batch item
+ * Outputs: hidden state [H] and cell [H]
+ */
+template <typename Dtype>
+class LayerLstmCell: public Layer<Dtype> {
+  // Public types
+ public:
+  typedef Dtype         Type;
+  typedef Layer<Dtype>  Parent;
+
+
+  // Protected attributes
+ protected:
+  uint32_t           size_in_;     // Input size (X)
+  uint32_t           size_out_;    // Hidden state size (H)
+  std::vector<Dtype> xh_;          // Input and previous hidden state (X+H)
+  std::vector<Dtype> xh_deriv_;    // Derivatives of xh_
+  std::vector<Dtype> gate_;        // Activated gates (4H)
+  std::vector<Dtype> gate_deriv_;  // Gates derivatives, before activation
+  std::vector<Dtype> tanh_cell_;   // tanh(cell) (H)
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get the number of weights slices (1 if the weights are shared by the
+   * batch, the batch size otherwise).
+   *
+   *  \return Number of weights slices
+   */
+  uint32_t NumSlice() const {
+    return Parent::in_[3]->size[3] == 1 ? 1 : Parent::out_[0]->size[3];
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name: layer name
+   *  \param[in]  in  : input, previous hidden state, previous cell, weights
+   *                    and bias
+   */
+  LayerLstmCell(const char*                                     name,
+                const std::vector<std::shared_ptr<Mat<Dtype>>>& in):
+    Parent(name, in) {
+    // Make sure we have 5 inputs and they have compatible sizes
+    Check(Parent::in_.size() == 5, "Layer '%s' must have 5 inputs",
+          Parent::Name());
+    size_in_  = Parent::in_[0]->size[0];
+    size_out_ = Parent::in_[1]->size[0];
+    uint32_t batch_size = Parent::in_[0]->size[3];
+    Check(Parent::in_[0]->size[1] == 1 && Parent::in_[0]->size[2] == 1 &&
+          Parent::in_[1]->size[1] == 1 && Parent::in_[1]->size[2] == 1 &&
+          Parent::in_[1]->size[3] == batch_size &&
+          Parent::in_[2]->size[0] == size_out_ &&
+          Parent::in_[2]->size[1] == 1 && Parent::in_[2]->size[2] == 1 &&
+          Parent::in_[2]->size[3] == batch_size,
+          "Layer '%s' inputs must have compatible sizes", Parent::Name());
+    Check(Parent::in_[3]->size[0] == 4 * size_out_ &&
+          Parent::in_[3]->size[1] == size_in_ + size_out_ &&
+          Parent::in_[3]->size[2] == 1 &&
+          Parent::in_[4]->size[0] == 4 * size_out_ &&
+          Parent::in_[4]->size[1] == 1 && Parent::in_[4]->size[2] == 1 &&
+          Parent::in_[4]->size[3] == Parent::in_[3]->size[3] &&
+          (Parent::in_[3]->size[3] == 1 ||
+           Parent::in_[3]->size[3] == batch_size),
+          "Layer '%s' weights must have compatible sizes", Parent::Name());
+
+    xh_.resize(size_t(batch_size) * (size_in_ + size_out_));
+    xh_deriv_.resize(xh_.size());
+    gate_.resize(size_t(batch_size) * 4 * size_out_);
+    gate_deriv_.resize(gate_.size());
+    tanh_cell_.resize(size_t(batch_size) * size_out_);
+
+    // Create 2 outputs: hidden state and cell
+    Parent::out_.resize(2);
+    Parent::out_[0] = std::make_shared<Mat<Dtype>>(size_out_, 1, 1,
+                                                   batch_size);
+    Parent::out_[1] = std::make_shared<Mat<Dtype>>(size_out_, 1, 1,
+                                                   batch_size);
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~LayerLstmCell() {}
+
+  /*!
+   * Set the batch size: the outputs and the temporaries are resized.
+   *
+   *  \param[in]  batch_size: batch size
+   */
+  virtual void SetBatchSize(uint32_t batch_size) {
+    Check(NumSlice() == 1, "Layer '%s' can't change its batch size: its "
+          "weights are not shared", Parent::Name());
+    Parent::SetBatchSize(batch_size);
+    xh_.resize(size_t(batch_size) * (size_in_ + size_out_));
+    gate_.resize(size_t(batch_size) * 4 * size_out_);
+    tanh_cell_.resize(size_t(batch_size) * size_out_);
+    if (!xh_deriv_.empty()) {
+      xh_deriv_.resize(xh_.size());
+      gate_deriv_.resize(gate_.size());
+    }
+  }
+
+  /*!
+   * Release the derivatives (inference only), including the gates ones.
+   */
+  virtual void ReleaseDeriv() {
+    Parent::ReleaseDeriv();
+    std::vector<Dtype>().swap(xh_deriv_);
+    std::vector<Dtype>().swap(gate_deriv_);
+  }
+
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    // Gates matrix multiplication, then the gates activations and the cell
+    // and hidden state updates (19 operations per hidden unit)
+    uint64_t batch_size = Parent::out_[0]->size[3];
+    uint64_t gate       = 2 * batch_size * 4 * size_out_ *
+                          (size_in_ + size_out_);
+    return gate + 19 * batch_size * size_out_;
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    // Gates derivatives (25 operations per hidden unit), then the weight
+    // and input derivatives matrix multiplications and the bias and input
+    // derivatives accumulations
+    uint64_t batch_size = Parent::out_[0]->size[3];
+    uint64_t gate       = 4 * batch_size * 4 * size_out_ *
+                          (size_in_ + size_out_);
+    return gate + batch_size * (25 * size_out_ + 4 * size_out_ +
+                                size_in_ + size_out_);
+  }
+
+  /*!
+   * Forward pass.
+   * The forward pass calculates the outputs activations
+   * in regard to the inputs activations and weights.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {
+    const Dtype* in_data          = Parent::in_[0]->Data();
+    const Dtype* hidden_prev_data = Parent::in_[1]->Data();
+    const Dtype* cell_prev_data   = Parent::in_[2]->Data();
+    const Dtype* weight_data      = Parent::in_[3]->Data();
+    const Dtype* bias_data        = Parent::in_[4]->Data();
+    Dtype*       hidden_data      = Parent::out_[0]->Data();
+    Dtype*       cell_data        = Parent::out_[1]->Data();
+    Dtype*       xh_data          = xh_.data();
+    Dtype*       gate_data        = gate_.data();
+    Dtype*       tanh_cell_data   = tanh_cell_.data();
+
+    uint32_t x  = size_in_;
+    uint32_t h  = size_out_;
+    uint32_t xh = x + h;
+    uint32_t g  = 4 * h;
+
+    uint32_t batch_size  = Parent::out_[0]->size[3];
+    uint32_t num_slice   = NumSlice();
+    uint32_t slice_batch = batch_size / num_slice;
+
+    // xh = [in, hidden_prev]
+    ParallelFor(0, batch_size, [&](size_t b) {
+      std::copy(in_data + b * x, in_data + (b + 1) * x, xh_data + b * xh);
+      std::copy(hidden_prev_data + b * h, hidden_prev_data + (b + 1) * h,
+                xh_data + b * xh + x);
+    });
+
+    // gate = xh * weight^T (one matrix multiplication per weights slice)
+    ParallelFor(0, num_slice, [&](size_t s) {
+      Gemm(false, true, slice_batch, g, xh,
+           Dtype(1), xh_data + s * slice_batch * xh, xh,
+           weight_data + s * g * xh, xh,
+           Dtype(0), gate_data + s * slice_batch * g, g);
+    });
+
+    // i, f, o = sigmoid(gate + bias), w = tanh(gate + bias)
+    // cell    = f * cell_prev + i * w
+    // hidden  = o * tanh(cell)
+    ParallelFor(0, batch_size, [&](size_t b) {
+      Dtype*       gate      = gate_data + b * g;
+      const Dtype* bias      = bias_data + (num_slice == 1 ? 0 : b * g);
+      const Dtype* cell_prev = cell_prev_data + b * h;
+      Dtype*       cell      = cell_data + b * h;
+      Dtype*       hidden    = hidden_data + b * h;
+      Dtype*       tanh_cell = tanh_cell_data + b * h;
+      EltwiseFor(h, [=](size_t i) {
+        Dtype gate_in     = SigmoidApprox(gate[i]         + bias[i]);
+        Dtype gate_forget = SigmoidApprox(gate[h + i]     + bias[h + i]);
+        Dtype gate_out    = SigmoidApprox(gate[2 * h + i] + bias[2 * h + i]);
+        Dtype cell_write  = TanhApprox(gate[3 * h + i]    + bias[3 * h + i]);
+        Dtype cell_curr   = gate_forget * cell_prev[i] + gate_in * cell_write;
+        Dtype tanhc       = TanhApprox(cell_curr);
+        gate[i]           = gate_in;
+        gate[h + i]       = gate_forget;
+        gate[2 * h + i]   = gate_out;
+        gate[3 * h + i]   = cell_write;
+        cell[i]           = cell_curr;
+        tanh_cell[i]      = tanhc;
+        hidden[i]         = gate_out * tanhc;
+      });
+    });
+  }
+
+  /*!
+   * Backward pass.
+   * The backward pass calculates the inputs activations and weights
+   * derivatives in regard to the outputs activations derivatives.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Backward(const State& state) {
+    const Dtype* hidden_deriv_data      = Parent::out_[0]->DerivData();
+    const Dtype* cell_deriv_data        = Parent::out_[1]->DerivData();
+    const Dtype* cell_prev_data         = Parent::in_[2]->Data();
+    const Dtype* weight_data            = Parent::in_[3]->Data();
+    Dtype*       in_deriv_data          = Parent::in_[0]->DerivData();
+    Dtype*       hidden_prev_deriv_data = Parent::in_[1]->DerivData();
+    Dtype*       cell_prev_deriv_data   = Parent::in_[2]->DerivData();
+    Dtype*       weight_deriv_data      = Parent::in_[3]->DerivData();
+    Dtype*       bias_deriv_data        = Parent::in_[4]->DerivData();
+    const Dtype* xh_data                = xh_.data();
+    const Dtype* gate_data              = gate_.data();
+    const Dtype* tanh_cell_data         = tanh_cell_.data();
+    Dtype*       xh_deriv_data          = xh_deriv_.data();
+    Dtype*       gate_deriv_data        = gate_deriv_.data();
+
+    uint32_t x  = size_in_;
+    uint32_t h  = size_out_;
+    uint32_t xh = x + h;
+    uint32_t g  = 4 * h;
+
+    uint32_t batch_size  = Parent::out_[0]->size[3];
+    uint32_t num_slice   = NumSlice();
+    uint32_t slice_batch = batch_size / num_slice;
+
+    // Gates derivatives (before activation) and cell_prev_deriv
+    ParallelFor(0, batch_size, [&](size_t b) {
+      const Dtype* gate            = gate_data + b * g;
+      const Dtype* hidden_deriv    = hidden_deriv_data + b * h;
+      const Dtype* cell_deriv      = cell_deriv_data + b * h;
+      const Dtype* cell_prev       = cell_prev_data + b * h;
+      const Dtype* tanh_cell       = tanh_cell_data + b * h;
+      Dtype*       gate_deriv      = gate_deriv_data + b * g;
+      Dtype*       cell_prev_deriv = cell_prev_deriv_data + b * h;
+      EltwiseFor(h, [=](size_t i) {
+        Dtype gate_in     = gate[i];
+        Dtype gate_forget = gate[h + i];
+        Dtype gate_out    = gate[2 * h + i];
+        Dtype cell_write  = gate[3 * h + i];
+        Dtype tanhc       = tanh_cell[i];
+        Dtype dh          = hidden_deriv[i];
+        Dtype dc          = cell_deriv[i] +
+                            dh * gate_out * (Dtype(1) - tanhc * tanhc);
+        gate_deriv[i]         = dc * cell_write *
+                                gate_in * (Dtype(1) - gate_in);
+        gate_deriv[h + i]     = dc * cell_prev[i] *
+                                gate_forget * (Dtype(1) - gate_forget);
+        gate_deriv[2 * h + i] = dh * tanhc *
+                                gate_out * (Dtype(1) - gate_out);
+        gate_deriv[3 * h + i] = dc * gate_in *
+                                (Dtype(1) - cell_write * cell_write);
+        cell_prev_deriv[i]   += dc * gate_forget;
+      });
+    });
+
+    // weight_deriv += gate_deriv^T * xh
+    // bias_deriv   += sum of gate_deriv
+    // xh_deriv      = gate_deriv * weight
+    // One weights slice per task
+    ParallelFor(0, num_slice, [&](size_t s) {
+      const Dtype* gate_deriv = gate_deriv_data + s * slice_batch * g;
+      Gemm(true, false, g, xh, slice_batch,
+           Dtype(1), gate_deriv, g, xh_data + s * slice_batch * xh, xh,
+           Dtype(1), weight_deriv_data + s * g * xh, xh);
+      for (uint32_t b = 0; b < slice_batch; ++b) {
+        EltwiseAxpy(g, Dtype(1), gate_deriv + b * g,
+                    bias_deriv_data + s * g);
+      }
+      Gemm(false, false, slice_batch, xh, g,
+           Dtype(1), gate_deriv, g, weight_data + s * g * xh, xh,
+           Dtype(0), xh_deriv_data + s * slice_batch * xh, xh);
+    });
+
+    // in_deriv += xh_deriv[0:X], hidden_prev_deriv += xh_deriv[X:X+H]
+    ParallelFor(0, batch_size, [&](size_t b) {
+      EltwiseAxpy(x, Dtype(1), xh_deriv_data + b * xh,
+                  in_deriv_data + b * x);
+      EltwiseAxpy(h, Dtype(1), xh_deriv_data + b * xh + x,
+                  hidden_prev_deriv_data + b * h);
+    });
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_LAYER_LSTM_CELL_H_
@@ -29,6 +29,8 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/gemm.h>
+#include <core/thread_pool.h>
 #include <memory>
 #include <vector>
 
@@ -39,6 +41,9 @@ namespace jik {
 /*!
  *  \class  LayerMult
  *  \brief  Matrices multiplication
+ *
+ * The first matrix can have a batch size of 1 (e.g. shared weights): it is
+ * then broadcast to all the batch items of the second one.
  */
 template <typename Dtype>
 class LayerMult: public Layer<Dtype> {
@@ -64,14 +69,41 @@ class LayerMult: public Layer<Dtype> {
           Parent::Name());
     Check(Parent::in_[0]->size[1] == Parent::in_[1]->size[0] &&
           Parent::in_[0]->size[2] == Parent::in_[1]->size[2] &&
-          Parent::in_[0]->size[3] == Parent::in_[1]->size[3],
+          (Parent::in_[0]->size[3] == Parent::in_[1]->size[3] ||
+           Parent::in_[0]->size[3] == 1),
           "Layer '%s' inputs must have compatible sizes", Parent::Name());
 
     // Create 1 output
     Parent::out_.resize(1);
     Parent::out_[0] = std::make_shared<Mat<Dtype>>(
       Parent::in_[0]->size[0], Parent::in_[1]->size[1],
-      Parent::in_[0]->size[2], Parent::in_[0]->size[3]);
+      Parent::in_[0]->size[2], Parent::in_[1]->size[3]);
+  }
+
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    // 1 multiply-add per output and inner dimension element
+    return 2 * Parent::out_[0]->ShapeSize() * Parent::in_[1]->size[0];
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    // Derivatives of both inputs
+    return 4 * Parent::out_[0]->ShapeSize() * Parent::in_[1]->size[0];
   }
 
   /*!
@@ -96,26 +128,26 @@ class LayerMult: public Layer<Dtype> {
 
     uint32_t num_channel = Parent::out_[0]->size[2];
     uint32_t batch_size  = Parent::out_[0]->size[3];
+    bool     broadcast   = Parent::in_[0]->size[3] != batch_size;
+
+    if (broadcast && n == 1 && num_channel == 1) {
+      // out^T = in2^T * in1^T
+      // The batch of vectors is a single matrix multiplication
+      Gemm(false, true, batch_size, m, k,
+           Dtype(1), in2_data, k, in1_data, k,
+           Dtype(0), out_data, m);
+      return;
+    }
 
     // out = in1 * in2
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
-        uint32_t offset     = channel + num_channel * batch;
-        uint32_t in1_offset = offset * in1_size;
-        uint32_t in2_offset = offset * in2_size;
-        uint32_t out_offset = offset * out_size;
-        for (uint32_t i = 0, ia = 0, ic = 0; i < m; ++i, ia += k, ic += n) {
-          for (uint32_t j = 0, jb = 0, jc = 0; j < n; ++j, ++jb, ++jc) {
-            uint32_t index  = out_offset + jc + ic;
-            out_data[index] = Dtype(0);
-            for (uint32_t l = 0, la = 0, lb = 0; l < k; ++l, ++la, lb += n) {
-              out_data[index] += in1_data[in1_offset + la + ia] *
-                                 in2_data[in2_offset + lb + jb];
-            }
-          }
-        }
-      }
-    }
+    // One (batch, channel) slice per task
+    ParallelFor(0, size_t(batch_size) * num_channel, [&](size_t offset) {
+      size_t in1_offset = broadcast ? offset % num_channel : offset;
+      Gemm(false, false, m, n, k,
+           Dtype(1), in1_data + in1_offset * in1_size, k,
+           in2_data + offset * in2_size, n,
+           Dtype(0), out_data + offset * out_size, n);
+    });
   }
 
   /*!
@@ -143,27 +175,53 @@ class LayerMult: public Layer<Dtype> {
     uint32_t num_channel = Parent::out_[0]->size[2];
     uint32_t batch_size  = Parent::out_[0]->size[3];
 
-    // in1_deriv = in2 * out_deriv
-    // in2_deriv = in1 * out_deriv
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
-        uint32_t offset     = channel + num_channel * batch;
-        uint32_t in1_offset = offset * in1_size;
-        uint32_t in2_offset = offset * in2_size;
-        uint32_t out_offset = offset * out_size;
-        for (uint32_t i = 0; i < m; ++i) {
-          for (uint32_t j = 0; j < n; ++j) {
-            Dtype dv = out_deriv_data[out_offset + n * i + j];
-            for (uint32_t l = 0; l < k; ++l) {
-              uint32_t i1 = in1_offset + k * i + l;
-              uint32_t i2 = in2_offset + n * l + j;
-              in1_deriv_data[i1] += in2_data[i2] * dv;
-              in2_deriv_data[i2] += in1_data[i1] * dv;
-            }
-          }
-        }
+    if (Parent::in_[0]->size[3] != batch_size) {
+      if (n == 1 && num_channel == 1) {
+        // in1_deriv = out_deriv^T * in2^T
+        // in2_deriv = out_deriv^T * in1
+        Gemm(true, false, m, k, batch_size,
+             Dtype(1), out_deriv_data, m, in2_data, k,
+             Dtype(1), in1_deriv_data, k);
+        Gemm(false, false, batch_size, k, m,
+             Dtype(1), out_deriv_data, m, in1_data, k,
+             Dtype(1), in2_deriv_data, k);
+        return;
       }
+
+      // in1_deriv = sum of out_deriv * in2^T over the batch
+      // in2_deriv = in1^T * out_deriv
+      // One channel per task for in1_deriv (accumulated over the batch)
+      // and one (batch, channel) slice per task for in2_deriv
+      ParallelFor(0, num_channel, [&](size_t c) {
+        for (uint32_t b = 0; b < batch_size; ++b) {
+          size_t offset = size_t(b) * num_channel + c;
+          Gemm(false, true, m, k, n,
+               Dtype(1), out_deriv_data + offset * out_size, n,
+               in2_data + offset * in2_size, n,
+               Dtype(1), in1_deriv_data + c * in1_size, k);
+        }
+      });
+      ParallelFor(0, size_t(batch_size) * num_channel, [&](size_t offset) {
+        Gemm(true, false, k, n, m,
+             Dtype(1), in1_data + (offset % num_channel) * in1_size, k,
+             out_deriv_data + offset * out_size, n,
+             Dtype(1), in2_deriv_data + offset * in2_size, n);
+      });
+      return;
     }
+
+    // in1_deriv = out_deriv * in2^T
+    // in2_deriv = in1^T * out_deriv
+    // One (batch, channel) slice per task
+    ParallelFor(0, size_t(batch_size) * num_channel, [&](size_t offset) {
+      const Dtype* out_deriv = out_deriv_data + offset * out_size;
+      Gemm(false, true, m, k, n,
+           Dtype(1), out_deriv, n, in2_data + offset * in2_size, n,
+           Dtype(1), in1_deriv_data + offset * in1_size, k);
+      Gemm(true, false, k, n, m,
+           Dtype(1), in1_data + offset * in1_size, k, out_deriv, n,
+           Dtype(1), in2_deriv_data + offset * in2_size, n);
+    });
   }
 };
 
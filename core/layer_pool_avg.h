@@ -28,6 +28,7 @@
 
 
 #include <core/layer_pool.h>
+#include <core/thread_pool.h>
 #include <memory>
 #include <limits>
 #include <vector>
@@ -67,6 +68,34 @@ class LayerPoolAvg: public LayerPool<Dtype> {
    */
   virtual ~LayerPoolAvg() {}
 
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    // 1 addition per filter tap and output
+    return Parent::out_[0]->ShapeSize() * Parent::filter_width_ *
+           Parent::filter_height_;
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    // 1 addition per filter tap and output
+    return Parent::out_[0]->ShapeSize() * Parent::filter_width_ *
+           Parent::filter_height_;
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -84,43 +113,44 @@ class LayerPoolAvg: public LayerPool<Dtype> {
     uint32_t batch_size  = Parent::in_[0]->size[3];
 
     // out = ave(in, kernel_x, kernel_y)
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+    // One (batch, channel) plane per task
+    ParallelFor(0, size_t(batch_size) * num_channel, [&](size_t plane) {
+      uint32_t batch      = uint32_t(plane / num_channel);
+      uint32_t channel    = uint32_t(plane % num_channel);
       uint32_t in_offset  = in_width * in_height * num_channel * batch;
       uint32_t out_offset = Parent::out_width_ * Parent::out_height_ *
                             num_channel * batch;
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
-        int32_t start_x = -Parent::padding_x_;
-        for (uint32_t out_x = 0; out_x < Parent::out_width_;
-          start_x += Parent::stride_x_, ++out_x) {
-          int32_t start_y = -Parent::padding_y_;
-          for (uint32_t out_y = 0; out_y < Parent::out_height_;
-            start_y += Parent::stride_y_, ++out_y) {
-            Dtype val      = Dtype(0);
-            uint32_t count = 0;
-            for (uint32_t x = 0; x < Parent::filter_width_; ++x) {
-              int32_t in_x = start_x + x;
-              if (in_x < 0 || uint32_t(in_x) >= in_width) {
+      int32_t start_x = -Parent::padding_x_;
+      for (uint32_t out_x = 0; out_x < Parent::out_width_;
+        start_x += Parent::stride_x_, ++out_x) {
+        int32_t start_y = -Parent::padding_y_;
+        for (uint32_t out_y = 0; out_y < Parent::out_height_;
+          start_y += Parent::stride_y_, ++out_y) {
+          Dtype val      = Dtype(0);
+          uint32_t count = 0;
+          for (uint32_t x = 0; x < Parent::filter_width_; ++x) {
+            int32_t in_x = start_x + x;
+            if (in_x < 0 || uint32_t(in_x) >= in_width) {
+              continue;
+            }
+            for (uint32_t y = 0; y < Parent::filter_height_; ++y) {
+              int32_t in_y = start_y + y;
+              if (in_y < 0 || uint32_t(in_y) >= in_height) {
                 continue;
               }
-              for (uint32_t y = 0; y < Parent::filter_height_; ++y) {
-                int32_t in_y = start_y + y;
-                if (in_y < 0 || uint32_t(in_y) >= in_height) {
-                  continue;
-                }
-                uint32_t in_index =
-                  in_offset + (channel * in_height + in_y) * in_width + in_x;
-                val += in_data[in_index];
-                ++count;
-              }
+              uint32_t in_index =
+                in_offset + (channel * in_height + in_y) * in_width + in_x;
+              val += in_data[in_index];
+              ++count;
             }
-            uint32_t out_index =
-              out_offset + (channel * Parent::out_height_ + out_y) *
-              Parent::out_width_ + out_x;
-            out_data[out_index] = val / count;
           }
+          uint32_t out_index =
+            out_offset + (channel * Parent::out_height_ + out_y) *
+            Parent::out_width_ + out_x;
+          out_data[out_index] = val / count;
         }
       }
-    }
+    });
   }
 
   /*!
@@ -140,39 +170,40 @@ class LayerPoolAvg: public LayerPool<Dtype> {
     uint32_t batch_size  = Parent::in_[0]->size[3];
 
     // in_deriv = out_deriv
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+    // One (batch, channel) plane per task
+    ParallelFor(0, size_t(batch_size) * num_channel, [&](size_t plane) {
+      uint32_t batch      = uint32_t(plane / num_channel);
+      uint32_t channel    = uint32_t(plane % num_channel);
       uint32_t in_offset  = in_width * in_height * num_channel * batch;
       uint32_t out_offset = Parent::out_width_ * Parent::out_height_ *
                             num_channel * batch;
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
-        int32_t start_x = -Parent::padding_x_;
-        for (uint32_t out_x = 0; out_x < Parent::out_width_;
-          start_x += Parent::stride_x_, ++out_x) {
-          int32_t start_y = -Parent::padding_y_;
-          for (uint32_t out_y = 0; out_y < Parent::out_height_;
-            start_y += Parent::stride_y_, ++out_y) {
-            uint32_t out_index =
-              out_offset + (channel * Parent::out_height_ + out_y) *
-              Parent::out_width_ + out_x;
-            for (uint32_t x = 0; x < Parent::filter_width_; ++x) {
-              int32_t in_x = start_x + x;
-              if (in_x < 0 || uint32_t(in_x) >= in_width) {
+      int32_t start_x = -Parent::padding_x_;
+      for (uint32_t out_x = 0; out_x < Parent::out_width_;
+        start_x += Parent::stride_x_, ++out_x) {
+        int32_t start_y = -Parent::padding_y_;
+        for (uint32_t out_y = 0; out_y < Parent::out_height_;
+          start_y += Parent::stride_y_, ++out_y) {
+          uint32_t out_index =
+            out_offset + (channel * Parent::out_height_ + out_y) *
+            Parent::out_width_ + out_x;
+          for (uint32_t x = 0; x < Parent::filter_width_; ++x) {
+            int32_t in_x = start_x + x;
+            if (in_x < 0 || uint32_t(in_x) >= in_width) {
+              continue;
+            }
+            for (uint32_t y = 0; y < Parent::filter_height_; ++y) {
+              int32_t in_y = start_y + y;
+              if (in_y < 0 || uint32_t(in_y) >= in_height) {
                 continue;
               }
-              for (uint32_t y = 0; y < Parent::filter_height_; ++y) {
-                int32_t in_y = start_y + y;
-                if (in_y < 0 || uint32_t(in_y) >= in_height) {
-                  continue;
-                }
-                uint32_t in_index =
-                  in_offset + (channel * in_height + in_y) * in_width + in_x;
-                in_deriv_data[in_index] += out_deriv_data[out_index];
-              }
+              uint32_t in_index =
+                in_offset + (channel * in_height + in_y) * in_width + in_x;
+              in_deriv_data[in_index] += out_deriv_data[out_index];
             }
           }
         }
       }
-    }
+    });
   }
 };
 
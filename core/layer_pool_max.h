@@ -28,14 +28,20 @@
 
 
 #include <core/layer_pool.h>
+#include <core/thread_pool.h>
 #include <memory>
 #include <limits>
+#include <cstdint>
 #include <vector>
 
 
 namespace jik {
 
 
+// Argmax of an output whose pooling window only covers padding
+const uint16_t kNoArgmax = 0xFFFF;
+
+
 /*!
  *  \class  LayerPoolMax
  *  \brief  Matrice max pooling
@@ -48,6 +54,14 @@ class LayerPoolMax: public LayerPool<Dtype> {
   typedef LayerPool<Dtype>  Parent;
 
 
+  // Protected attributes
+ protected:
+  // Argmax of each output: offset of the max in its pooling window
+  // (x * filter_height + y), or kNoArgmax if the window is only padding
+  std::vector<uint16_t> argmax_;
+  bool                  argmax_valid_;  // Argmax recorded (training)?
+
+
   // Public methods
  public:
   /*!
@@ -60,17 +74,50 @@ class LayerPoolMax: public LayerPool<Dtype> {
   LayerPoolMax(const char*                                     name,
                const std::vector<std::shared_ptr<Mat<Dtype>>>& in,
                const Param&                                    param):
-    Parent(name, in, param) {}
+    Parent(name, in, param), argmax_valid_(false) {
+    // The argmax is stored as an offset in the pooling window
+    Check(Parent::filter_width_ * Parent::filter_height_ < kNoArgmax,
+          "Layer '%s' pooling window is too large", Parent::Name());
+  }
 
   /*!
    * Destructor.
    */
   virtual ~LayerPoolMax() {}
 
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    // 1 comparison per filter tap and output
+    return Parent::out_[0]->ShapeSize() * Parent::filter_width_ *
+           Parent::filter_height_;
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    // 1 addition per output (to its argmax)
+    return Parent::out_[0]->ShapeSize();
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
    * in regard to the inputs activations and weights.
+   * In training phase, the argmax of each output is recorded for the
+   * backward pass.
    *
    *  \param[in]  state: state
    */
@@ -83,45 +130,52 @@ class LayerPoolMax: public LayerPool<Dtype> {
     uint32_t num_channel = Parent::in_[0]->size[2];
     uint32_t batch_size  = Parent::in_[0]->size[3];
 
+    // Record the argmax only when training
+    argmax_valid_ = state.phase == State::PHASE_TRAIN;
+    uint16_t* argmax_data = nullptr;
+    if (argmax_valid_) {
+      argmax_.resize(Parent::out_[0]->Size());
+      argmax_data = &argmax_[0];
+    }
+
     // out = max(in, kernel_x, kernel_y)
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      uint32_t in_offset  = in_width * in_height * num_channel * batch;
-      uint32_t out_offset = Parent::out_width_ * Parent::out_height_ *
-                            num_channel * batch;
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
+    // One (batch, channel) plane per task
+    size_t out_size = size_t(Parent::out_width_) * Parent::out_height_;
+    ParallelFor(0, size_t(batch_size) * num_channel, [&](size_t plane) {
+      const Dtype* in_plane  = in_data + plane * in_width * in_height;
+      size_t       out_index = plane * out_size;
+      int32_t start_y = -Parent::padding_y_;
+      for (uint32_t out_y = 0; out_y < Parent::out_height_;
+        start_y += Parent::stride_y_, ++out_y) {
         int32_t start_x = -Parent::padding_x_;
         for (uint32_t out_x = 0; out_x < Parent::out_width_;
-          start_x += Parent::stride_x_, ++out_x) {
-          int32_t start_y = -Parent::padding_y_;
-          for (uint32_t out_y = 0; out_y < Parent::out_height_;
-            start_y += Parent::stride_y_, ++out_y) {
-            Dtype val = -std::numeric_limits<Dtype>::max();
-            for (uint32_t x = 0; x < Parent::filter_width_; ++x) {
-              int32_t in_x = start_x + x;
-              if (in_x < 0 || uint32_t(in_x) >= in_width) {
+          start_x += Parent::stride_x_, ++out_x, ++out_index) {
+          Dtype    val     = -std::numeric_limits<Dtype>::max();
+          uint16_t val_off = kNoArgmax;
+          for (uint32_t x = 0; x < Parent::filter_width_; ++x) {
+            int32_t in_x = start_x + x;
+            if (in_x < 0 || uint32_t(in_x) >= in_width) {
+              continue;
+            }
+            for (uint32_t y = 0; y < Parent::filter_height_; ++y) {
+              int32_t in_y = start_y + y;
+              if (in_y < 0 || uint32_t(in_y) >= in_height) {
                 continue;
               }
-              for (uint32_t y = 0; y < Parent::filter_height_; ++y) {
-                int32_t in_y = start_y + y;
-                if (in_y < 0 || uint32_t(in_y) >= in_height) {
-                  continue;
-                }
-                uint32_t in_index =
-                  in_offset + (channel * in_height + in_y) * in_width + in_x;
-                Dtype curr = in_data[in_index];
-                if (curr > val) {
-                  val = curr;
-                }
+              Dtype curr = in_plane[size_t(in_y) * in_width + in_x];
+              if (curr > val || val_off == kNoArgmax) {
+                val     = curr;
+                val_off = uint16_t(x * Parent::filter_height_ + y);
               }
             }
-            uint32_t out_index =
-              out_offset + (channel * Parent::out_height_ + out_y) *
-              Parent::out_width_ + out_x;
-            out_data[out_index] = val;
+          }
+          out_data[out_index] = val;
+          if (argmax_data) {
+            argmax_data[out_index] = val_off;
           }
         }
       }
-    }
+    });
   }
 
   /*!
@@ -133,7 +187,6 @@ class LayerPoolMax: public LayerPool<Dtype> {
    */
   virtual void Backward(const State& state) {
     const Dtype* out_deriv_data = Parent::out_[0]->DerivData();
-    const Dtype* in_data        = Parent::in_[0]->Data();
     Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
 
     uint32_t in_width    = Parent::in_[0]->size[0];
@@ -141,47 +194,34 @@ class LayerPoolMax: public LayerPool<Dtype> {
     uint32_t num_channel = Parent::in_[0]->size[2];
     uint32_t batch_size  = Parent::in_[0]->size[3];
 
-    // in_deriv = out_deriv
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      uint32_t in_offset  = in_width * in_height * num_channel * batch;
-      uint32_t out_offset = Parent::out_width_ * Parent::out_height_ *
-                            num_channel * batch;
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
+    Check(argmax_valid_ && argmax_.size() == Parent::out_[0]->Size(),
+          "Layer '%s' backward pass needs a training forward pass",
+          Parent::Name());
+
+    // in_deriv = out_deriv (scattered to the recorded argmax)
+    const uint16_t* argmax_data = &argmax_[0];
+    // One (batch, channel) plane per task
+    size_t out_size = size_t(Parent::out_width_) * Parent::out_height_;
+    ParallelFor(0, size_t(batch_size) * num_channel, [&](size_t plane) {
+      Dtype* in_plane  = in_deriv_data + plane * in_width * in_height;
+      size_t out_index = plane * out_size;
+      int32_t start_y = -Parent::padding_y_;
+      for (uint32_t out_y = 0; out_y < Parent::out_height_;
+        start_y += Parent::stride_y_, ++out_y) {
         int32_t start_x = -Parent::padding_x_;
         for (uint32_t out_x = 0; out_x < Parent::out_width_;
-          start_x += Parent::stride_x_, ++out_x) {
-          int32_t start_y = -Parent::padding_y_;
-          for (uint32_t out_y = 0; out_y < Parent::out_height_;
-            start_y += Parent::stride_y_, ++out_y) {
-            Dtype val          = -std::numeric_limits<Dtype>::max();
-            uint32_t val_index = 0;
-            for (uint32_t x = 0; x < Parent::filter_width_; ++x) {
-              int32_t in_x = start_x + x;
-              if (in_x < 0 || uint32_t(in_x) >= in_width) {
-                continue;
-              }
-              for (uint32_t y = 0; y < Parent::filter_height_; ++y) {
-                int32_t in_y = start_y + y;
-                if (in_y < 0 || uint32_t(in_y) >= in_height) {
-                  continue;
-                }
-                uint32_t in_index =
-                  in_offset + (channel * in_height + in_y) * in_width + in_x;
-                Dtype curr = in_data[in_index];
-                if (curr > val) {
-                  val       = curr;
-                  val_index = in_index;
-                }
-              }
-            }
-            uint32_t out_index =
-              out_offset + (channel * Parent::out_height_ + out_y) *
-              Parent::out_width_ + out_x;
-            in_deriv_data[val_index] += out_deriv_data[out_index];
+          start_x += Parent::stride_x_, ++out_x, ++out_index) {
+          uint16_t off = argmax_data[out_index];
+          if (off == kNoArgmax) {
+            continue;
           }
+          int32_t in_x = start_x + off / Parent::filter_height_;
+          int32_t in_y = start_y + off % Parent::filter_height_;
+          in_plane[size_t(in_y) * in_width + in_x] +=
+            out_deriv_data[out_index];
         }
       }
-    }
+    });
   }
 };
 
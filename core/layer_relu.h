@@ -29,6 +29,7 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/eltwise.h>
 #include <memory>
 #include <algorithm>
 #include <vector>
@@ -74,6 +75,30 @@ class LayerRelu: public Layer<Dtype> {
    */
   virtual ~LayerRelu() {}
 
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    return Parent::out_[0]->ShapeSize();
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    return Parent::out_[0]->ShapeSize();
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -87,9 +112,9 @@ class LayerRelu: public Layer<Dtype> {
 
     // RELU activation is thresholded at zero
     // out = in if in > 0, 0 otherwise
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      out_data[i] = std::max(Dtype(0), in_data[i]);
-    }
+    EltwiseMap(Parent::out_[0]->Size(), in_data, out_data, [](Dtype in) {
+      return std::max(Dtype(0), in);
+    });
   }
 
   /*!
@@ -105,11 +130,11 @@ class LayerRelu: public Layer<Dtype> {
     Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
 
     // in_deriv = out_deriv if out > 0, 0 otherwise
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      if (out_data[i] > Dtype(0)) {
-        in_deriv_data[i] += out_deriv_data[i];
-      }
-    }
+    EltwiseTernary(Parent::out_[0]->Size(),
+                   out_data, out_deriv_data, in_deriv_data, in_deriv_data,
+                   [](Dtype out, Dtype out_deriv, Dtype in_deriv) {
+      return (out > Dtype(0)) ? in_deriv + out_deriv : in_deriv;
+    });
   }
 };
 
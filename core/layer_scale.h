@@ -29,6 +29,8 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/eltwise.h>
+#include <core/thread_pool.h>
 #include <memory>
 #include <vector>
 
@@ -93,6 +95,33 @@ class LayerScale: public Layer<Dtype> {
    */
   virtual ~LayerScale() {}
 
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    uint64_t num_out = Parent::out_[0]->ShapeSize();
+    return (Parent::weight_.size() > 1 ? 2 : 1) * num_out;
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    // Input and scale derivatives (multiply-adds), plus the bias one
+    uint64_t num_out = Parent::out_[0]->ShapeSize();
+    return (Parent::weight_.size() > 1 ? 5 : 4) * num_out;
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -112,17 +141,8 @@ class LayerScale: public Layer<Dtype> {
     uint32_t batch_size  = Parent::out_[0]->size[3];
 
     // out = scale * in + bias
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
-        uint32_t offset = (batch * num_channel + channel) * data_size;
-        for (uint32_t i = 0; i < data_size; ++i) {
-          out_data[offset + i] = scale_data[channel] * in_data[offset + i];
-          if (bias_data) {
-            out_data[offset + i] += bias_data[channel];
-          }
-        }
-      }
-    }
+    EltwiseChannel(batch_size, num_channel, data_size,
+                   in_data, scale_data, bias_data, out_data);
   }
 
   /*!
@@ -148,19 +168,22 @@ class LayerScale: public Layer<Dtype> {
     // in_deriv    = scale * out_deriv
     // scale_deriv = in * out_deriv
     // bias_deriv  = out_deriv
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
-        uint32_t offset = (batch * num_channel + channel) * data_size;
-        for (uint32_t i = 0; i < data_size; ++i) {
-          Dtype dv                   = out_deriv_data[offset + i];
-          in_deriv_data[offset + i] += dv * scale_data[channel];
-          scale_deriv_data[channel] += dv * in_data[offset + i];
-          if (bias_deriv_data) {
-            bias_deriv_data[channel] += dv;
-          }
+    // One channel per task: each channel accumulates its own weights
+    // derivatives
+    ParallelFor(0, num_channel, [&](size_t channel) {
+      for (uint32_t batch = 0; batch < batch_size; ++batch) {
+        size_t       offset    = (size_t(batch) * num_channel + channel) *
+                                 data_size;
+        const Dtype* out_deriv = out_deriv_data + offset;
+        EltwiseAxpy(data_size, scale_data[channel], out_deriv,
+                    in_deriv_data + offset);
+        scale_deriv_data[channel] += EltwiseDot(data_size, out_deriv,
+                                                in_data + offset);
+        if (bias_deriv_data) {
+          bias_deriv_data[channel] += EltwiseSum(data_size, out_deriv);
         }
       }
-    }
+    });
   }
 };
 
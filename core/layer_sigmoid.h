@@ -29,6 +29,7 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/eltwise.h>
 #include <memory>
 #include <cmath>
 #include <vector>
@@ -74,6 +75,31 @@ class LayerSigmoid: public Layer<Dtype> {
    */
   virtual ~LayerSigmoid() {}
 
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    // Exponential, addition and division
+    return 3 * Parent::out_[0]->ShapeSize();
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    return 4 * Parent::out_[0]->ShapeSize();
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -86,9 +112,9 @@ class LayerSigmoid: public Layer<Dtype> {
     const Dtype* in_data  = Parent::in_[0]->Data();
 
     // out = 1 / (1 + exp(-in))
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      out_data[i] = Dtype(1) / (Dtype(1) + std::exp(-in_data[i]));
-    }
+    EltwiseMap(Parent::out_[0]->Size(), in_data, out_data, [](Dtype in) {
+      return SigmoidApprox(in);
+    });
   }
 
   /*!
@@ -104,10 +130,11 @@ class LayerSigmoid: public Layer<Dtype> {
     Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
 
     // in_deriv = out * (1 - out) * out_deriv
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      Dtype val         = out_data[i];
-      in_deriv_data[i] += val * (Dtype(1) - val) * out_deriv_data[i];
-    }
+    EltwiseTernary(Parent::out_[0]->Size(),
+                   out_data, out_deriv_data, in_deriv_data, in_deriv_data,
+                   [](Dtype out, Dtype out_deriv, Dtype in_deriv) {
+      return in_deriv + out * (Dtype(1) - out) * out_deriv;
+    });
   }
 };
 
@@ -28,9 +28,12 @@
 
 
 #include <core/layer_loss.h>
+#include <core/thread_pool.h>
+#include <algorithm>
 #include <memory>
 #include <cmath>
 #include <vector>
+#include <cstring>
 
 
 namespace jik {
@@ -39,6 +42,9 @@ namespace jik {
 /*!
  *  \class  LayerSoftMaxLoss
  *  \brief  Softmax + multinomial logistic loss function
+ *
+ * A negative label masks its batch item (no loss and no derivative),
+ * e.g. the timesteps after the end of the shorter sequences of a batch.
  */
 template <typename Dtype>
 class LayerSoftMaxLoss: public LayerLoss<Dtype> {
@@ -101,7 +107,7 @@ class LayerSoftMaxLoss: public LayerLoss<Dtype> {
       return;
     }
 
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+    ParallelFor(0, batch_size, [&](size_t batch) {
       // Find the max value for the current data
       uint32_t offset = batch * data_size;
       Dtype val_max   = in_data[offset];
@@ -121,12 +127,15 @@ class LayerSoftMaxLoss: public LayerLoss<Dtype> {
       for (uint32_t i = 0; i < data_size; ++i) {
         out_data[offset + i] *= sum;
       }
-    }
+    });
 
     // Cross entropy between the prediction (output of the network)
     // and the label (true probability)
     Dtype inv_size = Dtype(1) / batch_size;
     for (uint32_t batch = 0; batch < batch_size; ++batch) {
+      if (label_data[batch] < Dtype(0)) {
+        continue;
+      }
       uint32_t index = batch * data_size + uint32_t(label_data[batch]);
       loss_data[0] -= std::log(out_data[index]) * inv_size;
     }
@@ -142,16 +151,24 @@ class LayerSoftMaxLoss: public LayerLoss<Dtype> {
   virtual void Backward(const State& state) {
     Dtype*       in_deriv_data = Parent::in_[0]->DerivData();
     const Dtype* label_data    = Parent::in_[1]->Data();
+    const Dtype* prob_data     = Parent::out_[1]->Data();
 
     uint32_t data_size  = Parent::out_[1]->size[0] * Parent::out_[1]->size[1] *
                           Parent::out_[1]->size[2];
     uint32_t batch_size = Parent::out_[1]->size[3];
 
-    Parent::in_[0]->deriv->data = Parent::out_[1]->data;
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      uint32_t index        = batch * data_size + uint32_t(label_data[batch]);
-      in_deriv_data[index] -= Dtype(1);
-    }
+    // in_deriv = prob - label (one-hot), a batch at a time (no copy of the
+    // whole probabilities beforehand)
+    ParallelFor(0, batch_size, [&](size_t batch) {
+      Dtype* in_deriv = in_deriv_data + batch * data_size;
+      if (label_data[batch] < Dtype(0)) {
+        std::fill(in_deriv, in_deriv + data_size, Dtype(0));
+        return;
+      }
+      std::memcpy(in_deriv, prob_data + batch * data_size,
+                  data_size * sizeof(Dtype));
+      in_deriv[uint32_t(label_data[batch])] -= Dtype(1);
+    });
   }
 };
 
@@ -29,6 +29,7 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/eltwise.h>
 #include <memory>
 #include <cmath>
 #include <vector>
@@ -74,6 +75,30 @@ class LayerTanh: public Layer<Dtype> {
    */
   virtual ~LayerTanh() {}
 
+  /*!
+   * Get the number of floating point operations of the forward pass (see
+   * Layer::ForwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t ForwardFlop(const State& state) const {
+    return Parent::out_[0]->ShapeSize();
+  }
+
+  /*!
+   * Get the number of floating point operations of the backward pass (see
+   * Layer::BackwardFlop).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Number of operations
+   */
+  virtual uint64_t BackwardFlop(const State& state) const {
+    return 4 * Parent::out_[0]->ShapeSize();
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -86,9 +111,9 @@ class LayerTanh: public Layer<Dtype> {
     const Dtype* in_data  = Parent::in_[0]->Data();
 
     // out = tanh(in)
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      out_data[i] = std::tanh(in_data[i]);
-    }
+    EltwiseMap(Parent::out_[0]->Size(), in_data, out_data, [](Dtype in) {
+      return TanhApprox(in);
+    });
   }
 
   /*!
@@ -104,10 +129,11 @@ class LayerTanh: public Layer<Dtype> {
     Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
 
     // in_deriv = (1 - out^2) * out_deriv
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      Dtype val         = out_data[i];
-      in_deriv_data[i] += (Dtype(1) - val * val) * out_deriv_data[i];
-    }
+    EltwiseTernary(Parent::out_[0]->Size(),
+                   out_data, out_deriv_data, in_deriv_data, in_deriv_data,
+                   [](Dtype out, Dtype out_deriv, Dtype in_deriv) {
+      return in_deriv + (Dtype(1) - out * out) * out_deriv;
+    });
   }
 };
 
@@ -27,6 +27,8 @@
 #define CORE_MAT_H_
 
 
+#include <core/mat_view.h>
+#include <core/mem_pool.h>
 #include <vector>
 #include <memory>
 #include <cstring>
@@ -60,14 +62,20 @@ template <typename Dtype>
 class Mat {
   // Public types
  public:
-  typedef Dtype Type;
+  typedef Dtype                                    Type;
+  typedef std::vector<Dtype, PoolAllocator<Dtype>> Storage;
 
 
   // Public attributes
  public:
-  uint32_t                    size[4];  // Matrix size
-  std::vector<Dtype>          data;     // Matrix data
-  std::shared_ptr<Mat<Dtype>> deriv;    // Gradients matrix (jacobian)
+  uint32_t                    size[4];     // Matrix size
+  Storage                     data;        // Matrix data (pool, aligned)
+  Dtype*                      view_data;   // Viewed data (not owned),
+                                           // replacing data (see SetView)
+  std::shared_ptr<Mat<Dtype>> deriv;       // Gradients matrix (jacobian)
+  std::vector<uint32_t>       deriv_row;   // Rows having derivatives
+                                           // (row-sparse derivatives)
+  std::vector<bool>           deriv_mask;  // deriv_row as a mask
 
 
   // Public methods
@@ -77,6 +85,7 @@ class Mat {
    */
   Mat() {
     size[0] = size[1] = size[2] = size[3] = 0;
+    view_data = nullptr;
   }
 
   /*!
@@ -94,9 +103,11 @@ class Mat {
     size[1] = m;
     size[2] = d;
     size[3] = b;
+    view_data = nullptr;
     data.resize(size[0] * size[1] * size[2] * size[3], Dtype(0));
     if (init_deriv) {
-      deriv = std::make_shared<Mat<Dtype>>(size, false);
+      deriv = std::allocate_shared<Mat<Dtype>>(PoolAllocator<Mat<Dtype>>(),
+                                               size, false);
     }
   }
 
@@ -120,6 +131,9 @@ class Mat {
    *  \return Data
    */
   const Dtype* Data() const {
+    if (view_data) {
+      return view_data;
+    }
     if (data.empty()) {
       return nullptr;
     }
@@ -132,6 +146,9 @@ class Mat {
    *  \return Data
    */
   Dtype* Data() {
+    if (view_data) {
+      return view_data;
+    }
     if (data.empty()) {
       return nullptr;
     }
@@ -168,32 +185,192 @@ class Mat {
    *  \return Matrix size (1D)
    */
   uint32_t Size() const {
+    if (view_data) {
+      return uint32_t(ShapeSize());
+    }
     return uint32_t(data.size());
   }
 
+  /*!
+   * Get the number of elements of the matrix shape, whatever its storage
+   * (e.g. released by ActivationPlan).
+   *
+   *  \return Number of elements
+   */
+  size_t ShapeSize() const {
+    return size_t(size[0]) * size[1] * size[2] * size[3];
+  }
+
+  /*!
+   * Set the batch size (last dimension): the data and derivatives are
+   * resized, reusing their capacity when shrinking and growing it when
+   * needed. A view is cleared (see SetView) and a storage released by
+   * ActivationPlan stays released (the plan resizes it).
+   *
+   *  \param[in]  batch_size: batch size
+   */
+  void SetBatchSize(uint32_t batch_size) {
+    bool released = data.empty() && ShapeSize();
+    size[3] = batch_size;
+    ClearView();
+    if (!released) {
+      data.resize(ShapeSize(), Dtype(0));
+    }
+    if (deriv) {
+      deriv->SetBatchSize(batch_size);
+    }
+  }
+
   /*!
    * Set the matrix to a special value.
    *
    *  \param  val: value
    */
   void Set(Dtype val) {
-    std::fill(data.begin(), data.end(), val);
+    std::fill(Data(), Data() + Size(), val);
   }
 
   /*!
    * Zero out the matrix.
    */
   void Zero() {
-    std::memset(&data[0], 0, data.size() * sizeof(Dtype));
+    std::memset(Data(), 0, Size() * sizeof(Dtype));
+  }
+
+  /*!
+   * Get a view of the data.
+   *
+   *  \return View
+   */
+  MatView<Dtype> View() {
+    return MatView<Dtype>(Data(), size);
+  }
+
+  /*!
+   * Get a view of the derivatives.
+   *
+   *  \return View (empty if there's no derivatives)
+   */
+  MatView<Dtype> DerivView() {
+    if (!DerivData()) {
+      return MatView<Dtype>();
+    }
+    return MatView<Dtype>(DerivData(), size);
+  }
+
+  /*!
+   * Use the storage of a view instead of the matrix data, e.g. for a layer
+   * output being its input (identity) or a shard of another matrix batch:
+   * nothing is copied. The derivatives are not affected.
+   *
+   *  \param[in]  view: contiguous view, same number of elements
+   */
+  void SetView(const MatView<Dtype>& view) {
+    Check(view.Contiguous() && view.Size() == ShapeSize(),
+          "Invalid matrix view");
+    view_data = view.data;
+  }
+
+  /*!
+   * Use the matrix data again (see SetView).
+   */
+  void ClearView() {
+    view_data = nullptr;
+  }
+
+  /*!
+   * Check if the matrix is a view (see SetView).
+   *
+   *  \return View?
+   */
+  bool IsView() const {
+    return view_data != nullptr;
+  }
+
+  /*!
+   * Use row-sparse derivatives: only the rows added with AddDerivRow have
+   * derivatives (a row being a slice of the first dimension, e.g. an entry
+   * of an embedding table), the other ones are 0.
+   */
+  void SetSparseDeriv() {
+    deriv_row.clear();
+    deriv_mask.assign(size[0], false);
+  }
+
+  /*!
+   * Check if the derivatives are row-sparse.
+   *
+   *  \return Row-sparse derivatives?
+   */
+  bool SparseDeriv() const {
+    return !deriv_mask.empty();
+  }
+
+  /*!
+   * Get the size of a row (see SetSparseDeriv).
+   *
+   *  \return Row size
+   */
+  uint32_t RowSize() const {
+    return size[0] ? Size() / size[0] : 0;
+  }
+
+  /*!
+   * Add a row to the row-sparse derivatives.
+   *
+   *  \param[in]  row: row index
+   */
+  void AddDerivRow(uint32_t row) {
+    if (!deriv_mask[row]) {
+      deriv_mask[row] = true;
+      deriv_row.push_back(row);
+    }
+  }
+
+  /*!
+   * Charge the data and derivatives to a tracker, unless they already are
+   * charged to a model (see MemPool::Adopt).
+   *
+   *  \param[in]  tracker: tracker
+   */
+  void Adopt(MemTracker* tracker) const {
+    MemPool::Adopt(data.data(), tracker);
+    if (deriv) {
+      MemPool::Adopt(deriv->data.data(), tracker);
+    }
+  }
+
+  /*!
+   * Release the derivative matrix (e.g. for inference only): the matrix
+   * doesn't have any derivatives afterwards.
+   */
+  void ReleaseDeriv() {
+    deriv.reset();
+    deriv_row.clear();
+    deriv_row.shrink_to_fit();
+    deriv_mask.clear();
+    deriv_mask.shrink_to_fit();
   }
 
   /*!
    * Zero out the derivative matrix.
    */
   void ZeroDeriv() {
-    if (deriv) {
-      std::memset(&deriv->data[0], 0, deriv->data.size() * sizeof(Dtype));
+    if (!deriv) {
+      return;
+    }
+    if (SparseDeriv()) {
+      // Only the rows having derivatives
+      uint32_t row_size = RowSize();
+      for (uint32_t row : deriv_row) {
+        std::memset(&deriv->data[row * row_size], 0,
+                    row_size * sizeof(Dtype));
+        deriv_mask[row] = false;
+      }
+      deriv_row.clear();
+      return;
     }
+    std::memset(&deriv->data[0], 0, deriv->data.size() * sizeof(Dtype));
   }
 };
 
@@ -0,0 +1,190 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_MAT_VIEW_H_
+#define CORE_MAT_VIEW_H_
+
+
+#include <core/log.h>
+#include <cstdint>
+#include <cstddef>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  MatView
+ *  \brief  Non-owning view of a matrix storage
+ *
+ * A view is a pointer, a size n*m*d*b (see Mat) and a stride per dimension,
+ * so taking a range of batches (e.g. a shard per thread), a range of
+ * channels (depth) or reshaping a matrix doesn't copy anything.
+ * The viewed storage must outlive the view.
+ *
+ * A contiguous view can also back a matrix (see Mat::SetView), so a layer
+ * can take it as an input or output.
+ */
+template <typename Dtype>
+class MatView {
+  // Public types
+ public:
+  typedef Dtype Type;
+
+
+  // Public attributes
+ public:
+  Dtype*   data;       // Data (not owned)
+  uint32_t size[4];    // View size
+  size_t   stride[4];  // Strides (number of elements)
+
+
+  // Public methods
+ public:
+  /*!
+   * Default constructor: empty view.
+   */
+  MatView() {
+    data = nullptr;
+    size[0] = size[1] = size[2] = size[3] = 0;
+    stride[0] = stride[1] = stride[2] = stride[3] = 0;
+  }
+
+  /*!
+   * Constructor: contiguous view.
+   *
+   *  \param[in]  ptr: data
+   *  \param[in]  sz : size
+   */
+  MatView(Dtype* ptr, const uint32_t* sz) {
+    data = ptr;
+    for (int i = 0; i < 4; ++i) {
+      size[i] = sz[i];
+    }
+    stride[0] = 1;
+    for (int i = 1; i < 4; ++i) {
+      stride[i] = stride[i - 1] * size[i - 1];
+    }
+  }
+
+  /*!
+   * Get the number of elements.
+   *
+   *  \return Number of elements
+   */
+  size_t Size() const {
+    return size_t(size[0]) * size[1] * size[2] * size[3];
+  }
+
+  /*!
+   * Check if the view is contiguous (no gap between the elements).
+   *
+   *  \return Contiguous?
+   */
+  bool Contiguous() const {
+    size_t expected = 1;
+    for (int i = 0; i < 4; ++i) {
+      if (size[i] > 1 && stride[i] != expected) {
+        return false;
+      }
+      expected *= size[i];
+    }
+    return true;
+  }
+
+  /*!
+   * Get an element.
+   *
+   *  \param[in]  n: column
+   *  \param[in]  m: row
+   *  \param[in]  d: depth
+   *  \param[in]  b: batch
+   *
+   *  \return     Element
+   */
+  Dtype& At(uint32_t n, uint32_t m = 0, uint32_t d = 0, uint32_t b = 0) const {
+    return data[n * stride[0] + m * stride[1] + d * stride[2] +
+                b * stride[3]];
+  }
+
+  /*!
+   * Get a range of batches, e.g. the shard of a thread.
+   *
+   *  \param[in]  begin: first batch
+   *  \param[in]  end  : last batch (excluded)
+   *
+   *  \return     View
+   */
+  MatView Batch(uint32_t begin, uint32_t end) const {
+    Check(begin <= end && end <= size[3], "Invalid batch range [%d, %d[",
+          begin, end);
+    MatView view = *this;
+    view.data   += begin * stride[3];
+    view.size[3] = end - begin;
+    return view;
+  }
+
+  /*!
+   * Get a range of channels (depth).
+   *
+   *  \param[in]  begin: first channel
+   *  \param[in]  end  : last channel (excluded)
+   *
+   *  \return     View
+   */
+  MatView Channel(uint32_t begin, uint32_t end) const {
+    Check(begin <= end && end <= size[2], "Invalid channel range [%d, %d[",
+          begin, end);
+    MatView view = *this;
+    view.data   += begin * stride[2];
+    view.size[2] = end - begin;
+    return view;
+  }
+
+  /*!
+   * Reshape a contiguous view (same number of elements).
+   *
+   *  \param[in]  n: number of columns
+   *  \param[in]  m: number of rows
+   *  \param[in]  d: depth
+   *  \param[in]  b: batch size
+   *
+   *  \return     View
+   */
+  MatView Reshape(uint32_t n, uint32_t m = 1, uint32_t d = 1,
+                  uint32_t b = 1) const {
+    Check(Contiguous(), "Can't reshape a non-contiguous view");
+    Check(size_t(n) * m * d * b == Size(), "Invalid reshape");
+    uint32_t sz[4] = {n, m, d, b};
+    return MatView(data, sz);
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_MAT_VIEW_H_
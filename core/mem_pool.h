@@ -0,0 +1,533 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_MEM_POOL_H_
+#define CORE_MEM_POOL_H_
+
+
+#include <core/log.h>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+
+namespace jik {
+
+
+/*!
+ *  \class  MemTracker
+ *  \brief  Memory allocated by a model (see MemPool)
+ *
+ * Every block of the pool is charged to a tracker: the one of the current
+ * thread when it's allocated (see MemScope), or the global tracker.
+ * A model adopts the blocks of its layers (see Adopt) so it can report its
+ * memory and cap it: going over the cap is an error.
+ *
+ * The tracker is reference counted (its owner and each block charged to
+ * it) so a block can outlive the model it was charged to.
+ */
+class MemTracker {
+  // Protected attributes
+ protected:
+  std::atomic<size_t>   size_;  // Allocated memory (in bytes)
+  std::atomic<size_t>   peak_;  // Peak memory (in bytes)
+  std::atomic<size_t>   cap_;   // Memory cap (in bytes, 0 = no cap)
+  std::atomic<uint32_t> ref_;   // Reference count
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Constructor.
+   */
+  MemTracker(): size_(0), peak_(0), cap_(0), ref_(1) {}
+
+  /*!
+   * Destructor.
+   */
+  ~MemTracker() {}
+
+
+  // Public methods
+ public:
+  /*!
+   * Create a tracker, owned by the caller (see Release).
+   *
+   *  \return Tracker
+   */
+  static MemTracker* Create() {
+    return new MemTracker();
+  }
+
+  /*!
+   * Release a reference: the tracker is deleted once its owner and all the
+   * blocks charged to it are released.
+   */
+  void Release() {
+    if (ref_.fetch_sub(1) == 1) {
+      delete this;
+    }
+  }
+
+  /*!
+   * Get the global tracker: blocks allocated outside of any scope.
+   *
+   *  \return Global tracker
+   */
+  static MemTracker* Global() {
+    static MemTracker* tracker = Create();
+    return tracker;
+  }
+
+  /*!
+   * Get the tracker of the current thread.
+   *
+   *  \return Current tracker
+   */
+  static MemTracker*& Current() {
+    static thread_local MemTracker* tracker = nullptr;
+    return tracker;
+  }
+
+  /*!
+   * Charge a block.
+   *
+   *  \param[in]  size: block size (in bytes)
+   */
+  void Charge(size_t size) {
+    ref_.fetch_add(1);
+    size_t total = size_.fetch_add(size) + size;
+    size_t peak  = peak_.load();
+    while (total > peak && !peak_.compare_exchange_weak(peak, total)) {}
+    size_t cap = cap_.load();
+    if (cap && total > cap) {
+      Report(kError, "Memory cap exceeded: %ld byte(s) > %ld byte(s)",
+             total, cap);
+    }
+  }
+
+  /*!
+   * Uncharge a block.
+   *
+   *  \param[in]  size: block size (in bytes)
+   */
+  void Uncharge(size_t size) {
+    size_.fetch_sub(size);
+    Release();
+  }
+
+  /*!
+   * Get the allocated memory.
+   *
+   *  \return Allocated memory (in bytes)
+   */
+  size_t Size() const {
+    return size_.load();
+  }
+
+  /*!
+   * Get the peak memory.
+   *
+   *  \return Peak memory (in bytes)
+   */
+  size_t Peak() const {
+    return peak_.load();
+  }
+
+  /*!
+   * Get the memory cap.
+   *
+   *  \return Memory cap (in bytes, 0 = no cap)
+   */
+  size_t Cap() const {
+    return cap_.load();
+  }
+
+  /*!
+   * Set the memory cap.
+   *
+   *  \param[in]  cap: memory cap (in bytes, 0 = no cap)
+   */
+  void SetCap(size_t cap) {
+    cap_ = cap;
+    if (cap && Size() > cap) {
+      Report(kError, "Memory cap exceeded: %ld byte(s) > %ld byte(s)",
+             Size(), cap);
+    }
+  }
+};
+
+
+/*!
+ *  \class  MemScope
+ *  \brief  Charge the blocks allocated by the current thread to a tracker,
+ *          for the lifetime of the scope
+ */
+class MemScope {
+  // Protected attributes
+ protected:
+  MemTracker* prev_;  // Previous tracker
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  tracker: tracker
+   */
+  explicit MemScope(MemTracker* tracker) {
+    prev_ = MemTracker::Current();
+    MemTracker::Current() = tracker;
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~MemScope() {
+    MemTracker::Current() = prev_;
+  }
+};
+
+
+/*!
+ *  \class  MemPool
+ *  \brief  Aligned memory pool
+ *
+ * The blocks are 64-byte aligned (a AVX-512 vector or a cache line) and
+ * their size is rounded up to a size class (at most 12.5% larger), so the
+ * blocks freed are cached and reused by the next allocations of the same
+ * class instead of going back to the heap.
+ * Large blocks (2 MB and more) are not cached: they are aligned on a huge
+ * page and, on Linux, advised to use transparent huge pages (fewer TLB
+ * misses) unless the JIK_HUGE_PAGES environment variable is set to 0.
+ *
+ * Each block starts with a header (size and tracker, see MemTracker).
+ */
+class MemPool {
+  // Public attributes
+ public:
+  static const size_t kAlign    = 64;          // Alignment (in bytes)
+  static const size_t kHugePage = 2 << 20;     // Huge page size (in bytes)
+  static const size_t kMaxCache = 64 << 20;    // Maximum cached memory
+
+
+  // Protected types
+ protected:
+  /*!
+   *  \struct Header
+   *  \brief  Block header, stored kAlign bytes before the data
+   */
+  struct Header {
+    size_t      size;     // Block size (size class, including the header)
+    MemTracker* tracker;  // Tracker the block is charged to
+  };
+
+
+  // Protected attributes
+ protected:
+  std::mutex                                     lock_;        // Lock
+  std::unordered_map<size_t, std::vector<void*>> free_;        // Free blocks
+                                                               // per class
+  size_t                                         cache_size_;  // Cached
+                                                               // memory
+  bool                                           huge_page_;   // Huge pages?
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Constructor.
+   */
+  MemPool() {
+    cache_size_ = 0;
+    const char* env = std::getenv("JIK_HUGE_PAGES");
+    huge_page_ = !env || std::strcmp(env, "0");
+  }
+
+  /*!
+   * Get the header of a block.
+   *
+   *  \param[in]  ptr: block data
+   *
+   *  \return     Header
+   */
+  static Header* GetHeader(const void* ptr) {
+    return reinterpret_cast<Header*>(
+      reinterpret_cast<uintptr_t>(ptr) - kAlign);
+  }
+
+  /*!
+   * Allocate aligned memory from the heap.
+   *
+   *  \param[in]  align: alignment (in bytes)
+   *  \param[in]  size : size (in bytes)
+   *
+   *  \return     Memory
+   */
+  static void* AlignedAlloc(size_t align, size_t size) {
+#ifdef _WIN32
+    void* ptr = _aligned_malloc(size, align);
+#else
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, align, size)) {
+      ptr = nullptr;
+    }
+#endif
+    if (!ptr) {
+      Report(kError, "Out of memory: can't allocate %ld byte(s)", size);
+    }
+    return ptr;
+  }
+
+  /*!
+   * Free aligned memory (see AlignedAlloc).
+   *
+   *  \param[in]  ptr: memory
+   */
+  static void AlignedFree(void* ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    std::free(ptr);
+#endif
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Get the pool.
+   *
+   *  \return Pool
+   */
+  static MemPool& Get() {
+    // Never destroyed: blocks can be freed by static destructors
+    static MemPool* pool = new MemPool();
+    return *pool;
+  }
+
+  /*!
+   * Get the size class of a block.
+   *
+   *  \param[in]  size: block size (in bytes)
+   *
+   *  \return     Size class (in bytes)
+   */
+  static size_t ClassSize(size_t size) {
+    // 8 classes per power of two, multiple of kAlign
+    size_t step = kAlign;
+    while (step * 16 <= size) {
+      step *= 2;
+    }
+    return (size + step - 1) / step * step;
+  }
+
+  /*!
+   * Allocate a block, charged to the current tracker.
+   *
+   *  \param[in]  size: size (in bytes)
+   *
+   *  \return     Block data (kAlign-byte aligned)
+   */
+  void* Allocate(size_t size) {
+    size_t block_size = ClassSize(size + kAlign);
+    void*  block      = nullptr;
+    if (block_size < kHugePage) {
+      std::lock_guard<std::mutex> lock(lock_);
+      std::vector<void*>& list = free_[block_size];
+      if (!list.empty()) {
+        block = list.back();
+        list.pop_back();
+        cache_size_ -= block_size;
+      }
+    }
+    if (!block) {
+      if (block_size < kHugePage) {
+        block = AlignedAlloc(kAlign, block_size);
+      } else {
+        block = AlignedAlloc(kHugePage, block_size);
+#ifdef MADV_HUGEPAGE
+        if (huge_page_) {
+          madvise(block, block_size, MADV_HUGEPAGE);
+        }
+#endif
+      }
+    }
+
+    // Charge the block
+    Header* header  = reinterpret_cast<Header*>(block);
+    header->size    = block_size;
+    header->tracker = MemTracker::Current();
+    if (!header->tracker) {
+      header->tracker = MemTracker::Global();
+    }
+    header->tracker->Charge(block_size);
+    return reinterpret_cast<uint8_t*>(block) + kAlign;
+  }
+
+  /*!
+   * Free a block (see Allocate).
+   *
+   *  \param[in]  ptr: block data
+   */
+  void Deallocate(void* ptr) {
+    if (!ptr) {
+      return;
+    }
+    Header* header     = GetHeader(ptr);
+    size_t  block_size = header->size;
+    header->tracker->Uncharge(block_size);
+    if (block_size < kHugePage) {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (cache_size_ + block_size <= kMaxCache) {
+        free_[block_size].push_back(header);
+        cache_size_ += block_size;
+        return;
+      }
+    }
+    AlignedFree(header);
+  }
+
+  /*!
+   * Charge a block to a tracker, if it's still charged to the global one
+   * (i.e. not yet adopted).
+   *
+   *  \param[in]  ptr    : block data
+   *  \param[in]  tracker: tracker
+   */
+  static void Adopt(const void* ptr, MemTracker* tracker) {
+    if (!ptr) {
+      return;
+    }
+    Header* header = GetHeader(ptr);
+    if (header->tracker != MemTracker::Global() ||
+        header->tracker == tracker) {
+      return;
+    }
+    tracker->Charge(header->size);
+    header->tracker->Uncharge(header->size);
+    header->tracker = tracker;
+  }
+
+  /*!
+   * Give the cached blocks back to the heap.
+   */
+  void Trim() {
+    std::lock_guard<std::mutex> lock(lock_);
+    for (auto& list : free_) {
+      for (void* block : list.second) {
+        AlignedFree(block);
+      }
+    }
+    free_.clear();
+    cache_size_ = 0;
+  }
+
+  /*!
+   * Get the cached memory.
+   *
+   *  \return Cached memory (in bytes)
+   */
+  size_t CacheSize() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return cache_size_;
+  }
+};
+
+
+/*!
+ *  \class  PoolAllocator
+ *  \brief  Standard allocator using the memory pool (see MemPool)
+ */
+template <typename T>
+class PoolAllocator {
+  // Public types
+ public:
+  typedef T value_type;
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  PoolAllocator() {}
+
+  /*!
+   * Copy constructor (from another type).
+   */
+  template <typename U>
+  PoolAllocator(const PoolAllocator<U>&) {}  // NOLINT(runtime/explicit)
+
+  /*!
+   * Allocate memory.
+   *
+   *  \param[in]  n: number of elements
+   *
+   *  \return     Memory
+   */
+  T* allocate(size_t n) {
+    return reinterpret_cast<T*>(MemPool::Get().Allocate(n * sizeof(T)));
+  }
+
+  /*!
+   * Free memory.
+   *
+   *  \param[in]  ptr: memory
+   *  \param[in]  n  : number of elements
+   */
+  void deallocate(T* ptr, size_t n) {
+    MemPool::Get().Deallocate(ptr);
+  }
+};
+
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+  return true;
+}
+
+
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+  return false;
+}
+
+
+}  // namespace jik
+
+
+#endif  // CORE_MEM_POOL_H_
@@ -28,10 +28,14 @@
 
 
 #include <core/log.h>
+#include <core/activation_plan.h>
 #include <core/layer.h>
 #include <core/layer_data.h>
 #include <core/layer_loss.h>
+#include <core/profiler.h>
+#include <core/trace.h>
 #include <cstdio>
+#include <cstring>
 #include <memory>
 #include <vector>
 #include <string>
@@ -56,10 +60,59 @@ class Model {
 
   // Protected attributes
  protected:
-  std::string                                name_;   // Model name
-  std::vector<std::shared_ptr<Layer<Dtype>>> layer_;  // List of layers
-  std::shared_ptr<Mat<Dtype>>                in_;     // Input  of the model
-  std::shared_ptr<Mat<Dtype>>                out_;    // Output of the model
+  std::string                                name_;      // Model name
+  std::vector<std::shared_ptr<Layer<Dtype>>> layer_;     // List of layers
+  std::shared_ptr<Mat<Dtype>>                in_;        // Input  of the model
+  std::shared_ptr<Mat<Dtype>>                out_;       // Output of the model
+  ActivationPlan<Dtype>                      plan_;      // Activations plan
+  bool                                       frozen_;    // No derivatives?
+  MemTracker*                                mem_;       // Model memory
+  Profiler*                                  profiler_;  // Layers timing
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Forward pass of a layer (timed if the model has a profiler, along with
+   * its operations, bytes and performance counters).
+   *
+   *  \param[in]  i    : layer index
+   *  \param[in]  state: state
+   */
+  void ForwardLayer(size_t i, const State& state) {
+    TraceScope trace(layer_[i]->Name(), "forward");
+    if (!profiler_) {
+      layer_[i]->Forward(state);
+      return;
+    }
+    Profiler::Sample sample;
+    profiler_->Start(&sample);
+    layer_[i]->Forward(state);
+    profiler_->Stop(sample, layer_[i]->Name(), Profiler::PHASE_FORWARD,
+                    layer_[i]->ForwardFlop(state),
+                    layer_[i]->ForwardByte(state));
+  }
+
+  /*!
+   * Backward pass of a layer (timed if the model has a profiler, along with
+   * its operations, bytes and performance counters).
+   *
+   *  \param[in]  i    : layer index
+   *  \param[in]  state: state
+   */
+  void BackwardLayer(size_t i, const State& state) {
+    TraceScope trace(layer_[i]->Name(), "backward");
+    if (!profiler_) {
+      layer_[i]->Backward(state);
+      return;
+    }
+    Profiler::Sample sample;
+    profiler_->Start(&sample);
+    layer_[i]->Backward(state);
+    profiler_->Stop(sample, layer_[i]->Name(), Profiler::PHASE_BACKWARD,
+                    layer_[i]->BackwardFlop(state),
+                    layer_[i]->BackwardByte(state));
+  }
 
 
   // Public methods
@@ -67,17 +120,23 @@ class Model {
   /*!
    * Constructor.
    *
-   *  \param[in]  name: graph name
+   *  \param[in]  name  : graph name
+   *  \param[in]  frozen: build the model for inference only (see Freeze)?
    */
-  explicit Model(const char* name) {
+  explicit Model(const char* name, bool frozen = false) {
     Check(name && *name, "A graph must have a name");
-    name_ = name;
+    name_   = name;
+    frozen_   = frozen;
+    mem_      = MemTracker::Create();
+    profiler_ = nullptr;
   }
 
   /*!
    * Destructor.
    */
-  virtual ~Model() {}
+  virtual ~Model() {
+    mem_->Release();
+  }
 
   /*!
    * Get the graph name.
@@ -134,6 +193,20 @@ class Model {
     }
   }
 
+  /*!
+   * Get the layers weights updated by the forward pass (see
+   * Layer::GetForwardWeight).
+   *
+   *  \param[out] weight: list of weights
+   */
+  void GetForwardWeight(
+    std::vector<std::shared_ptr<Mat<Dtype>>>* weight) const {
+    weight->clear();
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      layer_[i]->GetForwardWeight(weight);
+    }
+  }
+
   /*!
    * Read the graph from a file stream.
    *
@@ -160,6 +233,7 @@ class Model {
         res += std::fread(reinterpret_cast<void*>(w->Data()), 1,
                           sizeof(Dtype) * weight_size, fp);
       }
+      layer_[i]->InvalidateCache();
     }
     return res;
   }
@@ -252,6 +326,11 @@ class Model {
    */
   const std::vector<std::shared_ptr<Mat<Dtype>>>& Add(
     const std::shared_ptr<Layer<Dtype>>& layer) {
+    // A frozen model never keeps any derivatives
+    if (frozen_) {
+      layer->ReleaseDeriv();
+    }
+    layer->Adopt(mem_);
     layer_.push_back(layer);
     return layer->Output();
   }
@@ -274,33 +353,142 @@ class Model {
   }
 
   /*!
-   * Set the batch size.
+   * Set the batch size, e.g. large batches for offline scoring and batch 1
+   * for a single request on the same model: the layers resize their outputs
+   * and temporaries, reusing their capacity when shrinking.
    *
    *  \param[in]  batch_size: batch size
    */
-  void SetBatchSize(uint32_t batch_size) {
+  virtual void SetBatchSize(uint32_t batch_size) {
+    MemScope scope(mem_);
     for (size_t i = 0; i < layer_.size(); ++i) {
       layer_[i]->SetBatchSize(batch_size);
     }
+
+    // The planned activations changed size: plan them again (the arena
+    // keeps its capacity)
+    if (!plan_.Empty()) {
+      plan_.Create(layer_, {in_, out_});
+    }
   }
 
   /*!
    * Clear the derivatives.
    */
-  void ClearDeriv() {
+  virtual void ClearDeriv() {
+    if (frozen_) {
+      return;
+    }
     for (size_t i = 0; i < layer_.size(); ++i) {
       layer_[i]->ClearDeriv();
     }
   }
 
+  /*!
+   * Invalidate the values the layers cache from their weights (see
+   * Layer::InvalidateCache).
+   */
+  void InvalidateCache() {
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      layer_[i]->InvalidateCache();
+    }
+  }
+
+  /*!
+   * Freeze the model for inference: the derivatives of all the layers (and
+   * of the layers added afterwards) are released, the weights can still be
+   * loaded. The model can't be trained afterwards (no backward pass).
+   */
+  void Freeze() {
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      layer_[i]->ReleaseDeriv();
+    }
+    frozen_ = true;
+  }
+
+  /*!
+   * Check if the model is frozen (see Freeze).
+   *
+   *  \return Frozen?
+   */
+  bool Frozen() const {
+    return frozen_;
+  }
+
+  /*!
+   * Plan the activations memory for inference: the activations share a
+   * small arena during the forward pass (see ActivationPlan).
+   * The model can't be trained afterwards (no backward pass).
+   */
+  void PlanInference() {
+    MemScope scope(mem_);
+    plan_.Create(layer_, {in_, out_});
+  }
+
+  /*!
+   * Get the activations plan.
+   *
+   *  \return Activations plan
+   */
+  const ActivationPlan<Dtype>& Plan() const {
+    return plan_;
+  }
+
+  /*!
+   * Get the memory charged to the model: the matrices of its layers and
+   * whatever is allocated while running it.
+   *
+   *  \return Memory tracker
+   */
+  const MemTracker& Memory() const {
+    return *mem_;
+  }
+
+  /*!
+   * Cap the memory charged to the model: going over it is an error.
+   *
+   *  \param[in]  cap: memory cap (in bytes, 0 = no cap)
+   */
+  void SetMemoryCap(size_t cap) {
+    mem_->SetCap(cap);
+  }
+
+  /*!
+   * Time the layers calls (see Profiler).
+   *
+   *  \param[in]  profiler: profiler (nullptr to stop timing)
+   */
+  void SetProfiler(Profiler* profiler) {
+    profiler_ = profiler;
+  }
+
+  /*!
+   * Get the profiler timing the layers calls.
+   *
+   *  \return Profiler (nullptr if none)
+   */
+  Profiler* GetProfiler() const {
+    return profiler_;
+  }
+
   /*!
    * Forward pass.
    *
    *  \param[in]  state: state
    */
   void Forward(const State& state) {
+    MemScope   scope(mem_);
+    TraceScope trace("forward", "model");
+    if (!plan_.Empty()) {
+      for (size_t i = 0; i < layer_.size(); ++i) {
+        plan_.Acquire(i);
+        ForwardLayer(i, state);
+        plan_.Release(i);
+      }
+      return;
+    }
     for (size_t i = 0; i < layer_.size(); ++i) {
-      layer_[i]->Forward(state);
+      ForwardLayer(i, state);
     }
   }
 
@@ -310,9 +498,21 @@ class Model {
    *  \param[in]  state: state
    */
   void Backward(const State& state) {
+    MemScope   scope(mem_);
+    TraceScope trace("backward", "model");
+    if (!plan_.Empty()) {
+      Report(kError, "Model '%s' is planned for inference: no backward pass",
+             Name());
+      return;
+    }
+    if (frozen_) {
+      Report(kError, "Model '%s' is frozen for inference: no backward pass",
+             Name());
+      return;
+    }
     size_t offset = layer_.size() - 1;
     for (size_t i = 0; i < layer_.size(); ++i) {
-      layer_[offset - i]->Backward(state);
+      BackwardLayer(offset - i, state);
     }
   }
 
@@ -374,6 +574,46 @@ class Model {
     return Loss();
   }
 
+  /*!
+   * Model training on a shard of a batch fed by another data layer
+   * (data-parallel training): the outputs of the model data layer are views
+   * of the shard starting at the given batch index, of the model batch size
+   * (no copy), instead of running it.
+   *
+   *  \param[in]  data  : data layer holding the whole batch
+   *  \param[in]  offset: batch index of the shard
+   *
+   *  \return     Loss
+   */
+  Dtype Train(const LayerData<Dtype>& data, uint32_t offset) {
+    const std::vector<std::shared_ptr<Mat<Dtype>>>& src = data.Output();
+    const std::vector<std::shared_ptr<Mat<Dtype>>>& dst =
+      DataLayer()->Output();
+    Check(src.size() == dst.size(),
+          "Data layers of model '%s' are not matching", Name());
+    for (size_t i = 0; i < dst.size(); ++i) {
+      size_t item_size = size_t(dst[i]->size[0]) * dst[i]->size[1] *
+                         dst[i]->size[2];
+      Check(item_size == size_t(src[i]->size[0]) * src[i]->size[1] *
+                         src[i]->size[2] &&
+            offset + dst[i]->size[3] <= src[i]->size[3],
+            "Data layers of model '%s' are not matching", Name());
+      dst[i]->SetView(src[i]->View().Batch(offset,
+                                           offset + dst[i]->size[3]));
+    }
+
+    // Same as Train, skipping the data layer
+    State state(State::PHASE_TRAIN);
+    {
+      TraceScope trace("forward", "model");
+      for (size_t i = 1; i < layer_.size(); ++i) {
+        ForwardLayer(i, state);
+      }
+    }
+    Backward(state);
+    return Loss();
+  }
+
   /*!
    * Model testing (inference).
    *
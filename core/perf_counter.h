@@ -0,0 +1,305 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_PERF_COUNTER_H_
+#define CORE_PERF_COUNTER_H_
+
+
+#include <core/log.h>
+#include <vector>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#ifdef __linux__
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+namespace jik {
+
+
+/*!
+ *  \class  PerfCounter
+ *  \brief  Hardware performance counters of the process (Linux only)
+ *
+ * Each event is counted (user space only) on every thread of the process
+ * running when the counters are opened, e.g. the thread pool workers, and
+ * Read sums them. The counters multiplexed by the kernel (more events than
+ * hardware counters) are scaled to their enabled time.
+ *
+ * The counters may not be available (not Linux, no PMU in a virtual
+ * machine or a container, perf_event_paranoid): Open reports it and the
+ * events that can't be opened read 0 (see Available).
+ */
+class PerfCounter {
+  // Public types
+ public:
+  enum Event {
+    EVENT_CYCLES = 0,     // CPU cycles
+    EVENT_INSTRUCTIONS,   // Instructions retired
+    EVENT_LLC_MISSES,     // Last level cache misses
+    EVENT_L1D_MISSES,     // L1 data cache read misses
+    EVENT_BRANCH_MISSES,  // Mispredicted branches
+    NUM_EVENT
+  };
+
+
+  // Protected attributes
+ protected:
+  std::vector<int> fd_;                     // Event x thread descriptors
+  uint32_t         num_thread_;             // Number of counted threads
+  bool             available_[NUM_EVENT];   // Events available?
+
+
+  // Protected methods
+ protected:
+#ifdef __linux__
+  /*!
+   * Open an event on a thread.
+   *
+   *  \param[in]  event: event
+   *  \param[in]  tid  : thread id
+   *
+   *  \return     Descriptor, -1 if not available
+   */
+  static int OpenEvent(Event event, pid_t tid) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                          PERF_FORMAT_TOTAL_TIME_RUNNING;
+    switch (event) {
+      case EVENT_CYCLES: {
+        attr.type   = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+      }
+      case EVENT_INSTRUCTIONS: {
+        attr.type   = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+      }
+      case EVENT_LLC_MISSES: {
+        attr.type   = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+      }
+      case EVENT_L1D_MISSES: {
+        attr.type   = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+      }
+      default: {
+        attr.type   = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+      }
+    }
+    return int(syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0));
+  }
+
+  /*!
+   * Get the threads of the process.
+   *
+   *  \return List of thread ids
+   */
+  static std::vector<pid_t> Threads() {
+    std::vector<pid_t> tid;
+    DIR* dir = opendir("/proc/self/task");
+    if (!dir) {
+      tid.push_back(pid_t(syscall(SYS_gettid)));
+      return tid;
+    }
+    while (dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+        tid.push_back(pid_t(std::atoi(entry->d_name)));
+      }
+    }
+    closedir(dir);
+    return tid;
+  }
+#endif  // __linux__
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  PerfCounter() {
+    num_thread_ = 0;
+    for (int event = 0; event < NUM_EVENT; ++event) {
+      available_[event] = false;
+    }
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~PerfCounter() {
+    Close();
+  }
+
+  /*!
+   * Get the name of an event.
+   *
+   *  \param[in]  event: event
+   *
+   *  \return     Event name
+   */
+  static const char* EventName(Event event) {
+    const char* name[NUM_EVENT] = {
+      "cycles", "instructions", "LLC misses", "L1D misses", "branch misses"
+    };
+    return name[event];
+  }
+
+  /*!
+   * Open the counters on the threads of the process (closing the previous
+   * ones).
+   *
+   *  \return Any event available?
+   */
+  bool Open() {
+    Close();
+#ifdef __linux__
+    std::vector<pid_t> tid = Threads();
+    num_thread_ = uint32_t(tid.size());
+    fd_.assign(size_t(NUM_EVENT) * num_thread_, -1);
+    int error[NUM_EVENT] = {0};
+    for (int event = 0; event < NUM_EVENT; ++event) {
+      for (uint32_t t = 0; t < num_thread_; ++t) {
+        int fd = OpenEvent(Event(event), tid[t]);
+        if (fd < 0 && !error[event]) {
+          error[event] = errno;
+        }
+        fd_[event * num_thread_ + t] = fd;
+        available_[event] = available_[event] || fd >= 0;
+      }
+    }
+    bool any = Available();
+    for (int event = 0; event < NUM_EVENT; ++event) {
+      if (!any) {
+        Report(kWarning, "Performance counters not available (%s), see "
+               "/proc/sys/kernel/perf_event_paranoid",
+               std::strerror(error[event]));
+        break;
+      }
+      if (!available_[event]) {
+        Report(kWarning, "Performance counter '%s' not available (%s)",
+               EventName(Event(event)), std::strerror(error[event]));
+      }
+    }
+    return any;
+#else
+    Report(kWarning, "Performance counters are only available on Linux");
+    return false;
+#endif  // __linux__
+  }
+
+  /*!
+   * Close the counters.
+   */
+  void Close() {
+#ifdef __linux__
+    for (size_t i = 0; i < fd_.size(); ++i) {
+      if (fd_[i] >= 0) {
+        close(fd_[i]);
+      }
+    }
+#endif  // __linux__
+    fd_.clear();
+    num_thread_ = 0;
+    for (int event = 0; event < NUM_EVENT; ++event) {
+      available_[event] = false;
+    }
+  }
+
+  /*!
+   * Check if an event is available.
+   *
+   *  \param[in]  event: event
+   *
+   *  \return     Event available?
+   */
+  bool Available(Event event) const {
+    return available_[event];
+  }
+
+  /*!
+   * Check if any event is available.
+   *
+   *  \return Any event available?
+   */
+  bool Available() const {
+    for (int event = 0; event < NUM_EVENT; ++event) {
+      if (available_[event]) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /*!
+   * Read the counters (summed over the threads).
+   *
+   *  \param[out] value: value of each event (NUM_EVENT values)
+   */
+  void Read(uint64_t* value) const {
+    for (int event = 0; event < NUM_EVENT; ++event) {
+      value[event] = 0;
+#ifdef __linux__
+      if (!available_[event]) {
+        continue;
+      }
+      for (uint32_t t = 0; t < num_thread_; ++t) {
+        int fd = fd_[event * num_thread_ + t];
+        uint64_t data[3];  // Value, time enabled, time running
+        if (fd < 0 || read(fd, data, sizeof(data)) != sizeof(data)) {
+          continue;
+        }
+        value[event] += (data[2] && data[2] < data[1]) ?
+                        uint64_t(double(data[0]) * data[1] / data[2]) :
+                        data[0];
+      }
+#endif  // __linux__
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_PERF_COUNTER_H_
@@ -0,0 +1,195 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_PREFETCH_H_
+#define CORE_PREFETCH_H_
+
+
+#include <core/log.h>
+#include <core/mat.h>
+#include <core/trace.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Prefetch
+ *  \brief  Background batch prefetching
+ *
+ * A producer thread fills the next batches in advance while the model is
+ * processing the current one. The batches are filled in a ring of
+ * pre-allocated buffers, used as a bounded lock-free queue (one producer,
+ * one consumer). Getting a batch only swaps its buffers with the storage of
+ * the outputs, the previous storage going back to the ring.
+ */
+template <typename Dtype>
+class Prefetch {
+  // Public types
+ public:
+  typedef Dtype Type;
+  typedef std::function<void(const std::vector<Dtype*>& data)> Fill;
+
+
+  // Protected types
+ protected:
+  typedef typename Mat<Dtype>::Storage Storage;
+
+
+  // Protected attributes
+ protected:
+  std::vector<std::vector<Storage>>
+                        buffer_;  // Buffers of each batch (one per output)
+  Fill                  fill_;    // Function filling a batch
+  std::atomic<uint64_t> head_;    // Number of batches consumed
+  std::atomic<uint64_t> tail_;    // Number of batches produced
+  std::atomic<bool>     stop_;    // Stop the producer?
+  std::thread           thread_;  // Producer thread
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Producer: fill the batches as long as there's a free buffer.
+   */
+  void Produce() {
+    Trace::SetThreadName("prefetch");
+    std::vector<Dtype*> data(buffer_[0].size());
+    while (!stop_.load(std::memory_order_relaxed)) {
+      uint64_t tail = tail_.load(std::memory_order_relaxed);
+      if (tail - head_.load(std::memory_order_acquire) >= buffer_.size()) {
+        // The queue is full: the model is slower than us
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        continue;
+      }
+      std::vector<Storage>& buffer = buffer_[tail % buffer_.size()];
+      for (size_t i = 0; i < buffer.size(); ++i) {
+        data[i] = &buffer[i][0];
+      }
+      {
+        TraceScope trace("batch", "data");
+        fill_(data);
+      }
+      tail_.store(tail + 1, std::memory_order_release);
+    }
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  Prefetch(): head_(0), tail_(0), stop_(false) {}
+
+  /*!
+   * Destructor.
+   */
+  ~Prefetch() {
+    Stop();
+  }
+
+  /*!
+   * Check if the producer is running.
+   *
+   *  \return Running?
+   */
+  bool Running() const {
+    return thread_.joinable();
+  }
+
+  /*!
+   * Start the producer.
+   *
+   *  \param[in]  out      : outputs (giving the size of the buffers)
+   *  \param[in]  num_batch: number of batches filled in advance
+   *  \param[in]  fill     : function filling a batch, one pointer per output
+   *                         (called from the producer thread)
+   */
+  void Start(const std::vector<std::shared_ptr<Mat<Dtype>>>& out,
+             uint32_t num_batch, const Fill& fill) {
+    Stop();
+    Check(num_batch && !out.empty(), "Invalid prefetch parameters");
+    buffer_.resize(num_batch);
+    for (size_t i = 0; i < buffer_.size(); ++i) {
+      buffer_[i].resize(out.size());
+      for (size_t j = 0; j < out.size(); ++j) {
+        buffer_[i][j].resize(out[j]->Size());
+      }
+    }
+    fill_ = fill;
+    head_.store(0);
+    tail_.store(0);
+    stop_.store(false);
+    thread_ = std::thread(&Prefetch::Produce, this);
+  }
+
+  /*!
+   * Stop the producer.
+   */
+  void Stop() {
+    if (thread_.joinable()) {
+      stop_.store(true);
+      thread_.join();
+    }
+  }
+
+  /*!
+   * Get the next batch: wait for it to be ready and swap its buffers with
+   * the storage of the outputs.
+   *
+   *  \param[in]  out: outputs
+   */
+  void Get(const std::vector<std::shared_ptr<Mat<Dtype>>>& out) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (tail_.load(std::memory_order_acquire) == head) {
+      // The queue is empty: we are faster than the producer
+      TraceScope trace("wait", "data");
+      while (tail_.load(std::memory_order_acquire) == head) {
+        std::this_thread::yield();
+      }
+    }
+    std::vector<Storage>& buffer = buffer_[head % buffer_.size()];
+    for (size_t i = 0; i < out.size(); ++i) {
+      Check(out[i]->Size() == buffer[i].size(), "Invalid prefetched batch");
+      out[i]->data.swap(buffer[i]);
+    }
+    head_.store(head + 1, std::memory_order_release);
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_PREFETCH_H_
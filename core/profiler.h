@@ -0,0 +1,492 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_PROFILER_H_
+#define CORE_PROFILER_H_
+
+
+#include <core/log.h>
+#include <core/gemm.h>
+#include <core/perf_counter.h>
+#include <core/thread_pool.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Profiler
+ *  \brief  Per-layer timing of the forward and backward passes
+ *
+ * A model with a profiler (see Model::SetProfiler) records the wall-clock
+ * time (steady clock) of each layer call, grouped by layer name and phase:
+ * the layers of an unrolled recurrent model sharing a name are reported
+ * together. The time of the whole training steps is recorded by the solver
+ * so each layer can be reported as a share of it.
+ *
+ * The layers also report the operations and bytes of each call (see
+ * Layer::ForwardFlop and Layer::ForwardByte): the achieved GFLOP/s and
+ * arithmetic intensity (operations per byte) are compared to the machine
+ * roofline, min(peak GFLOP/s, intensity * peak bandwidth), and the layers
+ * far below it are flagged as worth optimizing.
+ *
+ * Optionally (see OpenCounter), the hardware performance counters are
+ * read around each call too: the table gives the IPC (instructions per
+ * cycle) and the misses per 1000 operations of each layer.
+ *
+ * Replicas may record in parallel: their times are summed, so the shares
+ * can add up to more than 100% in that case, and the counters (summed over
+ * the threads of the process) are then shared by the layers running at the
+ * same time.
+ */
+class Profiler {
+  // Public types
+ public:
+  enum Phase {
+    PHASE_FORWARD = 0,
+    PHASE_BACKWARD,
+    NUM_PHASE
+  };
+
+  /*!
+   *  \struct Sample
+   *  \brief  Time and counters at the start of a call (see Start)
+   */
+  struct Sample {
+    double   time;                            // Time (in seconds)
+    uint64_t counter[PerfCounter::NUM_EVENT];  // Counters
+  };
+
+
+  // Protected types
+ protected:
+  struct Entry {
+    std::string         name;  // Layer name
+    std::vector<double> time;  // Time of each call (in seconds)
+    uint64_t            flop;  // Number of operations of the calls
+    uint64_t            byte;  // Number of bytes moved by the calls
+    uint64_t            counter[PerfCounter::NUM_EVENT];  // Counters
+  };
+
+
+  // Protected attributes
+ protected:
+  std::vector<Entry>                      entry_[NUM_PHASE];  // Entries
+  std::unordered_map<std::string, size_t> index_[NUM_PHASE];  // Name->entry
+  std::vector<double>                     step_;              // Steps time
+  double                                  peak_flop_;         // FLOP/s
+  double                                  peak_byte_;         // Bytes/s
+  PerfCounter                             counter_;           // Counters
+  mutable std::mutex                      lock_;              // Entries lock
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get the min, mean and 99th percentile of a list of times.
+   *
+   *  \param[in]  time: list of times
+   *  \param[out] min : min time
+   *  \param[out] mean: mean time
+   *  \param[out] p99 : 99th percentile time
+   *
+   *  \return     Total time
+   */
+  static double Stat(std::vector<double> time, double* min, double* mean,
+                     double* p99) {
+    *min = *mean = *p99 = 0.;
+    if (time.empty()) {
+      return 0.;
+    }
+    double total = 0.;
+    for (double t : time) {
+      total += t;
+    }
+    std::sort(time.begin(), time.end());
+    size_t rank = (time.size() * 99 + 99) / 100;
+    *min  = time[0];
+    *mean = total / time.size();
+    *p99  = time[std::min(rank, time.size()) - 1];
+    return total;
+  }
+
+  /*!
+   * Get the summary table.
+   *
+   *  \return Table lines
+   */
+  std::vector<std::string> Table() const {
+    std::lock_guard<std::mutex> lock(lock_);
+    const char*  phase_name[NUM_PHASE] = {"forward", "backward"};
+    const double kSlowRatio = 0.1;  // Flagged below 10% of the roofline
+    const size_t kLineSize  = 0x100;
+    char line[kLineSize];
+    std::vector<std::string> table;
+
+    double step_min, step_mean, step_p99;
+    double step_total = Stat(step_, &step_min, &step_mean, &step_p99);
+    bool counter = counter_.Available();
+    std::string header;
+    std::snprintf(line, kLineSize, "%-16s %-8s %6s %9s %9s %9s %9s",
+                  "Layer", "Phase", "Calls", "Min (ms)", "Mean (ms)",
+                  "P99 (ms)", "Share (%)");
+    header = line;
+    if (counter) {
+      std::snprintf(line, kLineSize, " %6s %8s %8s %8s", "IPC", "LLC/kF",
+                    "L1D/kF", "BrM/kF");
+      header += line;
+    }
+    std::snprintf(line, kLineSize, " %8s %7s %8s", "GFLOP/s", "FLOP/B",
+                  "Roof (%)");
+    table.push_back(header + line);
+    for (int phase = 0; phase < NUM_PHASE; ++phase) {
+      for (const Entry& entry : entry_[phase]) {
+        if (entry.time.empty()) {
+          continue;
+        }
+        double min, mean, p99;
+        double total = Stat(entry.time, &min, &mean, &p99);
+        std::snprintf(line, kLineSize,
+                      "%-16s %-8s %6ld %9.3f %9.3f %9.3f %9.1f",
+                      entry.name.c_str(), phase_name[phase],
+                      entry.time.size(), min * 1e3, mean * 1e3, p99 * 1e3,
+                      step_total > 0. ? 100. * total / step_total : 0.);
+        std::string row = line;
+
+        // IPC and misses per 1000 operations
+        if (counter) {
+          const uint64_t* count = entry.counter;
+          const PerfCounter::Event miss[] = {
+            PerfCounter::EVENT_LLC_MISSES, PerfCounter::EVENT_L1D_MISSES,
+            PerfCounter::EVENT_BRANCH_MISSES
+          };
+          if (count[PerfCounter::EVENT_CYCLES] &&
+              counter_.Available(PerfCounter::EVENT_INSTRUCTIONS)) {
+            std::snprintf(line, kLineSize, " %6.2f",
+                          double(count[PerfCounter::EVENT_INSTRUCTIONS]) /
+                          count[PerfCounter::EVENT_CYCLES]);
+          } else {
+            std::snprintf(line, kLineSize, " %6s", "-");
+          }
+          row += line;
+          for (PerfCounter::Event event : miss) {
+            if (entry.flop && counter_.Available(event)) {
+              std::snprintf(line, kLineSize, " %8.3f",
+                            1e3 * count[event] / entry.flop);
+            } else {
+              std::snprintf(line, kLineSize, " %8s", "-");
+            }
+            row += line;
+          }
+        }
+
+        // Achieved GFLOP/s and arithmetic intensity, against the roofline
+        if (entry.flop && total > 0.) {
+          double flops     = entry.flop / total;
+          double intensity = entry.byte ? double(entry.flop) / entry.byte :
+                                          0.;
+          double roof      = std::min(peak_flop_, intensity * peak_byte_);
+          if (roof > 0.) {
+            std::snprintf(line, kLineSize, " %8.2f %7.2f %8.1f%s",
+                          flops * 1e-9, intensity, 100. * flops / roof,
+                          flops < kSlowRatio * roof ? " <<" : "");
+          } else {
+            std::snprintf(line, kLineSize, " %8.2f %7.2f %8s",
+                          flops * 1e-9, intensity, "-");
+          }
+        } else {
+          std::snprintf(line, kLineSize, " %8s %7s %8s", "-", "-", "-");
+        }
+        table.push_back(row + line);
+      }
+    }
+    std::snprintf(line, kLineSize,
+                  "%-16s %-8s %6ld %9.3f %9.3f %9.3f %9.1f",
+                  "(step)", "", step_.size(), step_min * 1e3,
+                  step_mean * 1e3, step_p99 * 1e3,
+                  step_total > 0. ? 100. : 0.);
+    table.push_back(line);
+    if (peak_flop_ > 0.) {
+      std::snprintf(line, kLineSize,
+                    "Peak: %.2f GFLOP/s, %.2f GB/s (<<: below %.0f%% of the "
+                    "roofline)", peak_flop_ * 1e-9, peak_byte_ * 1e-9,
+                    100. * kSlowRatio);
+      table.push_back(line);
+    }
+    return table;
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  Profiler() {
+    peak_flop_ = 0.;
+    peak_byte_ = 0.;
+  }
+
+  /*!
+   * Get the current time.
+   *
+   *  \return Time (in seconds, steady clock)
+   */
+  static double Now() {
+    return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  /*!
+   * Record the time of a layer call.
+   *
+   *  \param[in]  name : layer name
+   *  \param[in]  phase: phase
+   *  \param[in]  time : time (in seconds)
+   *  \param[in]  flop : number of operations of the call
+   *  \param[in]  byte : number of bytes moved by the call
+   *  \param[in]  count: counters of the call (PerfCounter::NUM_EVENT
+   *                      values, optional)
+   */
+  void Record(const char* name, Phase phase, double time,
+              uint64_t flop = 0, uint64_t byte = 0,
+              const uint64_t* count = nullptr) {
+    if (!name || !*name) {
+      name = "(unnamed)";
+    }
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = index_[phase].find(name);
+    if (it == index_[phase].end()) {
+      it = index_[phase].emplace(name, entry_[phase].size()).first;
+      entry_[phase].push_back(Entry());
+      entry_[phase].back().name = name;
+      entry_[phase].back().flop = 0;
+      entry_[phase].back().byte = 0;
+      std::fill_n(entry_[phase].back().counter, int(PerfCounter::NUM_EVENT),
+                  uint64_t(0));
+    }
+    Entry& entry = entry_[phase][it->second];
+    entry.time.push_back(time);
+    entry.flop += flop;
+    entry.byte += byte;
+    for (int event = 0; count && event < PerfCounter::NUM_EVENT; ++event) {
+      entry.counter[event] += count[event];
+    }
+  }
+
+  /*!
+   * Start timing a layer call (see Stop).
+   *
+   *  \param[out] sample: time and counters at the start of the call
+   */
+  void Start(Sample* sample) const {
+    if (counter_.Available()) {
+      counter_.Read(sample->counter);
+    }
+    sample->time = Now();
+  }
+
+  /*!
+   * Stop timing a layer call and record it (see Record).
+   *
+   *  \param[in]  sample: time and counters at the start of the call
+   *  \param[in]  name  : layer name
+   *  \param[in]  phase : phase
+   *  \param[in]  flop  : number of operations of the call
+   *  \param[in]  byte  : number of bytes moved by the call
+   */
+  void Stop(const Sample& sample, const char* name, Phase phase,
+            uint64_t flop, uint64_t byte) {
+    double time = Now() - sample.time;
+    if (!counter_.Available()) {
+      Record(name, phase, time, flop, byte);
+      return;
+    }
+    uint64_t count[PerfCounter::NUM_EVENT];
+    counter_.Read(count);
+    for (int event = 0; event < PerfCounter::NUM_EVENT; ++event) {
+      count[event] = count[event] > sample.counter[event] ?
+                     count[event] - sample.counter[event] : 0;
+    }
+    Record(name, phase, time, flop, byte, count);
+  }
+
+  /*!
+   * Read the hardware performance counters around each layer call, on the
+   * threads of the process running now (see PerfCounter).
+   *
+   *  \return Any counter available?
+   */
+  bool OpenCounter() {
+    return counter_.Open();
+  }
+
+  /*!
+   * Stop reading the hardware performance counters.
+   */
+  void CloseCounter() {
+    counter_.Close();
+  }
+
+  /*!
+   * Set the machine peak (see MeasurePeak).
+   *
+   *  \param[in]  flop: peak operations per second
+   *  \param[in]  byte: peak memory bandwidth (in bytes per second)
+   */
+  void SetPeak(double flop, double byte) {
+    std::lock_guard<std::mutex> lock(lock_);
+    peak_flop_ = flop;
+    peak_byte_ = byte;
+  }
+
+  /*!
+   * Measure the machine peak: the best of a few large matrix
+   * multiplications (operations) and copies larger than the caches
+   * (bandwidth), using the thread pool like the layers do.
+   */
+  template <typename Dtype>
+  void MeasurePeak() {
+    const uint32_t kGemmSize = 512;
+    const size_t   kCopySize = size_t(64) << 20;  // Bytes
+    const size_t   kNumBlock = 64;
+    const int      kNumRep   = 4;
+
+    // Operations (the first multiplication warms up)
+    size_t gemm_size = size_t(kGemmSize) * kGemmSize;
+    std::vector<Dtype> a(gemm_size, Dtype(1)), b(gemm_size, Dtype(1));
+    std::vector<Dtype> c(gemm_size);
+    double flop = 0.;
+    for (int rep = 0; rep < kNumRep; ++rep) {
+      double start = Now();
+      Gemm(false, false, kGemmSize, kGemmSize, kGemmSize,
+           Dtype(1), &a[0], kGemmSize, &b[0], kGemmSize,
+           Dtype(0), &c[0], kGemmSize);
+      double time = Now() - start;
+      if (rep && time > 0.) {
+        flop = std::max(flop, 2. * gemm_size * kGemmSize / time);
+      }
+    }
+
+    // Bandwidth: each byte is read and written
+    std::vector<char> src(kCopySize, 1), dst(kCopySize);
+    size_t block_size = kCopySize / kNumBlock;
+    double byte = 0.;
+    for (int rep = 0; rep < kNumRep; ++rep) {
+      double start = Now();
+      ParallelFor(0, kNumBlock, [&](size_t block) {
+        std::memcpy(&dst[block * block_size], &src[block * block_size],
+                    block_size);
+      });
+      double time = Now() - start;
+      if (rep && time > 0.) {
+        byte = std::max(byte, 2. * kCopySize / time);
+      }
+    }
+
+    SetPeak(flop, byte);
+  }
+
+  /*!
+   * Record the time of a whole training step.
+   *
+   *  \param[in]  time: time (in seconds)
+   */
+  void AddStep(double time) {
+    std::lock_guard<std::mutex> lock(lock_);
+    step_.push_back(time);
+  }
+
+  /*!
+   * Get the number of recorded steps.
+   *
+   *  \return Number of steps
+   */
+  size_t NumStep() const {
+    std::lock_guard<std::mutex> lock(lock_);
+    return step_.size();
+  }
+
+  /*!
+   * Clear the recorded times (the layers are kept in the same order).
+   */
+  void Clear() {
+    std::lock_guard<std::mutex> lock(lock_);
+    for (int phase = 0; phase < NUM_PHASE; ++phase) {
+      for (Entry& entry : entry_[phase]) {
+        entry.time.clear();
+        entry.flop = 0;
+        entry.byte = 0;
+        std::fill_n(entry.counter, int(PerfCounter::NUM_EVENT), uint64_t(0));
+      }
+    }
+    step_.clear();
+  }
+
+  /*!
+   * Print the summary table: min/mean/p99 time of a call of each layer and
+   * its share of the steps time.
+   */
+  void Print() const {
+    for (const std::string& line : Table()) {
+      Report(kInfo, "%s", line.c_str());
+    }
+  }
+
+  /*!
+   * Write the summary table to a file (see Print).
+   *
+   *  \param[in]  file_name: file name
+   *
+   *  \return     Error?
+   */
+  bool Write(const char* file_name) const {
+    std::FILE* file = std::fopen(file_name, "wt");
+    if (!file) {
+      Report(kWarning, "Cannot open '%s'", file_name);
+      return false;
+    }
+    for (const std::string& line : Table()) {
+      std::fprintf(file, "%s\n", line.c_str());
+    }
+    std::fclose(file);
+    return true;
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_PROFILER_H_
@@ -28,10 +28,16 @@
 
 
 #include <core/model.h>
+#include <core/profiler.h>
+#include <core/trace.h>
+#include <core/eltwise.h>
+#include <core/thread_pool.h>
+#include <algorithm>
 #include <memory>
+#include <cstring>
 #include <cmath>
 #include <limits>
-#include <ctime>
+#include <chrono>
 #include <vector>
 #include <string>
 
@@ -53,14 +59,192 @@ class Solver {
   // Protected attributes
  protected:
   std::vector<std::shared_ptr<Mat<Dtype>>>
-           weight_;         // List of weights for a model (current value)
+           weight_;           // List of weights for a model (current value)
   std::vector<std::shared_ptr<Mat<Dtype>>>
-           weight_prev_;    // List of weights for a model (previous value)
-  uint32_t print_each_;     // Print the model stats every n steps
-  uint32_t test_each_;      // Test the model every n steps
-  uint32_t save_each_;      // Save the model every n steps
-  uint32_t lr_scale_each_;  // Scale the learning rate every n steps
-  Dtype    lr_scale_;       // Learning rate scale
+           weight_prev_;      // List of weights for a model (previous value)
+  std::vector<std::vector<std::shared_ptr<Mat<Dtype>>>>
+           replica_weight_;   // List of weights for each replica
+  std::vector<bool>
+           forward_weight_;   // Weights updated by the forward pass
+  std::vector<std::vector<uint32_t>>
+           row_step_;         // Last update step of each row (row-sparse)
+  uint32_t step_;             // Current learning step
+  uint32_t print_each_;       // Print the model stats every n steps
+  uint32_t test_each_;        // Test the model every n steps
+  uint32_t save_each_;        // Save the model every n steps
+  uint32_t lr_scale_each_;    // Scale the learning rate every n steps
+  Dtype    lr_scale_;         // Learning rate scale
+  std::unique_ptr<Profiler>
+           profiler_;         // Layers timing (see EnableProfiler)
+  std::string
+           profile_file_;     // File to write the profiler table to
+  bool     profile_counter_;  // Read the performance counters?
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Copy the weights updated by the forward pass of a model to its replicas
+   * (the other ones are shared).
+   */
+  void Broadcast() const {
+    ParallelFor(0, replica_weight_.size(), [&](size_t replica) {
+      for (size_t i = 0; i < weight_.size(); ++i) {
+        if (!forward_weight_[i]) {
+          continue;
+        }
+        std::memcpy(replica_weight_[replica][i]->Data(), weight_[i]->Data(),
+                    weight_[i]->Size() * sizeof(Dtype));
+      }
+    });
+  }
+
+  /*!
+   * Update the rows having derivatives of a weight with row-sparse
+   * derivatives (see Mat::SetSparseDeriv). The L2 regularization of the
+   * learning steps a row was not updated for is applied before updating it
+   * (lazy weight decay).
+   *
+   *  \param[in]  i            : weight index
+   *  \param[in]  learning_rate: learning rate
+   *  \param[in]  reg          : L2 regularization
+   *  \param[in]  func         : update function of a range of the weight
+   *                              (begin, end)
+   */
+  template <class Func>
+  void LearnRow(size_t i, Dtype learning_rate, Dtype reg, const Func& func) {
+    const std::shared_ptr<Mat<Dtype>>& weight = weight_[i];
+    std::vector<uint32_t>& row_step           = row_step_[i];
+    Dtype* weight_data                        = weight->Data();
+    uint32_t row_size                         = weight->RowSize();
+    for (uint32_t row : weight->deriv_row) {
+      uint32_t num_skip = step_ - row_step[row] - 1;
+      if (num_skip && reg != Dtype(0)) {
+        Dtype decay = std::pow(Dtype(1) - learning_rate * reg,
+                               Dtype(num_skip));
+        for (uint32_t j = 0; j < row_size; ++j) {
+          weight_data[row * row_size + j] *= decay;
+        }
+      }
+      row_step[row] = step_;
+      func(size_t(row) * row_size, size_t(row + 1) * row_size);
+    }
+  }
+
+  /*!
+   * Print the profiler table (and write it to the profile file), then clear
+   * it.
+   */
+  void ReportProfile() const {
+    if (!profiler_) {
+      return;
+    }
+    profiler_->Print();
+    if (!profile_file_.empty()) {
+      profiler_->Write(profile_file_.c_str());
+    }
+    profiler_->Clear();
+  }
+
+  /*!
+   * Set the profiler of a model and its replicas.
+   *
+   *  \param[in]  model   : model
+   *  \param[in]  replica : model replicas
+   *  \param[in]  profiler: profiler (nullptr to stop timing)
+   */
+  static void SetProfiler(Model<Dtype>* model,
+                          const std::vector<Model<Dtype>*>& replica,
+                          Profiler* profiler) {
+    model->SetProfiler(profiler);
+    for (size_t r = 0; r < replica.size(); ++r) {
+      replica[r]->SetProfiler(profiler);
+    }
+  }
+
+  /*!
+   * Data-parallel training step: the model data layer fills the batch, each
+   * replica trains on its own shard of the batch (in parallel), then the
+   * replicas weights derivatives are summed into the model ones (tree
+   * reduction).
+   *
+   *  \param[in]  model  : model to train
+   *  \param[in]  replica: model replicas
+   *
+   *  \return     Loss
+   */
+  Dtype TrainReplica(Model<Dtype>* model,
+                     const std::vector<Model<Dtype>*>& replica) const {
+    // Fill the whole batch
+    const std::shared_ptr<LayerData<Dtype>>& data = model->DataLayer();
+    State  state(State::PHASE_TRAIN);
+    double start = Profiler::Now();
+    Trace::Begin(data->Name(), "data");
+    data->Forward(state);
+    Trace::End(data->Name(), "data");
+    if (profiler_) {
+      profiler_->Record(data->Name(), Profiler::PHASE_FORWARD,
+                        Profiler::Now() - start, data->ForwardFlop(state),
+                        data->ForwardByte(state));
+    }
+
+    // Train each replica on its shard
+    std::vector<uint32_t> offset(replica.size());
+    for (size_t r = 1; r < replica.size(); ++r) {
+      offset[r] = offset[r - 1] + replica[r - 1]->BatchSize();
+    }
+    std::vector<Dtype> loss(replica.size());
+    ParallelFor(0, replica.size(), [&](size_t r) {
+      loss[r] = replica[r]->Train(*data, offset[r]);
+    });
+
+    // Sum the derivatives pairwise: replica r gets the sum of
+    // replicas [r, r + 2 * stride[ at each level
+    for (size_t stride = 1; stride < replica.size(); stride *= 2) {
+      ParallelFor(0, (replica.size() - 1) / (2 * stride) + 1, [&](size_t p) {
+        size_t dst = p * 2 * stride;
+        size_t src = dst + stride;
+        if (src >= replica.size()) {
+          return;
+        }
+        for (size_t i = 0; i < weight_.size(); ++i) {
+          EltwiseAxpy(weight_[i]->Size(), Dtype(1),
+                      replica_weight_[src][i]->DerivData(),
+                      replica_weight_[dst][i]->DerivData());
+          if (weight_[i]->SparseDeriv()) {
+            for (uint32_t row : replica_weight_[src][i]->deriv_row) {
+              replica_weight_[dst][i]->AddDerivRow(row);
+            }
+          }
+        }
+      });
+    }
+
+    // The first replica holds the derivatives. We also take the weights it
+    // updated in the forward pass (e.g. the batch normalization moving
+    // averages), the other ones being shared
+    for (size_t i = 0; i < weight_.size(); ++i) {
+      if (forward_weight_[i]) {
+        std::memcpy(weight_[i]->Data(), replica_weight_[0][i]->Data(),
+                    weight_[i]->Size() * sizeof(Dtype));
+      }
+      std::memcpy(weight_[i]->DerivData(),
+                  replica_weight_[0][i]->DerivData(),
+                  weight_[i]->Size() * sizeof(Dtype));
+      if (weight_[i]->SparseDeriv()) {
+        for (uint32_t row : replica_weight_[0][i]->deriv_row) {
+          weight_[i]->AddDerivRow(row);
+        }
+      }
+    }
+
+    // Loss over the whole batch (the losses are averaged over the batch)
+    Dtype res = Dtype(0);
+    for (size_t r = 0; r < replica.size(); ++r) {
+      res += loss[r] * replica[r]->BatchSize();
+    }
+    return res / model->BatchSize();
+  }
 
 
   // Public methods
@@ -77,11 +261,13 @@ class Solver {
    */
   Solver(uint32_t print_each, uint32_t test_each, uint32_t save_each,
          uint32_t lr_scale_each, Dtype lr_scale) {
-    print_each_    = print_each;
-    test_each_     = test_each;
-    save_each_     = save_each;
-    lr_scale_each_ = lr_scale_each;
-    lr_scale_      = lr_scale;
+    print_each_      = print_each;
+    test_each_       = test_each;
+    save_each_       = save_each;
+    lr_scale_each_   = lr_scale_each;
+    lr_scale_        = lr_scale;
+    step_            = 0;
+    profile_counter_ = false;
   }
 
   /*!
@@ -89,13 +275,29 @@ class Solver {
    */
   virtual ~Solver() {}
 
+  /*!
+   * Time the layers of the trained models (see Profiler): the table is
+   * printed every print_each steps (and at the end of the training).
+   * The machine peak is measured first, to flag the slow layers.
+   *
+   *  \param[in]  file_name: file to write the table to as well (optional)
+   *  \param[in]  counter  : read the hardware performance counters too
+   *                          (see Profiler::OpenCounter)?
+   */
+  void EnableProfiler(const char* file_name = nullptr, bool counter = false) {
+    profiler_.reset(new Profiler());
+    profile_file_    = file_name ? file_name : "";
+    profile_counter_ = counter;
+    profiler_->MeasurePeak<Dtype>();
+  }
+
   /*!
    * Learning function.
    *
    *  \param[in]  batch_size   : batch size
    *  \param[in]  learning_rate: learning rate
    */
-  virtual void Learn(uint32_t batch_size, Dtype learning_rate) const = 0;
+  virtual void Learn(uint32_t batch_size, Dtype learning_rate) = 0;
 
   /*!
    * Train a model.
@@ -107,6 +309,30 @@ class Solver {
    *  \return     Error?
    */
   bool Train(Model<Dtype>* model, uint32_t num_step, Dtype learning_rate) {
+    return Train(model, {}, num_step, learning_rate);
+  }
+
+  /*!
+   * Train a model, data-parallel: each batch is split across the replicas
+   * of the model, trained in parallel, and their weights derivatives are
+   * summed before updating the model weights (one learning step for the
+   * whole batch). The replicas must have the same architecture as the model
+   * and their batch sizes must sum up to the model batch size.
+   * Their weights become views of the model ones (no copy, see
+   * Mat::SetView), except the ones updated by the forward pass (see
+   * Layer::GetForwardWeight), copied at each step: the replicas only have
+   * their own derivatives.
+   *
+   *  \param[in]  model        : model to train
+   *  \param[in]  replica      : model replicas (none to train the model
+   *                              itself)
+   *  \param[in]  num_step     : number of training steps
+   *  \param[in]  learning_rate: learning rate
+   *
+   *  \return     Error?
+   */
+  bool Train(Model<Dtype>* model, const std::vector<Model<Dtype>*>& replica,
+             uint32_t num_step, Dtype learning_rate) {
     if (!model) {
       Report(kError, "Invalid model");
       return false;
@@ -120,21 +346,106 @@ class Solver {
       weight_prev_[i] = std::make_shared<Mat<Dtype>>(weight_[i]->size, false);
     }
 
-    std::clock_t start = std::clock();
+    // Keep track of the last update of the row-sparse weights rows
+    row_step_.assign(weight_.size(), std::vector<uint32_t>());
+    for (size_t i = 0; i < weight_.size(); ++i) {
+      if (weight_[i]->SparseDeriv()) {
+        row_step_[i].assign(weight_[i]->size[0], 0);
+      }
+    }
+    step_ = 0;
+
+    // Weights updated by the forward pass
+    std::vector<std::shared_ptr<Mat<Dtype>>> forward_weight;
+    model->GetForwardWeight(&forward_weight);
+    forward_weight_.assign(weight_.size(), false);
+    for (size_t i = 0; i < weight_.size(); ++i) {
+      forward_weight_[i] = std::find(forward_weight.begin(),
+                                     forward_weight.end(), weight_[i]) !=
+                           forward_weight.end();
+    }
+
+    // Get the replicas weights and share the model ones
+    uint32_t batch_size = 0;
+    replica_weight_.resize(replica.size());
+    for (size_t r = 0; r < replica.size(); ++r) {
+      if (!replica[r] || !replica[r]->DataLayer()) {
+        Report(kError, "Invalid replica");
+        return false;
+      }
+      replica[r]->GetWeight(&replica_weight_[r]);
+      bool match = replica_weight_[r].size() == weight_.size();
+      for (size_t i = 0; match && i < weight_.size(); ++i) {
+        match = replica_weight_[r][i]->Size() == weight_[i]->Size();
+      }
+      if (!match) {
+        Report(kError, "Replica #%d is not matching the model",
+               int(r));
+        return false;
+      }
+      for (size_t i = 0; i < weight_.size(); ++i) {
+        if (!forward_weight_[i]) {
+          replica_weight_[r][i]->SetView(weight_[i]->View());
+        }
+      }
+      replica[r]->InvalidateCache();
+      replica[r]->ClearDeriv();
+      batch_size += replica[r]->BatchSize();
+    }
+    if (!replica.empty()) {
+      if (!model->DataLayer() || batch_size != model->BatchSize()) {
+        Report(kError, "Replicas batch sizes are not matching the model");
+        return false;
+      }
+      Broadcast();
+    }
+
+    if (profiler_) {
+      profiler_->Clear();
+      if (profile_counter_) {
+        // Opened now to count all the running threads
+        profiler_->OpenCounter();
+      }
+      SetProfiler(model, replica, profiler_.get());
+    }
+
+    // Wall-clock time (the CPU time would add up the worker threads)
+    double start = Profiler::Now();
 
     uint32_t print = 0;
     uint32_t test  = 0;
     uint32_t save  = 0;
     uint32_t lr    = 0;
     for (uint32_t step = 0; step < num_step; ++step) {
+      double step_start = Profiler::Now();
+
       // Train (calculate output values and input/weight derivatives)
-      Dtype loss = model->Train();
+      Trace::Begin("train", "solver");
+      Dtype loss = replica.empty() ? model->Train() :
+                                     TrainReplica(model, replica);
+      Trace::End("train", "solver");
 
       // Learn (update the weights)
+      step_ = step + 1;
+      Trace::Begin("learn", "solver");
       Learn(model->BatchSize(), learning_rate);
+      Trace::End("learn", "solver");
 
       // Clean
+      Trace::Begin("clear", "solver");
       model->ClearDeriv();
+      model->InvalidateCache();
+      if (!replica.empty()) {
+        Broadcast();
+        ParallelFor(0, replica.size(), [&](size_t r) {
+          replica[r]->ClearDeriv();
+          replica[r]->InvalidateCache();
+        });
+      }
+      Trace::End("clear", "solver");
+      if (profiler_) {
+        profiler_->AddStep(Profiler::Now() - step_start);
+      }
 
       if (print_each_ && !step) {
         Report(kInfo, "Step #%ld LR: %f, Initial loss: %f",
@@ -144,22 +455,30 @@ class Solver {
       if (print_each_ && ((++print >= print_each_) ||
                           (step == num_step - 1))) {
         Report(kInfo, "Step #%ld LR: %f, Loss: %f, Speed: %f steps/sec",
-               step + 1, learning_rate, loss, print_each_ /
-               (static_cast<double>(std::clock() - start) / CLOCKS_PER_SEC));
+               step + 1, learning_rate, loss,
+               print / (Profiler::Now() - start));
+        ReportProfile();
         print = 0;
-        start = std::clock();
+        start = Profiler::Now();
       }
 
       if (test_each_ && ((++test >= test_each_) || (step == num_step - 1))) {
-        Report(kInfo, "Step #%d Accuracy: %f",
-               step + 1, model->Test());
+        // Only the training steps are profiled
+        model->SetProfiler(nullptr);
+        Trace::Begin("test", "solver");
+        Dtype accuracy = model->Test();
+        Trace::End("test", "solver");
+        Report(kInfo, "Step #%d Accuracy: %f", step + 1, accuracy);
+        model->SetProfiler(profiler_.get());
         test = 0;
       }
 
       if (save_each_ && ((++save >= save_each_) || (step == num_step - 1))) {
         std::string file_name = model->Name() + std::string("_") +
                                 std::to_string(step + 1) + ".model";
+        Trace::Begin("save", "solver");
         size_t size = model->Save(file_name.c_str());
+        Trace::End("save", "solver");
         if (print_each_ && size) {
           Report(kInfo, "Saving model '%s' (%ld byte(s))",
                  file_name.c_str(), size);
@@ -178,9 +497,20 @@ class Solver {
       }
     }
 
+    // Report the steps left
+    if (profiler_) {
+      if (profiler_->NumStep()) {
+        ReportProfile();
+      }
+      profiler_->CloseCounter();
+      SetProfiler(model, replica, nullptr);
+    }
+
     // Clear the weights
     weight_.clear();
     weight_prev_.clear();
+    replica_weight_.clear();
+    row_step_.clear();
 
     return true;
   }
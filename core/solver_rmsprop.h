@@ -92,16 +92,19 @@ class SolverRMSprop: public Solver<Dtype> {
    *  \param[in]  decay_rate   : decay rate
    *  \param[in]  reg          : L2 regularization
    *  \param[in]  clip         : gradient clipping
+   *  \param[in]  begin        : first weight to update
+   *  \param[in]  end          : last weight to update (excluded)
    */
   static void RMSprop(const std::shared_ptr<Mat<Dtype>>& weight,
                       const std::shared_ptr<Mat<Dtype>>& weight_prev,
                       uint32_t batch_size, Dtype learning_rate,
-                      Dtype decay_rate, Dtype reg, Dtype clip) {
+                      Dtype decay_rate, Dtype reg, Dtype clip,
+                      size_t begin, size_t end) {
   Dtype* weight_data             = weight->Data();
   const Dtype* weight_deriv_data = weight->DerivData();
   Dtype* weight_prev_data        = weight_prev->Data();
 
-  for (uint32_t i = 0; i < weight->Size(); ++i) {
+  for (size_t i = begin; i < end; ++i) {
       // RMSprop adaptive learning rate
       Dtype dv  = weight_deriv_data[i] / batch_size;
       Dtype ddv = decay_rate * weight_prev_data[i] +
@@ -130,10 +133,21 @@ class SolverRMSprop: public Solver<Dtype> {
    *  \param[in]  batch_size   : batch size
    *  \param[in]  learning_rate: learning rate
    */
-  virtual void Learn(uint32_t batch_size, Dtype learning_rate) const {
+  virtual void Learn(uint32_t batch_size, Dtype learning_rate) {
     for (size_t i = 0; i < Parent::weight_.size(); ++i) {
-      RMSprop(Parent::weight_[i], Parent::weight_prev_[i],
-              batch_size, learning_rate, decay_rate_, reg_, clip_);
+      const std::shared_ptr<Mat<Dtype>>& weight      = Parent::weight_[i];
+      const std::shared_ptr<Mat<Dtype>>& weight_prev = Parent::weight_prev_[i];
+      if (weight->SparseDeriv()) {
+        // Only the rows having derivatives
+        Parent::LearnRow(i, learning_rate, reg_, [&](size_t begin,
+                                                     size_t end) {
+          RMSprop(weight, weight_prev, batch_size, learning_rate,
+                  decay_rate_, reg_, clip_, begin, end);
+        });
+        continue;
+      }
+      RMSprop(weight, weight_prev, batch_size, learning_rate,
+              decay_rate_, reg_, clip_, 0, weight->Size());
     }
   }
 };
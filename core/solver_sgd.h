@@ -91,16 +91,19 @@ class SolverSGD: public Solver<Dtype> {
    *  \param[in]  momentum     : momentum
    *  \param[in]  reg          : L2 regularization
    *  \param[in]  clip         : gradient clipping
+   *  \param[in]  begin        : first weight to update
+   *  \param[in]  end          : last weight to update (excluded)
    */
   static void SGD(const std::shared_ptr<Mat<Dtype>>& weight,
                   const std::shared_ptr<Mat<Dtype>>& weight_prev,
                   uint32_t batch_size, Dtype learning_rate,
-                  Dtype momentum, Dtype reg, Dtype clip) {
+                  Dtype momentum, Dtype reg, Dtype clip,
+                  size_t begin, size_t end) {
     Dtype*       weight_data       = weight->Data();
     const Dtype* weight_deriv_data = weight->DerivData();
     Dtype*       weight_prev_data  = weight_prev->Data();
 
-    for (uint32_t i = 0; i < weight->Size(); ++i) {
+    for (size_t i = begin; i < end; ++i) {
       // SGD with momentum
       Dtype dv = weight_deriv_data[i] / batch_size;
       dv       = momentum * weight_prev_data[i] + dv;
@@ -126,10 +129,21 @@ class SolverSGD: public Solver<Dtype> {
    *  \param[in]  batch_size   : batch size
    *  \param[in]  learning_rate: learning rate
    */
-  virtual void Learn(uint32_t batch_size, Dtype learning_rate) const {
+  virtual void Learn(uint32_t batch_size, Dtype learning_rate) {
     for (size_t i = 0; i < Parent::weight_.size(); ++i) {
-      SGD(Parent::weight_[i], Parent::weight_prev_[i],
-          batch_size, learning_rate, momentum_, reg_, clip_);
+      const std::shared_ptr<Mat<Dtype>>& weight      = Parent::weight_[i];
+      const std::shared_ptr<Mat<Dtype>>& weight_prev = Parent::weight_prev_[i];
+      if (weight->SparseDeriv()) {
+        // Only the rows having derivatives
+        Parent::LearnRow(i, learning_rate, reg_, [&](size_t begin,
+                                                     size_t end) {
+          SGD(weight, weight_prev, batch_size, learning_rate,
+              momentum_, reg_, clip_, begin, end);
+        });
+        continue;
+      }
+      SGD(weight, weight_prev, batch_size, learning_rate,
+          momentum_, reg_, clip_, 0, weight->Size());
     }
   }
 };
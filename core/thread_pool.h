@@ -0,0 +1,590 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_THREAD_POOL_H_
+#define CORE_THREAD_POOL_H_
+
+
+#include <core/log.h>
+#include <core/trace.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  ThreadPool
+ *  \brief  Persistent work-stealing thread pool
+ *
+ * The pool has one task queue (deque) per thread: the thread owning a queue
+ * pushes and pops its tasks at the back (LIFO, the data is still in its
+ * caches), and the idle threads steal tasks from the front of the other
+ * queues (FIFO, the largest pending tasks). The threads calling into the
+ * pool from outside (e.g. the main thread) share queue 0.
+ * A thread waiting for its tasks to be done runs pending tasks meanwhile,
+ * so nested parallel loops neither deadlock nor leave a core idle.
+ *
+ * Tasks do not own anything: they reference a function object living on
+ * the stack of the thread waiting for them, so spawning a task does not
+ * allocate memory.
+ *
+ * The number of threads (including the calling thread) is the number of
+ * cores, unless overridden by the JIK_NUM_THREADS environment variable or
+ * by SetNumThread.
+ */
+class ThreadPool {
+  // Public types
+ public:
+  /*!
+   *  \struct Task
+   *  \brief  Task: run(func, begin, end), then decrement the pending counter
+   */
+  struct Task {
+    void (*run)(const void* func, size_t begin, size_t end);  // Runner
+    const void*          func;     // Function object
+    size_t               begin;    // Range start
+    size_t               end;      // Range end
+    std::atomic<size_t>* pending;  // Pending counter of the task group
+  };
+
+
+  // Protected types
+ protected:
+  /*!
+   *  \struct Queue
+   *  \brief  Task queue (fixed size ring buffer, protected by a lock)
+   */
+  struct Queue {
+    static const size_t kSize = 256;  // Maximum number of tasks
+
+    std::mutex          lock;         // Lock
+    Task                task[kSize];  // Tasks
+    size_t              head = 0;     // Front task index
+    std::atomic<size_t> count{0};     // Number of tasks
+  };
+
+
+  // Protected attributes
+ protected:
+  std::vector<std::unique_ptr<Queue>> queue_;        // Queues, one per thread
+  std::vector<std::thread>            thread_;       // Worker threads
+  std::atomic<size_t>                 num_queued_;   // Number of queued tasks
+  std::atomic<uint32_t>               num_sleeping_; // Sleeping workers
+  std::atomic<bool>                   stop_;         // Stop the workers?
+  std::mutex                          sleep_lock_;   // Sleep lock
+  std::condition_variable             wake_;         // Wake up the workers
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get the index of the queue of the current thread.
+   * Only the workers own a queue, other threads use queue 0.
+   *
+   *  \return Queue index
+   */
+  uint32_t QueueIndex() const {
+    const ThreadPool* pool = CurrentPool();
+    return (pool == this) ? CurrentIndex() : 0;
+  }
+
+  /*!
+   * Get the pool of the current worker thread (nullptr for other threads).
+   *
+   *  \return Pool
+   */
+  static const ThreadPool*& CurrentPool() {
+    static thread_local const ThreadPool* pool = nullptr;
+    return pool;
+  }
+
+  /*!
+   * Get the queue index of the current worker thread.
+   *
+   *  \return Queue index
+   */
+  static uint32_t& CurrentIndex() {
+    static thread_local uint32_t index = 0;
+    return index;
+  }
+
+  /*!
+   * Pop a task from the back of a queue.
+   *
+   *  \param[in]  index: queue index
+   *
+   *  \param[out] task : task
+   *  \return     Task found?
+   */
+  bool Pop(uint32_t index, Task* task) {
+    Queue* queue = queue_[index].get();
+    if (!queue->count.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(queue->lock);
+    size_t count = queue->count.load(std::memory_order_relaxed);
+    if (!count) {
+      return false;
+    }
+    *task = queue->task[(queue->head + count - 1) % Queue::kSize];
+    queue->count.store(count - 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /*!
+   * Steal a task from the front of a queue.
+   *
+   *  \param[in]  index: queue index
+   *
+   *  \param[out] task : task
+   *  \return     Task found?
+   */
+  bool Steal(uint32_t index, Task* task) {
+    Queue* queue = queue_[index].get();
+    if (!queue->count.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(queue->lock);
+    size_t count = queue->count.load(std::memory_order_relaxed);
+    if (!count) {
+      return false;
+    }
+    *task       = queue->task[queue->head];
+    queue->head = (queue->head + 1) % Queue::kSize;
+    queue->count.store(count - 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /*!
+   * Find a task: from the back of our own queue first, then from the front
+   * of the other queues.
+   *
+   *  \param[in]  index: queue index of the current thread
+   *
+   *  \param[out] task : task
+   *  \return     Task found?
+   */
+  bool Find(uint32_t index, Task* task) {
+    if (!num_queued_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    bool found = Pop(index, task);
+    for (size_t i = 1; !found && i < queue_.size(); ++i) {
+      found = Steal((index + i) % queue_.size(), task);
+    }
+    if (found) {
+      num_queued_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return found;
+  }
+
+  /*!
+   * Run a task.
+   *
+   *  \param[in]  task: task
+   */
+  static void Run(const Task& task) {
+    task.run(task.func, task.begin, task.end);
+    task.pending->fetch_sub(1, std::memory_order_release);
+  }
+
+  /*!
+   * Worker thread main loop.
+   *
+   *  \param[in]  index: queue index
+   */
+  void Worker(uint32_t index) {
+    const uint32_t kNumSpin = 1024;
+
+    CurrentPool()  = this;
+    CurrentIndex() = index;
+    Trace::SetThreadName(("worker " + std::to_string(index)).c_str());
+
+    // The worker is traced as busy from the first task it finds to the
+    // first time it runs out of tasks
+    Task task;
+    bool busy = false;
+    while (!stop_.load(std::memory_order_relaxed)) {
+      if (Find(index, &task)) {
+        if (!busy) {
+          Trace::Begin("busy", "pool");
+          busy = true;
+        }
+        Run(task);
+        continue;
+      }
+      if (busy) {
+        Trace::End("busy", "pool");
+        busy = false;
+      }
+
+      // Spin a little before sleeping: the next parallel loop usually
+      // follows closely (e.g. next layer)
+      uint32_t spin = 0;
+      while (spin < kNumSpin &&
+             !num_queued_.load(std::memory_order_relaxed) &&
+             !stop_.load(std::memory_order_relaxed)) {
+        std::this_thread::yield();
+        ++spin;
+      }
+      if (spin < kNumSpin) {
+        continue;
+      }
+
+      // Sleep until some tasks are pushed
+      std::unique_lock<std::mutex> lock(sleep_lock_);
+      num_sleeping_.fetch_add(1);
+      wake_.wait(lock, [this]() {
+        return num_queued_.load() || stop_.load();
+      });
+      num_sleeping_.fetch_sub(1);
+    }
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  num_thread: number of threads, including the calling thread
+   */
+  explicit ThreadPool(uint32_t num_thread):
+    num_queued_(0), num_sleeping_(0), stop_(false) {
+    num_thread = std::max(num_thread, 1u);
+    queue_.resize(num_thread);
+    for (uint32_t i = 0; i < num_thread; ++i) {
+      queue_[i].reset(new Queue);
+    }
+    for (uint32_t i = 1; i < num_thread; ++i) {
+      thread_.emplace_back(&ThreadPool::Worker, this, i);
+    }
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_lock_);
+      stop_.store(true);
+    }
+    wake_.notify_all();
+    for (std::thread& thread : thread_) {
+      thread.join();
+    }
+  }
+
+  /*!
+   * Get the number of threads, including the calling thread.
+   *
+   *  \return Number of threads
+   */
+  uint32_t Size() const {
+    return uint32_t(queue_.size());
+  }
+
+  /*!
+   * Push a task on the queue of the current thread.
+   * The pending counter must have been incremented by the caller.
+   * If the queue is full, the task is run right away.
+   *
+   *  \param[in]  task: task
+   */
+  void Push(const Task& task) {
+    Queue* queue = queue_[QueueIndex()].get();
+    bool   full  = false;
+    num_queued_.fetch_add(1);
+    {
+      std::lock_guard<std::mutex> lock(queue->lock);
+      size_t count = queue->count.load(std::memory_order_relaxed);
+      if (count < Queue::kSize) {
+        queue->task[(queue->head + count) % Queue::kSize] = task;
+        queue->count.store(count + 1, std::memory_order_relaxed);
+      } else {
+        full = true;
+      }
+    }
+    if (full) {
+      num_queued_.fetch_sub(1);
+      Run(task);
+      return;
+    }
+
+    // Wake up a sleeping worker, if any
+    if (num_sleeping_.load()) {
+      std::lock_guard<std::mutex> lock(sleep_lock_);
+      wake_.notify_one();
+    }
+  }
+
+  /*!
+   * Wait for tasks to be done, running pending tasks meanwhile.
+   *
+   *  \param[in]  pending: pending counter of the tasks
+   */
+  void Wait(const std::atomic<size_t>* pending) {
+    uint32_t index = QueueIndex();
+    Task task;
+    while (pending->load(std::memory_order_acquire)) {
+      if (Find(index, &task)) {
+        Run(task);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  /*!
+   * Get the default number of threads: the JIK_NUM_THREADS environment
+   * variable if set, the number of cores otherwise.
+   *
+   *  \return Number of threads
+   */
+  static uint32_t DefaultNumThread() {
+    uint32_t num_thread = std::max(std::thread::hardware_concurrency(), 1u);
+
+    const char* env = std::getenv("JIK_NUM_THREADS");
+    if (!env || !*env) {
+      return num_thread;
+    }
+
+    int val = std::atoi(env);
+    if (val <= 0) {
+      Report(kWarning, "Invalid number of threads '%s', using %d",
+             env, num_thread);
+      return num_thread;
+    }
+    return uint32_t(val);
+  }
+
+  /*!
+   * Get the pool instance.
+   *
+   *  \return Pool instance
+   */
+  static std::unique_ptr<ThreadPool>& Instance() {
+    static std::unique_ptr<ThreadPool> pool(
+      new ThreadPool(DefaultNumThread()));
+    return pool;
+  }
+
+  /*!
+   * Get the pool.
+   *
+   *  \return Pool
+   */
+  static ThreadPool& Get() {
+    return *Instance();
+  }
+
+  /*!
+   * Get the number of threads.
+   *
+   *  \return Number of threads
+   */
+  static uint32_t NumThread() {
+    return Get().Size();
+  }
+
+  /*!
+   * Set the number of threads: the pool is re-created.
+   * This must not be called while some parallel work is running.
+   *
+   *  \param[in]  num_thread: number of threads, including the calling thread
+   */
+  static void SetNumThread(uint32_t num_thread) {
+    if (num_thread == NumThread()) {
+      return;
+    }
+    Instance().reset();
+    Instance().reset(new ThreadPool(num_thread));
+  }
+};
+
+
+/*!
+ *  \class  TaskGroup
+ *  \brief  Fork/join: run small tasks in parallel and wait for them
+ *
+ * The function objects are referenced, not copied: they must outlive the
+ * call to Wait, e.g.:
+ *   auto task = [&]() { ... };
+ *   TaskGroup group;
+ *   group.Run(task);
+ *   ... (runs in parallel with the task)
+ *   group.Wait();
+ */
+class TaskGroup {
+  // Protected attributes
+ protected:
+  ThreadPool*         pool_;     // Thread pool
+  std::atomic<size_t> pending_;  // Number of pending tasks
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Run a function object on a range: func(begin, end).
+   */
+  template <class Func>
+  static void RunRange(const void* func, size_t begin, size_t end) {
+    (*static_cast<const Func*>(func))(begin, end);
+  }
+
+  /*!
+   * Run a function object: func().
+   */
+  template <class Func>
+  static void RunFunc(const void* func, size_t, size_t) {
+    (*static_cast<const Func*>(func))();
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  TaskGroup(): pool_(&ThreadPool::Get()), pending_(0) {}
+
+  /*!
+   * Destructor: wait for the pending tasks.
+   */
+  ~TaskGroup() {
+    Wait();
+  }
+
+  /*!
+   * Run a task: func().
+   *
+   *  \param[in]  func: function object (must outlive Wait)
+   */
+  template <class Func>
+  void Run(const Func& func) {
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    pool_->Push({&RunFunc<Func>, &func, 0, 0, &pending_});
+  }
+
+  /*!
+   * Run a task on a range: func(begin, end).
+   *
+   *  \param[in]  func : function object (must outlive Wait)
+   *  \param[in]  begin: range start
+   *  \param[in]  end  : range end
+   */
+  template <class Func>
+  void Run(const Func& func, size_t begin, size_t end) {
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    pool_->Push({&RunRange<Func>, &func, begin, end, &pending_});
+  }
+
+  // A temporary function object would not outlive Wait
+  template <class Func>
+  void Run(const Func&& func) = delete;
+  template <class Func>
+  void Run(const Func&& func, size_t begin, size_t end) = delete;
+
+  /*!
+   * Wait for the tasks to be done, running pending tasks meanwhile.
+   */
+  void Wait() {
+    pool_->Wait(&pending_);
+  }
+};
+
+
+/*!
+ * Parallel loop over a range, split into sub-ranges: func(begin, end).
+ * The range is split into a few sub-ranges per thread (for load
+ * balancing), of at least grain indices each. The calling thread runs the
+ * first sub-range.
+ *
+ *  \param[in]  begin: range start
+ *  \param[in]  end  : range end
+ *  \param[in]  grain: minimum sub-range size
+ *  \param[in]  func : function object, called on each sub-range
+ */
+template <class Func>
+void ParallelRange(size_t begin, size_t end, size_t grain, const Func& func) {
+  const size_t kNumChunkPerThread = 4;
+
+  if (begin >= end) {
+    return;
+  }
+
+  size_t size      = end - begin;
+  size_t num_chunk = std::min((size + std::max(grain, size_t(1)) - 1) /
+                              std::max(grain, size_t(1)),
+                              ThreadPool::NumThread() * kNumChunkPerThread);
+  if (num_chunk <= 1) {
+    func(begin, end);
+    return;
+  }
+
+  // Push the last sub-ranges first: the owner pops them back to front,
+  // the other threads steal them front to back
+  TaskGroup group;
+  for (size_t chunk = num_chunk - 1; chunk > 0; --chunk) {
+    group.Run(func, begin + size * chunk / num_chunk,
+              begin + size * (chunk + 1) / num_chunk);
+  }
+  func(begin, begin + size / num_chunk);
+  group.Wait();
+}
+
+
+/*!
+ * Parallel loop over a range: func(i) for i in [begin, end[.
+ * Meant for coarse iterations (e.g. one image or one channel each).
+ *
+ *  \param[in]  begin: range start
+ *  \param[in]  end  : range end
+ *  \param[in]  func : function object, called on each index
+ */
+template <class Func>
+void ParallelFor(size_t begin, size_t end, const Func& func) {
+  ParallelRange(begin, end, 1, [&func](size_t range_begin, size_t range_end) {
+    for (size_t i = range_begin; i < range_end; ++i) {
+      func(i);
+    }
+  });
+}
+
+
+}  // namespace jik
+
+
+#endif  // CORE_THREAD_POOL_H_
@@ -0,0 +1,371 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_TRACE_H_
+#define CORE_TRACE_H_
+
+
+#include <core/log.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Trace
+ *  \brief  Begin/end events tracing, exported as a Chrome trace
+ *
+ * Each thread records its events in its own ring buffer (the oldest events
+ * are overwritten), so tracing a thread doesn't contend with the other
+ * ones. Write exports the events of all the threads in the Chrome trace
+ * event format (JSON), readable by chrome://tracing or Perfetto.
+ *
+ * Tracing is disabled by default: a disabled trace point (see TraceScope)
+ * only costs a branch on a flag.
+ */
+class Trace {
+  friend class TraceScope;
+
+  // Public types
+ public:
+  static const size_t kBufferSize = 1 << 16;  // Events per thread
+  static const size_t kNameSize   = 39;       // Maximum name length
+
+
+  // Protected types
+ protected:
+  /*!
+   *  \struct Event
+   *  \brief  Begin or end event
+   */
+  struct Event {
+    uint64_t    time;                  // Timestamp (in ns, steady clock)
+    const char* category;              // Category (static string)
+    char        phase;                 // 'B' (begin) or 'E' (end)
+    char        name[kNameSize + 1];   // Name (truncated)
+  };
+
+  /*!
+   *  \struct Buffer
+   *  \brief  Events of a thread (ring buffer)
+   */
+  struct Buffer {
+    std::mutex         lock;   // Lock (against Write and Clear)
+    std::vector<Event> event;  // Events (allocated on the first one)
+    uint64_t           count;  // Number of recorded events
+    uint32_t           tid;    // Thread id (in the trace)
+    std::string        name;   // Thread name
+  };
+
+  /*!
+   *  \struct Registry
+   *  \brief  Buffers of all the threads (they outlive their thread)
+   */
+  struct Registry {
+    std::mutex                           lock;    // Lock
+    std::vector<std::shared_ptr<Buffer>> buffer;  // Buffers
+  };
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get the tracing flag.
+   *
+   *  \return Tracing flag
+   */
+  static std::atomic<bool>& Active() {
+    static std::atomic<bool> active(false);
+    return active;
+  }
+
+  /*!
+   * Get the registry of the buffers.
+   *
+   *  \return Registry
+   */
+  static Registry& Global() {
+    static Registry registry;
+    return registry;
+  }
+
+  /*!
+   * Get the buffer of the current thread (registered on the first call).
+   *
+   *  \return Buffer
+   */
+  static Buffer& Current() {
+    static thread_local std::shared_ptr<Buffer> buffer;
+    if (!buffer) {
+      buffer = std::make_shared<Buffer>();
+      buffer->count = 0;
+      Registry& registry = Global();
+      std::lock_guard<std::mutex> lock(registry.lock);
+      buffer->tid = uint32_t(registry.buffer.size() + 1);
+      registry.buffer.push_back(buffer);
+    }
+    return *buffer;
+  }
+
+  /*!
+   * Record an event in the buffer of the current thread.
+   *
+   *  \param[in]  phase   : 'B' (begin) or 'E' (end)
+   *  \param[in]  name    : name
+   *  \param[in]  category: category (static string)
+   */
+  static void Record(char phase, const char* name, const char* category) {
+    uint64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+    Buffer& buffer = Current();
+    std::lock_guard<std::mutex> lock(buffer.lock);
+    if (buffer.event.empty()) {
+      buffer.event.resize(kBufferSize);
+    }
+    Event& event   = buffer.event[buffer.count % kBufferSize];
+    event.time     = time;
+    event.category = category;
+    event.phase    = phase;
+    std::strncpy(event.name, (name && *name) ? name : "(unnamed)",
+                 kNameSize);
+    event.name[kNameSize] = '\0';
+    ++buffer.count;
+  }
+
+  /*!
+   * Write a string as a JSON string.
+   *
+   *  \param[in]  file: file
+   *  \param[in]  str : string
+   */
+  static void WriteString(std::FILE* file, const char* str) {
+    std::fputc('"', file);
+    for (; *str; ++str) {
+      if (*str == '"' || *str == '\\') {
+        std::fputc('\\', file);
+      }
+      if (uint8_t(*str) >= 0x20) {
+        std::fputc(*str, file);
+      }
+    }
+    std::fputc('"', file);
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Enable (or disable) the tracing.
+   *
+   *  \param[in]  enable: enable the tracing?
+   */
+  static void Enable(bool enable = true) {
+    Active().store(enable, std::memory_order_relaxed);
+  }
+
+  /*!
+   * Check if the tracing is enabled.
+   *
+   *  \return Tracing enabled?
+   */
+  static bool Enabled() {
+    return Active().load(std::memory_order_relaxed);
+  }
+
+  /*!
+   * Begin an event on the current thread (see TraceScope).
+   *
+   *  \param[in]  name    : name
+   *  \param[in]  category: category (static string)
+   */
+  static void Begin(const char* name, const char* category) {
+    if (Enabled()) {
+      Record('B', name, category);
+    }
+  }
+
+  /*!
+   * End the last event begun on the current thread.
+   *
+   *  \param[in]  name    : name
+   *  \param[in]  category: category (static string)
+   */
+  static void End(const char* name, const char* category) {
+    if (Enabled()) {
+      Record('E', name, category);
+    }
+  }
+
+  /*!
+   * Name the current thread in the trace.
+   *
+   *  \param[in]  name: thread name
+   */
+  static void SetThreadName(const char* name) {
+    Buffer& buffer = Current();
+    std::lock_guard<std::mutex> lock(buffer.lock);
+    buffer.name = name;
+  }
+
+  /*!
+   * Clear the events of all the threads.
+   */
+  static void Clear() {
+    Registry& registry = Global();
+    std::lock_guard<std::mutex> lock(registry.lock);
+    for (const std::shared_ptr<Buffer>& buffer : registry.buffer) {
+      std::lock_guard<std::mutex> buffer_lock(buffer->lock);
+      buffer->count = 0;
+    }
+  }
+
+  /*!
+   * Write the events of all the threads as a Chrome trace (JSON).
+   * The end events having lost their begin event (overwritten) are
+   * skipped.
+   *
+   *  \param[in]  file_name: file name
+   *
+   *  \return     Error?
+   */
+  static bool Write(const char* file_name) {
+    std::FILE* file = std::fopen(file_name, "wt");
+    if (!file) {
+      Report(kWarning, "Cannot open '%s'", file_name);
+      return false;
+    }
+
+    Registry& registry = Global();
+    std::lock_guard<std::mutex> lock(registry.lock);
+
+    // Timestamps relative to the first event
+    uint64_t start = UINT64_MAX;
+    for (const std::shared_ptr<Buffer>& buffer : registry.buffer) {
+      std::lock_guard<std::mutex> buffer_lock(buffer->lock);
+      uint64_t first = buffer->count > kBufferSize ?
+                       buffer->count - kBufferSize : 0;
+      if (buffer->count) {
+        start = std::min(start,
+                         buffer->event[first % kBufferSize].time);
+      }
+    }
+
+    std::fprintf(file, "{\"traceEvents\":[\n");
+    std::fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+                 "\"args\":{\"name\":\"jik\"}}");
+    for (const std::shared_ptr<Buffer>& buffer : registry.buffer) {
+      std::lock_guard<std::mutex> buffer_lock(buffer->lock);
+      std::string name = buffer->name.empty() ?
+                         "thread " + std::to_string(buffer->tid) :
+                         buffer->name;
+      std::fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                   "\"pid\":1,\"tid\":%u,\"args\":{\"name\":", buffer->tid);
+      WriteString(file, name.c_str());
+      std::fprintf(file, "}}");
+
+      uint64_t first = buffer->count > kBufferSize ?
+                       buffer->count - kBufferSize : 0;
+      uint32_t depth = 0;
+      for (uint64_t i = first; i < buffer->count; ++i) {
+        const Event& event = buffer->event[i % kBufferSize];
+        if (event.phase == 'E') {
+          if (!depth) {
+            continue;
+          }
+          --depth;
+        } else {
+          ++depth;
+        }
+        std::fprintf(file, ",\n{\"name\":");
+        WriteString(file, event.name);
+        std::fprintf(file, ",\"cat\":");
+        WriteString(file, event.category);
+        std::fprintf(file, ",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,"
+                     "\"ts\":%.3f}", event.phase, buffer->tid,
+                     (event.time - start) * 1e-3);
+      }
+    }
+    std::fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    std::fclose(file);
+    return true;
+  }
+};
+
+
+/*!
+ *  \class  TraceScope
+ *  \brief  Event of the current thread lasting for a scope (see Trace)
+ */
+class TraceScope {
+  // Protected attributes
+ protected:
+  const char* name_;      // Name
+  const char* category_;  // Category (static string)
+  bool        active_;    // Event begun?
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor: begin the event.
+   *
+   *  \param[in]  name    : name
+   *  \param[in]  category: category (static string)
+   */
+  TraceScope(const char* name, const char* category) {
+    name_     = name;
+    category_ = category;
+    active_   = Trace::Enabled();
+    if (active_) {
+      Trace::Record('B', name, category);
+    }
+  }
+
+  /*!
+   * Destructor: end the event.
+   */
+  ~TraceScope() {
+    if (active_) {
+      Trace::Record('E', name_, category_);
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_TRACE_H_
@@ -28,6 +28,9 @@
 
 
 #include <core/model.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
 
 
 namespace jik {
@@ -36,6 +39,12 @@ namespace jik {
 /*!
  *  \class  Recurrent
  *  \brief  Recurrent model
+ *
+ * The graph is unrolled once for a maximum number of timesteps: each
+ * timestep has its own layers (sharing the weights) and activations, the
+ * first one reading the initial state. A sequence is run over the first
+ * timesteps of the graph, and the backward pass goes through all of them
+ * (backpropagation through time), without creating anything.
  */
 template <typename Dtype>
 class Recurrent: public Model<Dtype> {
@@ -45,6 +54,25 @@ class Recurrent: public Model<Dtype> {
   typedef Model<Dtype> Parent;
 
 
+  // Protected attributes
+ protected:
+  std::vector<std::shared_ptr<Mat<Dtype>>> step_in_;     // Inputs (indices)
+  std::vector<std::shared_ptr<Mat<Dtype>>> step_out_;    // Outputs
+  std::vector<size_t>                      step_layer_;  // First layers
+  uint32_t                                 num_step_;    // Timesteps to clear
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Add the layers of a timestep to the graph.
+   * It must set the timestep input (indices) and output.
+   *
+   *  \param[in]  step: timestep
+   */
+  virtual void CreateStep(uint32_t step) = 0;
+
+
   // Public methods
  public:
   /*!
@@ -52,7 +80,9 @@ class Recurrent: public Model<Dtype> {
    *
    *  \param[in]  name: model name
    */
-  explicit Recurrent(const char* name): Model<Dtype>(name) {}
+  explicit Recurrent(const char* name): Model<Dtype>(name) {
+    num_step_ = 0;
+  }
 
   /*!
    * Destructor.
@@ -60,14 +90,113 @@ class Recurrent: public Model<Dtype> {
   virtual ~Recurrent() {}
 
   /*!
-   * Create at a specific index.
+   * Create the unrolled graph.
    *
+   *  \param[in]  max_step: maximum number of timesteps
+   */
+  void Create(uint32_t max_step) {
+    Parent::Clear();
+    step_in_.assign(max_step, nullptr);
+    step_out_.assign(max_step, nullptr);
+    step_layer_.resize(max_step + 1);
+    for (uint32_t step = 0; step < max_step; ++step) {
+      step_layer_[step] = Parent::layer_.size();
+      CreateStep(step);
+    }
+    step_layer_[max_step] = Parent::layer_.size();
+    Parent::in_  = step_in_[0];
+    Parent::out_ = step_out_[max_step - 1];
+    num_step_    = max_step;
+    ClearPrevState();
+  }
+
+  /*!
+   * Get the maximum number of timesteps.
+   *
+   *  \return Maximum number of timesteps
+   */
+  uint32_t MaxStep() const {
+    return uint32_t(step_in_.size());
+  }
+
+  /*!
+   * Set the input of a timestep.
+   *
+   *  \param[in]  step : timestep
    *  \param[in]  index: data index
+   *  \param[in]  batch: batch index
+   */
+  void SetInput(uint32_t step, uint32_t index, uint32_t batch = 0) {
+    step_in_[step]->Data()[batch] = Dtype(index);
+  }
+
+  /*!
+   * Set the batch size (see Model::SetBatchSize), including the timesteps
+   * inputs.
+   *
+   *  \param[in]  batch_size: batch size
+   */
+  virtual void SetBatchSize(uint32_t batch_size) {
+    for (size_t step = 0; step < step_in_.size(); ++step) {
+      step_in_[step]->SetBatchSize(batch_size);
+    }
+    Parent::SetBatchSize(batch_size);
+  }
+
+  /*!
+   * Forward pass over a range of timesteps.
+   *
+   *  \param[in]  state     : state
+   *  \param[in]  step_begin: first timestep
+   *  \param[in]  step_end  : last timestep (excluded)
+   */
+  void ForwardStep(const State& state, uint32_t step_begin,
+                   uint32_t step_end) {
+    TraceScope trace("forward", "model");
+    for (size_t i = step_layer_[step_begin]; i < step_layer_[step_end]; ++i) {
+      Parent::ForwardLayer(i, state);
+    }
+  }
+
+  /*!
+   * Backward pass over a range of timesteps (backpropagation through time).
+   *
+   *  \param[in]  state     : state
+   *  \param[in]  step_begin: first timestep
+   *  \param[in]  step_end  : last timestep (excluded)
+   */
+  void BackwardStep(const State& state, uint32_t step_begin,
+                    uint32_t step_end) {
+    TraceScope trace("backward", "model");
+    for (size_t i = step_layer_[step_end]; i > step_layer_[step_begin]; --i) {
+      Parent::BackwardLayer(i - 1, state);
+    }
+    num_step_ = std::max(num_step_, step_end);
+  }
+
+  /*!
+   * Clear the derivatives (of the timesteps that went backward only).
+   */
+  virtual void ClearDeriv() {
+    if (!num_step_) {
+      return;
+    }
+    for (size_t i = 0; i < step_layer_[num_step_]; ++i) {
+      Parent::layer_[i]->ClearDeriv();
+    }
+    num_step_ = 0;
+  }
+
+  /*!
+   * Copy the state of a timestep to the initial state (to run a sequence
+   * longer than the graph).
+   *
+   *  \param[in]  step: timestep
    */
-  virtual void Create(uint32_t index) {}
+  virtual void CarryState(uint32_t step) {}
 
   /*!
-   * Clear the previous iteration state.
+   * Clear the initial state.
    */
   virtual void ClearPrevState() {}
 };
@@ -30,6 +30,7 @@
 #include <recurrent/recurrent.h>
 #include <core/rand.h>
 #include <core/layer_add.h>
+#include <core/layer_embed.h>
 #include <core/layer_mult.h>
 #include <core/layer_relu.h>
 #include <memory>
@@ -58,9 +59,82 @@ class Rnn: public Recurrent<Dtype> {
   std::vector<std::shared_ptr<Mat<Dtype>>> bhh_;          // Gates weights
   std::shared_ptr<Mat<Dtype>>              whd_;          // Decoder weights
   std::shared_ptr<Mat<Dtype>>              bd_;           // Decoder weights
-  std::shared_ptr<Mat<Dtype>>              wil_;          // Decoder weights
-  std::vector<std::shared_ptr<Mat<Dtype>>> hidden_prev_;  // Previous hidden
+  std::shared_ptr<Mat<Dtype>>              wil_;          // Embedding table
+  std::vector<std::shared_ptr<Mat<Dtype>>> hidden_init_;  // Initial hidden
+  std::vector<std::vector<std::shared_ptr<Mat<Dtype>>>>
+                                           hidden_;       // Hidden states
   std::vector<uint32_t>                    hidden_size_;  // Hidden state size
+  uint32_t                                 batch_size_;   // Batch size
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Add the layers of a timestep to the graph.
+   *
+   *  \param[in]  step: timestep
+   */
+  virtual void CreateStep(uint32_t step) {
+    if (!step) {
+      // Initial state
+      hidden_init_.clear();
+      for (size_t d = 0; d < hidden_size_.size(); d++) {
+        hidden_init_.push_back(std::make_shared<Mat<Dtype>>(
+          hidden_size_[d], 1, 1, batch_size_));
+      }
+      hidden_.clear();
+    }
+
+    Parent::step_in_[step] = std::make_shared<Mat<Dtype>>(1, 1, 1,
+                                                          batch_size_, false);
+
+    std::shared_ptr<Mat<Dtype>> x = Parent::Add(
+      std::make_shared<LayerEmbed<Dtype>>("embed",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+      Parent::step_in_[step], wil_}))[0];
+
+    std::vector<std::shared_ptr<Mat<Dtype>>> hidden;
+    for (size_t d = 0; d < hidden_size_.size(); d++) {
+      std::shared_ptr<Mat<Dtype>> in_vector;
+      if (d == 0) {
+        in_vector = x;
+      } else {
+        in_vector = hidden[d - 1];
+      }
+      const std::shared_ptr<Mat<Dtype>>& hidden_prev =
+        step ? hidden_[step - 1][d] : hidden_init_[d];
+
+      std::shared_ptr<Mat<Dtype>> h0 = Parent::Add(
+        std::make_shared<LayerMult<Dtype>>("wxh",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wxh_[d],
+        in_vector}))[0];
+      std::shared_ptr<Mat<Dtype>> h1 = Parent::Add(
+        std::make_shared<LayerMult<Dtype>>("whh",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{whh_[d],
+        hidden_prev}))[0];
+      std::shared_ptr<Mat<Dtype>> h01 = Parent::Add(
+        std::make_shared<LayerAdd<Dtype>>("h01",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{h0, h1}))[0];
+      std::shared_ptr<Mat<Dtype>> bias = Parent::Add(
+        std::make_shared<LayerAdd<Dtype>>("bhh",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{h01, bhh_[d]}))[0];
+      std::shared_ptr<Mat<Dtype>> hidden_curr = Parent::Add(
+        std::make_shared<LayerRelu<Dtype>>("relu",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{bias}))[0];
+
+      hidden.push_back(hidden_curr);
+    }
+
+    // Decoder
+    std::shared_ptr<Mat<Dtype>> hd = Parent::Add(
+      std::make_shared<LayerMult<Dtype>>("whd",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{whd_,
+      hidden[hidden.size() - 1]}))[0];
+    Parent::step_out_[step] = Parent::Add(std::make_shared<LayerAdd<Dtype>>(
+      "bd", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hd, bd_}))[0];
+
+    hidden_.push_back(hidden);
+  }
 
 
   // Public methods
@@ -80,6 +154,7 @@ class Rnn: public Recurrent<Dtype> {
       uint32_t size_out, Dtype range,
       uint32_t batch_size): Recurrent<Dtype>(name) {
     hidden_size_ = hidden_size;
+    batch_size_  = batch_size;
 
     Dtype hrange   = 0.5f * range;
     uint32_t hsize = 0;
@@ -93,18 +168,18 @@ class Rnn: public Recurrent<Dtype> {
       hsize = hidden_size_[d];
 
       // Add the gates weights
-      wxh_.push_back(Rand<Dtype>::GenMat(hsize, size_prev, 1, batch_size,
+      wxh_.push_back(Rand<Dtype>::GenMat(hsize, size_prev, 1, 1,
                                          -hrange, hrange));
-      whh_.push_back(Rand<Dtype>::GenMat(hsize, hsize, 1, batch_size,
+      whh_.push_back(Rand<Dtype>::GenMat(hsize, hsize, 1, 1,
                                          -hrange, hrange));
-      bhh_.push_back(std::make_shared<Mat<Dtype>>(hsize, 1, 1, batch_size));
+      bhh_.push_back(std::make_shared<Mat<Dtype>>(hsize, 1, 1, 1));
     }
 
     // Create the decoder weights
-    whd_ = Rand<Dtype>::GenMat(size_out, hsize, 1, batch_size,
+    whd_ = Rand<Dtype>::GenMat(size_out, hsize, 1, 1,
                                -hrange, hrange);
-    bd_  = std::make_shared<Mat<Dtype>>(size_out, 1, 1, batch_size);
-    wil_ = Rand<Dtype>::GenMat(size_in, size_out, 1, batch_size,
+    bd_  = std::make_shared<Mat<Dtype>>(size_out, 1, 1, 1);
+    wil_ = Rand<Dtype>::GenMat(size_out, size_in, 1, 1,
                                -hrange, hrange);
   }
 
@@ -113,6 +188,20 @@ class Rnn: public Recurrent<Dtype> {
    */
   virtual ~Rnn() {}
 
+  /*!
+   * Set the batch size (see Model::SetBatchSize), including the initial
+   * state.
+   *
+   *  \param[in]  batch_size: batch size
+   */
+  virtual void SetBatchSize(uint32_t batch_size) {
+    batch_size_ = batch_size;
+    for (size_t d = 0; d < hidden_init_.size(); d++) {
+      hidden_init_[d]->SetBatchSize(batch_size);
+    }
+    Parent::SetBatchSize(batch_size);
+  }
+
   /*!
    * Get the weights.
    *
@@ -132,79 +221,23 @@ class Rnn: public Recurrent<Dtype> {
   }
 
   /*!
-   * Create at a specific index.
+   * Copy the state of a timestep to the initial state.
    *
-   *  \param[in]  index: data index
+   *  \param[in]  step: timestep
    */
-  virtual void Create(uint32_t index) {
-    // Clear all the layers
-    Parent::Clear();
-
-    uint32_t batch_size = wil_->size[3];
-
-    if (hidden_prev_.empty()) {
-      for (uint32_t d = 0; d < hidden_size_.size(); d++) {
-        hidden_prev_.push_back(std::make_shared<Mat<Dtype>>(
-          hidden_size_[d], 1, 1, batch_size));
-      }
-    }
-
-    Parent::in_ = std::make_shared<Mat<Dtype>>(wil_->size[1],
-                                               1, 1, batch_size);
-    Parent::in_->Data()[index] = Dtype(1);
-
-    std::shared_ptr<Mat<Dtype>> x = Parent::Add(
-      std::make_shared<LayerMult<Dtype>>("",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wil_,
-      Parent::in_}))[0];
-
-    std::vector<std::shared_ptr<Mat<Dtype>>> hidden;
+  virtual void CarryState(uint32_t step) {
     for (size_t d = 0; d < hidden_size_.size(); d++) {
-      std::shared_ptr<Mat<Dtype>> in_vector;
-      if (d == 0) {
-        in_vector = x;
-      } else {
-        in_vector = hidden[d - 1];
-      }
-      std::shared_ptr<Mat<Dtype>>& hidden_prev = hidden_prev_[d];
-
-      std::shared_ptr<Mat<Dtype>> h0 = Parent::Add(
-        std::make_shared<LayerMult<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wxh_[d],
-        in_vector}))[0];
-      std::shared_ptr<Mat<Dtype>> h1 = Parent::Add(
-        std::make_shared<LayerMult<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{whh_[d],
-        hidden_prev}))[0];
-      std::shared_ptr<Mat<Dtype>> h01 = Parent::Add(
-        std::make_shared<LayerAdd<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{h0, h1}))[0];
-      std::shared_ptr<Mat<Dtype>> bias = Parent::Add(
-        std::make_shared<LayerAdd<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{h01, bhh_[d]}))[0];
-      std::shared_ptr<Mat<Dtype>> hidden_curr = Parent::Add(
-        std::make_shared<LayerRelu<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{bias}))[0];
-
-      hidden.push_back(hidden_curr);
+      hidden_init_[d]->data = hidden_[step][d]->data;
     }
-
-    // Decoder
-    std::shared_ptr<Mat<Dtype>> hd = Parent::Add(
-      std::make_shared<LayerMult<Dtype>>("",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{whd_,
-      hidden[hidden.size() - 1]}))[0];
-    Parent::out_ = Parent::Add(std::make_shared<LayerAdd<Dtype>>("",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hd, bd_}))[0];
-
-    hidden_prev_ = hidden;
   }
 
   /*!
-   * Clear the previous iteration state.
+   * Clear the initial state.
    */
   virtual void ClearPrevState() {
-    hidden_prev_.clear();
+    for (size_t d = 0; d < hidden_init_.size(); d++) {
+      hidden_init_[d]->Zero();
+    }
   }
 };
 
@@ -26,10 +26,11 @@
 #include <sys/stat.h>
 #include <core/arg_parse.h>
 #include <core/log.h>
+#include <core/thread_pool.h>
 #include <core/dataset.h>
 #include <core/layer_data.h>
+#include <core/prefetch.h>
 #include <core/layer_batch_norm.h>
-#include <core/layer_scale.h>
 #include <core/layer_conv.h>
 #include <core/layer_relu.h>
 #include <core/layer_pool_max.h>
@@ -321,6 +322,15 @@ class Cifar10Dataset: public Dataset {
     return true;
   }
 
+  /*!
+   * Randomly shuffle the training set (e.g. at each epoch).
+   */
+  void ShuffleTrain() {
+    std::random_device rd;
+    std::default_random_engine re(rd());
+    std::shuffle(train_.begin(), train_.end(), re);
+  }
+
   /*!
    * Get the training set.
    *
@@ -358,6 +368,8 @@ class Cifar10DataLayer: public LayerData<Dtype> {
   Cifar10Dataset<Dtype> dataset_;               // Cifar10 dataset
   uint32_t              dataset_train_index_;   // Dataset index (training)
   uint32_t              dataset_test_index_;    // Dataset index (testing)
+  uint32_t              num_prefetch_;          // Number of prefetched batches
+  Prefetch<Dtype>       prefetch_;              // Training batches prefetching
 
 
   // Public methods
@@ -376,6 +388,7 @@ class Cifar10DataLayer: public LayerData<Dtype> {
     uint32_t batch_size;
     param.Get("dataset_path", &dataset_path);
     param.Get("batch_size"  , &batch_size);
+    param.Get("num_prefetch", 4u, &num_prefetch_);
 
     if (!dataset_.Load(dataset_path.c_str())) {
       return;
@@ -397,11 +410,46 @@ class Cifar10DataLayer: public LayerData<Dtype> {
     Parent::out_[1] = std::make_shared<Mat<Dtype>>(1, 1, 1, batch_size, false);
   }
 
+  /*!
+   * Constructor of a replica data layer (data-parallel training).
+   * It does not load any dataset: its outputs are fed with shards of the
+   * batch of the replicated data layer.
+   *
+   *  \param[in]  name      : layer name
+   *  \param[in]  data      : replicated data layer
+   *  \param[in]  batch_size: batch size
+   */
+  Cifar10DataLayer(const char* name, const LayerData<Dtype>& data,
+                   uint32_t batch_size): LayerData<Dtype>(name),
+                                         dataset_(false) {
+    dataset_train_index_ = dataset_test_index_ = 0;
+    num_prefetch_        = 0;
+
+    const std::vector<std::shared_ptr<Mat<Dtype>>>& out = data.Output();
+    Parent::out_.resize(out.size());
+    for (size_t i = 0; i < out.size(); ++i) {
+      Parent::out_[i] = std::make_shared<Mat<Dtype>>(
+        out[i]->size[0], out[i]->size[1], out[i]->size[2], batch_size,
+        bool(out[i]->deriv));
+    }
+  }
+
   /*!
    * Destructor.
    */
   virtual ~Cifar10DataLayer() {}
 
+  /*!
+   * Set the batch size: the batches prefetched so far have the previous
+   * size, the prefetching starts over.
+   *
+   *  \param[in]  batch_size: batch size
+   */
+  virtual void SetBatchSize(uint32_t batch_size) {
+    prefetch_.Stop();
+    Parent::SetBatchSize(batch_size);
+  }
+
   /*!
    * Get the test index.
    *
@@ -436,15 +484,20 @@ class Cifar10DataLayer: public LayerData<Dtype> {
   }
 
   /*!
-   * Forward pass.
+   * Fill a batch with the next images of the dataset.
    *
-   *  \param[in]  state: state
+   *  \param[in]  train     : training dataset? (or testing one)
+   *  \param[in]  batch_size: batch size
+   *
+   *  \param[out] image_data: images
+   *  \param[out] label_data: labels
    */
-  virtual void Forward(const State& state) {
+  void Fill(bool train, uint32_t batch_size,
+            Dtype* image_data, Dtype* label_data) {
     // Get the proper dataset (either training or testing one)
     const std::vector<typename Cifar10Dataset<Dtype>::Image>* dataset;
     uint32_t* dataset_index;
-    if (state.phase == State::PHASE_TRAIN) {
+    if (train) {
       dataset       = &dataset_.Train();
       dataset_index = &dataset_train_index_;
     } else {
@@ -454,24 +507,16 @@ class Cifar10DataLayer: public LayerData<Dtype> {
 
     if (dataset->empty()) {
       Report(kError, "Empty dataset");
-      Parent::out_[0]->Zero();
-      Parent::out_[1]->Zero();
       return;
     }
 
     if (*dataset_index >= uint32_t(dataset->size())) {
       Report(kError, "Invalid dataset index");
-      Parent::out_[0]->Zero();
-      Parent::out_[1]->Zero();
       return;
     }
 
-    Dtype* image_data = Parent::out_[0]->Data();
-    Dtype* label_data = Parent::out_[1]->Data();
-
     uint32_t image_size = Parent::out_[0]->size[0] * Parent::out_[0]->size[1] *
                           Parent::out_[0]->size[2];
-    uint32_t batch_size = Parent::out_[0]->size[3];
 
     bool testing_done = false;
 
@@ -489,9 +534,10 @@ class Cifar10DataLayer: public LayerData<Dtype> {
 
       // Go to the next image
       if (++*dataset_index >= uint32_t(dataset->size())) {
-        if (state.phase == State::PHASE_TRAIN) {
-          // Rewind
+        if (train) {
+          // Rewind and shuffle for the next epoch
           *dataset_index = 0;
+          dataset_.ShuffleTrain();
         } else {
           // Clamp
           *dataset_index = uint32_t(dataset->size()) - 1;
@@ -505,6 +551,29 @@ class Cifar10DataLayer: public LayerData<Dtype> {
       *dataset_index = uint32_t(dataset->size());
     }
   }
+
+  /*!
+   * Forward pass.
+   * The training batches are filled in the background (see Prefetch).
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {
+    if (state.phase == State::PHASE_TRAIN) {
+      if (!prefetch_.Running()) {
+        uint32_t batch_size = Parent::out_[0]->size[3];
+        prefetch_.Start(Parent::out_, num_prefetch_,
+                        [this, batch_size](const std::vector<Dtype*>& data) {
+          Fill(true, batch_size, data[0], data[1]);
+        });
+      }
+      prefetch_.Get(Parent::out_);
+      return;
+    }
+
+    Fill(false, Parent::out_[0]->size[3], Parent::out_[0]->Data(),
+         Parent::out_[1]->Data());
+  }
 };
 
 
@@ -537,11 +606,16 @@ class Cifar10Model: public Model<Dtype> {
    *  \param[in]  batch_size  : matrix size (batch size)
    *  \param[in]  gray : grayscale the input?
    *  \param[in]  use_bn      : use batch norm?
+   *  \param[in]  model       : model to replicate (data-parallel training),
+   *                             if any
+   *  \param[in]  frozen      : inference only (no derivatives)?
    */
   Cifar10Model(const char* name, const char* dataset_path, uint32_t num_output,
-               uint32_t batch_size, bool gray, bool use_bn):
+               uint32_t batch_size, bool gray, bool use_bn,
+               const Model<Dtype>* model = nullptr,
+               bool frozen = false):
 
-  Model<Dtype>(name) {
+  Model<Dtype>(name, frozen) {
     // Network architecture:
     //
     // DATA1 (INPUT)
@@ -597,7 +671,10 @@ class Cifar10Model: public Model<Dtype> {
     data_param.Add("batch_size"  , batch_size);
 
     // Input layer
-    std::vector<std::shared_ptr<Mat<Dtype>>> out = Parent::Add(
+    // A replica gets its data from the replicated model data layer
+    std::vector<std::shared_ptr<Mat<Dtype>>> out = Parent::Add(model ?
+      std::make_shared<Cifar10DataLayer<Dtype>>("data1", *model->DataLayer(),
+                                                batch_size) :
       std::make_shared<Cifar10DataLayer<Dtype>>("data1", data_param, gray));
 
     // Model input (images) and labels
@@ -639,14 +716,12 @@ class Cifar10Model: public Model<Dtype> {
     // BN layer parameters
     Param bn_param;
     bn_param.Add("moving_avg_frac", 0.99f);
+    bn_param.Add("use_scale"      , 1);
     if (use_bn) {
-      // BN1, Scale1 (whitening activations)
+      // BN1 (whitening activations, fused scale)
       Parent::out_ = Parent::Add(std::make_shared<LayerBatchNorm<Dtype>>("bn1",
         std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
         bn_param))[0];
-      Parent::out_ = Parent::Add(std::make_shared<LayerScale<Dtype>>("scale1",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-        Param()))[0];
     }
 
     // Conv2, Relu2, Pool2
@@ -660,13 +735,10 @@ class Cifar10Model: public Model<Dtype> {
       pool_param))[0];
 
     if (use_bn) {
-      // BN2, Scale2 (whitening activations)
+      // BN2 (whitening activations, fused scale)
       Parent::out_ = Parent::Add(std::make_shared<LayerBatchNorm<Dtype>>("bn2",
         std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
         bn_param))[0];
-      Parent::out_ = Parent::Add(std::make_shared<LayerScale<Dtype>>("scale2",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-        Param()))[0];
     }
 
     // Increase the depth for the next conv layer
@@ -783,12 +855,17 @@ int main(int argc, char* argv[]) {
   const char* model_path   = arg.Arg("-model");
   const char* model_name   = arg.Arg("-name");
   const char* solver_type  = arg.Arg("-solver");
+  const char* profile_path = arg.Arg("-profilefile");
+  bool        profile      = arg.ArgExists("-profile");
+  bool        counters     = arg.ArgExists("-counters");
+  const char* trace_path   = arg.Arg("-trace");
   bool        train        = arg.ArgExists("-train");
   bool        gray         = arg.ArgExists("-gray");
   bool        use_bn       = arg.ArgExists("-bn");
   uint32_t batch_size;
   Dtype learning_rate, decay_rate, momentum, reg, clip, lr_scale;
   uint32_t num_step, print_each, test_each, save_each, lr_scale_each;
+  uint32_t num_thread, num_replica, mem_cap;
   arg.Arg<uint32_t>("-batchsize"  , 128          , &batch_size);
   arg.Arg<Dtype>   ("-lr"         , Dtype(0.0005), &learning_rate);
   arg.Arg<Dtype>   ("-decayrate"  , Dtype(0.999) , &decay_rate);
@@ -801,6 +878,9 @@ int main(int argc, char* argv[]) {
   arg.Arg<uint32_t>("-saveeach"   , 1000         , &save_each);
   arg.Arg<uint32_t>("-lrscaleeach", 10000        , &lr_scale_each);
   arg.Arg<Dtype>   ("-lrscale"    , Dtype(0.1)   , &lr_scale);
+  arg.Arg<uint32_t>("-threads"    , 0            , &num_thread);
+  arg.Arg<uint32_t>("-replicas"   , 0            , &num_replica);
+  arg.Arg<uint32_t>("-memcap"     , 0            , &mem_cap);
 
   if (!dataset_path || (!train && !model_path) || arg.ArgExists("-h")) {
     Report(kInfo, "Usage: %s -dataset <path/to/cifar10/dataset> [-train] "
@@ -830,10 +910,28 @@ int main(int argc, char* argv[]) {
   Report(kInfo, "Scale learning rate each: %d", lr_scale_each);
   Report(kInfo, "Learning rate scale     : %f", lr_scale);
 
+  // Threads
+  if (num_thread) {
+    ThreadPool::SetNumThread(num_thread);
+  }
+  Report(kInfo, "Number of threads       : %d", ThreadPool::NumThread());
+
+  // Trace the run (see Trace)
+  if (trace_path) {
+    Trace::Enable();
+    Trace::SetThreadName("main");
+  }
+
   // Create the model
+  // Testing the model only: it's built without any derivatives (frozen)
   Cifar10Model<Dtype> model(model_name, dataset_path,
                             Cifar10Dataset<Dtype>::NumClass(),
-                            batch_size, gray, use_bn);
+                            batch_size, gray, use_bn, nullptr, !train);
+
+  // Cap the model memory (in MB), if any
+  if (mem_cap) {
+    model.SetMemoryCap(size_t(mem_cap) << 20);
+  }
 
   // Load the model if one is specified
   if (model_path) {
@@ -843,9 +941,21 @@ int main(int argc, char* argv[]) {
 
   // Testing the model only
   if (!train) {
+    // Inference only: the activations can share an arena
+    model.PlanInference();
+    Report(kInfo, "Activations memory: %ld byte(s) in an arena of %ld byte(s)",
+           model.Plan().ActivationSize(), model.Plan().ArenaSize());
+
     Report(kInfo, "Testing model '%s'", model_name);
     Dtype acc = model.Test();
     Report(kInfo, "Accuracy: %f", acc);
+    Report(kInfo, "Model memory: %ld byte(s) (peak: %ld byte(s))",
+           model.Memory().Size(), model.Memory().Peak());
+
+    // Write the trace of the run
+    if (trace_path && Trace::Write(trace_path)) {
+      Report(kInfo, "Writing trace '%s'", trace_path);
+    }
     return 0;
   }
 
@@ -865,11 +975,40 @@ int main(int argc, char* argv[]) {
     return -1;
   }
 
+  // Time the layers (the table is printed every print_each steps),
+  // optionally reading the hardware performance counters
+  if (profile || profile_path || counters) {
+    solver->EnableProfiler(profile_path, counters);
+  }
+
+  // Create the replicas (data-parallel training), splitting the batch
+  std::vector<std::unique_ptr<Cifar10Model<Dtype>>> replica(
+    std::min(num_replica, batch_size));
+  std::vector<Model<Dtype>*> replica_ptr(replica.size());
+  for (size_t r = 0; r < replica.size(); ++r) {
+    uint32_t replica_batch_size = batch_size / uint32_t(replica.size()) +
+                                  (r < batch_size % replica.size());
+    replica[r].reset(new Cifar10Model<Dtype>(model_name, dataset_path,
+                                             Cifar10Dataset<Dtype>::NumClass(),
+                                             replica_batch_size, gray, use_bn,
+                                             &model));
+    replica_ptr[r] = replica[r].get();
+  }
+  Report(kInfo, "Number of replicas      : %d", int(replica.size()));
+
   // Train the model
-  if (!solver->Train(&model, num_step, learning_rate)) {
+  if (!solver->Train(&model, replica_ptr, num_step, learning_rate)) {
     return -1;
   }
 
+  Report(kInfo, "Model memory: %ld byte(s) (peak: %ld byte(s))",
+         model.Memory().Size(), model.Memory().Peak());
+
+  // Write the trace of the run
+  if (trace_path && Trace::Write(trace_path)) {
+    Report(kInfo, "Writing trace '%s'", trace_path);
+  }
+
   // Clean
   delete solver;
 
@@ -25,6 +25,7 @@
 
 #include <core/arg_parse.h>
 #include <core/log.h>
+#include <core/thread_pool.h>
 #include <core/dataset.h>
 #include <core/layer_data.h>
 #include <core/layer_scale.h>
@@ -386,6 +387,7 @@ int main(int argc, char* argv[]) {
   Dtype learning_rate, decay_rate, momentum,
         reg, clip, lr_scale, mult, min, max, noise;
   uint32_t num_step, print_each, test_each, save_each, lr_scale_each;
+  uint32_t num_thread;
   arg.Arg<uint32_t>("-batchsize"  , 1                   , &batch_size);
   arg.Arg<Dtype>   ("-lr"         , Dtype(0.01)         , &learning_rate);
   arg.Arg<Dtype>   ("-decayrate"  , Dtype(0.999)        , &decay_rate);
@@ -402,6 +404,7 @@ int main(int argc, char* argv[]) {
   arg.Arg<Dtype>   ("-min"        , Dtype(0)            , &min);
   arg.Arg<Dtype>   ("-max"        , Dtype(1)            , &max);
   arg.Arg<Dtype>   ("-noise"      , Dtype(0.001)        , &noise);
+  arg.Arg<uint32_t>("-threads"    , 0                   , &num_thread);
 
   if ((!train && !model_path) || arg.ArgExists("-h")) {
     Report(kInfo, "Usage: %s [-train] [-scale <SCALE>] [-min <MIN>] "
@@ -432,6 +435,12 @@ int main(int argc, char* argv[]) {
   Report(kInfo, "Scale learning rate each: %d", lr_scale_each);
   Report(kInfo, "Learning rate scale     : %f", lr_scale);
 
+  // Threads
+  if (num_thread) {
+    ThreadPool::SetNumThread(num_thread);
+  }
+  Report(kInfo, "Number of threads       : %d", ThreadPool::NumThread());
+
   // Create the model: make sure we have enough data to cover exactly 1 epoch
   LinearRegressionModel<Dtype> model(model_name, batch_size,
                                      mult, min, max, noise,
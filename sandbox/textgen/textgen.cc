@@ -25,6 +25,7 @@
 
 #include <core/arg_parse.h>
 #include <core/log.h>
+#include <core/thread_pool.h>
 #include <core/dataset.h>
 #include <core/layer_eltwise_scale.h>
 #include <core/layer_softmax_loss.h>
@@ -32,6 +33,7 @@
 #include <core/solver_rmsprop.h>
 #include <recurrent/rnn.h>
 #include <recurrent/lstm.h>
+#include <algorithm>
 #include <vector>
 #include <set>
 #include <map>
@@ -59,6 +61,7 @@ class TextgenDataset: public Dataset {
   std::set<char>           vocab_;            // Vocabulary
   std::map<char, uint32_t> letter_to_index_;  // Mapping letters to indices
   std::map<uint32_t, char> index_to_letter_;  // Mapping indices to letters
+  uint32_t                 max_length_;       // Longest sentence length
 
 
   // Protected methods
@@ -89,7 +92,9 @@ class TextgenDataset: public Dataset {
   /*!
    * Default constructor.
    */
-  TextgenDataset() {}
+  TextgenDataset() {
+    max_length_ = 0;
+  }
 
   /*!
    * Destructor.
@@ -122,6 +127,7 @@ class TextgenDataset: public Dataset {
         vocab_.insert(line[i]);
       }
       sentence_.push_back(line);
+      max_length_ = std::max(max_length_, uint32_t(line.length()));
     }
 
     // Reserve index 0
@@ -143,6 +149,15 @@ class TextgenDataset: public Dataset {
     return uint32_t(sentence_.size());
   }
 
+  /*!
+   * Get the length of the longest sentence.
+   *
+   *  \return Longest sentence length
+   */
+  uint32_t MaxSentenceLength() const {
+    return max_length_;
+  }
+
   /*!
    * Get the number of letters.
    *
@@ -198,6 +213,10 @@ class TextgenDataset: public Dataset {
 /*!
  *  \class  TextgenDataLayer
  *  \brief  Textgen data layer
+ *
+ * The sentences are sorted by length and split into batches of consecutive
+ * sentences (buckets), so the sentences of a batch have close lengths.
+ * The order of the batches is shuffled at each epoch.
  */
 template <typename Dtype>
 class TextgenDataLayer: public LayerData<Dtype> {
@@ -209,11 +228,25 @@ class TextgenDataLayer: public LayerData<Dtype> {
 
   // Protected attributes
  protected:
-  TextgenDataset dataset_;              // Textgen dataset
-  uint32_t       dataset_train_index_;  // Index in the dataset (training)
-  uint32_t       dataset_test_index_;   // Index in the dataset (testing)
-  uint32_t       num_predict_;          // Number of predictions
-  std::string    sentence_;             // Currently loaded sentence
+  TextgenDataset        dataset_;              // Textgen dataset
+  uint32_t              dataset_train_index_;  // Index in the batches
+  uint32_t              dataset_test_index_;   // Index in the dataset (test)
+  uint32_t              num_predict_;          // Number of predictions
+  std::vector<uint32_t> bucket_;               // Sentences sorted by length
+  std::vector<uint32_t> batch_order_;          // Order of the batches
+  std::vector<uint32_t> sentence_index_;       // Currently loaded sentences
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Randomly shuffle the order of the batches (e.g. at each epoch).
+   */
+  void ShuffleBatch() {
+    std::random_device rd;
+    std::default_random_engine re(rd());
+    std::shuffle(batch_order_.begin(), batch_order_.end(), re);
+  }
 
 
   // Public methods
@@ -242,6 +275,23 @@ class TextgenDataLayer: public LayerData<Dtype> {
 
     // Set index at the beginning of the dataset
     dataset_train_index_ = dataset_test_index_ = 0;
+    sentence_index_.assign(batch_size, 0);
+
+    // Sort the sentences by length and split them into batches
+    // (the last batch wraps around to the shortest sentences)
+    bucket_.resize(dataset_.SentenceSize());
+    for (uint32_t i = 0; i < bucket_.size(); ++i) {
+      bucket_[i] = i;
+    }
+    std::stable_sort(bucket_.begin(), bucket_.end(),
+                     [this](uint32_t i1, uint32_t i2) {
+      return dataset_.Sentence(i1).length() < dataset_.Sentence(i2).length();
+    });
+    batch_order_.resize((bucket_.size() + batch_size - 1) / batch_size);
+    for (uint32_t i = 0; i < batch_order_.size(); ++i) {
+      batch_order_[i] = i;
+    }
+    ShuffleBatch();
 
     // Create 1 output for the labels
     // There's no derivative as we don't backpropagate them
@@ -296,12 +346,14 @@ class TextgenDataLayer: public LayerData<Dtype> {
   }
 
   /*!
-   * Get the currently loaded sentence.
+   * Get a currently loaded sentence.
    *
-   *  \return Currently loaded sentence
+   *  \param[in]  batch: batch index
+   *
+   *  \return     Currently loaded sentence
    */
-  const std::string& Sentence() const {
-    return sentence_;
+  const std::string& Sentence(uint32_t batch) const {
+    return dataset_.Sentence(sentence_index_[batch]);
   }
 
   /*!
@@ -323,21 +375,25 @@ class TextgenDataLayer: public LayerData<Dtype> {
     uint32_t sentence_size = dataset_.SentenceSize();
     if (!sentence_size) {
       Report(kError, "Empty dataset");
-      sentence_.clear();
       return;
     }
-    if (dataset_train_index_ >= sentence_size) {
+    if (dataset_train_index_ >= batch_order_.size()) {
       Report(kError, "Invalid dataset index");
-      sentence_.clear();
       return;
     }
 
-    // Load the current sentence
-    sentence_ = dataset_.Sentence(dataset_train_index_);
+    // Load the sentences of the current batch
+    size_t offset = size_t(batch_order_[dataset_train_index_]) *
+                    sentence_index_.size();
+    for (size_t b = 0; b < sentence_index_.size(); ++b) {
+      sentence_index_[b] = bucket_[(offset + b) % sentence_size];
+    }
 
-    // Go to the next sentence
-    if (++dataset_train_index_ >= sentence_size) {
+    // Go to the next batch
+    if (++dataset_train_index_ >= batch_order_.size()) {
+      // Rewind and shuffle for the next epoch
       dataset_train_index_ = 0;
+      ShuffleBatch();
     }
   }
 };
@@ -362,13 +418,54 @@ class TextgenModel: public R {
  protected:
   std::shared_ptr<TextgenDataLayer<Dtype>> data_layer_;   // Data layer
   Dtype                                    temperature_;  // Temperature
-  std::shared_ptr<Mat<Dtype>>              prob_;         // Probabilities
+  std::vector<std::shared_ptr<Mat<Dtype>>> label_;        // Labels
+  std::vector<std::shared_ptr<Mat<Dtype>>> prob_;         // Probabilities
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Add the layers of a timestep to the graph.
+   *
+   *  \param[in]  step: timestep
+   */
+  virtual void CreateStep(uint32_t step) {
+    Parent::CreateStep(step);
+
+    std::shared_ptr<Mat<Dtype>> out = Parent::step_out_[step];
+
+    // Add a scale (temperature) layer
+    if (temperature_ > std::numeric_limits<Dtype>::epsilon() &&
+        temperature_ < Dtype(1) -
+        std::numeric_limits<Dtype>::epsilon()) {
+      Param param;
+      param.Add("scale", temperature_);
+      out = Parent::Add(std::make_shared<EltwiseScaleLayer<Dtype>>(
+        "scale", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out},
+        param))[0];
+    }
+
+    // Add a softmax layer, with its own labels
+    if (!step) {
+      label_.clear();
+      prob_.clear();
+    }
+    label_.push_back(std::make_shared<Mat<Dtype>>(
+      data_layer_->Output()[0]->size, false));
+    const std::vector<std::shared_ptr<Mat<Dtype>>>& softmax_out =
+    Parent::Add(std::make_shared<LayerSoftMaxLoss<Dtype>>(
+      "softmax", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+      out, label_[step]}));
+    Parent::step_out_[step] = softmax_out[0];
+    prob_.push_back(softmax_out[1]);
+  }
 
 
   // Public methods
  public:
   /*!
    * Constructor.
+   * The graph is unrolled for the longest sentence of the dataset.
    *
    *  \param[in]  name       : model name
    *  \param[in]  data_layer : data layer
@@ -386,6 +483,9 @@ class TextgenModel: public R {
       range, batch_size) {
     data_layer_  = data_layer;
     temperature_ = temperature;
+
+    // One timestep per letter, plus the end of the sentence
+    Parent::Create(data_layer_->Dataset().MaxSentenceLength() + 1);
   }
 
   /*!
@@ -412,41 +512,12 @@ class TextgenModel: public R {
   }
 
   /*!
-   * Create at a specific index.
-   *
-   *  \param[in]  index: data index
-   */
-  virtual void Create(uint32_t index) {
-    Parent::Create(index);
-
-    // Add a scale (temperature) layer
-    if (temperature_ > std::numeric_limits<Dtype>::epsilon() &&
-        temperature_ < Dtype(1) -
-        std::numeric_limits<Dtype>::epsilon()) {
-      Param param;
-      param.Add("scale", temperature_);
-      Parent::out_ = Parent::Add(std::make_shared<EltwiseScaleLayer<Dtype>>(
-        "", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-        param))[0];
-    }
-
-    // Add a softmax layer
-    std::shared_ptr<Mat<Dtype>> label = data_layer_->Output()[0];
-    const std::vector<std::shared_ptr<Mat<Dtype>>>& out =
-    Parent::Add(std::make_shared<LayerSoftMaxLoss<Dtype>>(
-      "", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
-      Parent::out_, label}));
-    Parent::out_ = out[0];
-    prob_        = out[1];
-  }
-
-  /*!
-   * Graph training (forward + backward pass).
+   * Graph training (forward + backward pass through the whole sentence).
    *
    *  \return Loss
    */
   virtual Dtype Train() {
-    // Clear the previous iteration state
+    // Clear the initial state
     Parent::ClearPrevState();
 
     State state(State::PHASE_TRAIN);
@@ -454,33 +525,63 @@ class TextgenModel: public R {
     // Load the data
     data_layer_->Forward(state);
 
-    // Get the label, sentence dataset and currently loaded sentence
-    std::shared_ptr<Mat<Dtype>> label = data_layer_->Output()[0];
-    const TextgenDataset& dataset     = data_layer_->Dataset();
-    const std::string& sentence       = data_layer_->Sentence();
-
-    uint32_t len = sentence.length();
-    if (!len) {
+    // Get the sentence dataset
+    const TextgenDataset& dataset = data_layer_->Dataset();
+    uint32_t batch_size           = Parent::BatchSize();
+
+    // The batch runs for its longest sentence
+    // A sentence of len letters makes len + 1 predictions (up to the end),
+    // truncated to the unrolled timesteps
+    uint32_t num_step = 0;
+    uint32_t num_pred = 0;
+    for (uint32_t b = 0; b < batch_size; ++b) {
+      uint32_t len      = data_layer_->Sentence(b).length();
+      uint32_t len_pred = std::min(len + 1, Parent::MaxStep());
+      num_step          = std::max(num_step, len_pred);
+      num_pred         += len_pred;
+    }
+    if (!num_pred) {
       return Dtype(0);
     }
 
-    Dtype loss = Dtype(0);
-    for (uint32_t i = 0; i <= len; ++i) {
-      uint32_t index_src = 0;
-      uint32_t index_dst = 0;
-      if (i) {
-        index_src = dataset.LetterToIndex(sentence[i - 1]);
-      }
-      if (i != len) {
-        index_dst = dataset.LetterToIndex(sentence[i]);
+    // Each letter (0 to start) predicts the next one (0 to end)
+    // The timesteps after the end of a sentence are masked (negative label)
+    for (uint32_t i = 0; i < num_step; ++i) {
+      Dtype* label_data = label_[i]->Data();
+      for (uint32_t b = 0; b < batch_size; ++b) {
+        const std::string& sentence = data_layer_->Sentence(b);
+        uint32_t len = sentence.length();
+        if (i > len) {
+          label_data[b] = Dtype(-1);
+          Parent::SetInput(i, 0, b);
+          continue;
+        }
+
+        uint32_t index_src = 0;
+        uint32_t index_dst = 0;
+        if (i) {
+          index_src = dataset.LetterToIndex(sentence[i - 1]);
+        }
+        if (i != len) {
+          index_dst = dataset.LetterToIndex(sentence[i]);
+        }
+
+        label_data[b] = index_dst;
+        Parent::SetInput(i, index_src, b);
       }
+    }
+
+    Parent::ForwardStep(state, 0, num_step);
+    Parent::BackwardStep(state, 0, num_step);
 
-      *label->Data() = index_dst;
-      Create(index_src);
-      loss += Parent::Train();
+    // Loss per prediction (the losses are averaged over the whole batch,
+    // masked items included)
+    Dtype loss = Dtype(0);
+    for (uint32_t i = 0; i < num_step; ++i) {
+      loss += *Parent::step_out_[i]->Data();
     }
 
-    return loss / len;
+    return loss * batch_size / num_pred;
   }
 
   /*!
@@ -489,9 +590,6 @@ class TextgenModel: public R {
    *  \return Accuracy
    */
   virtual Dtype Test() {
-    // Clear the previous iteration state
-    Parent::ClearPrevState();
-
     State state(State::PHASE_TEST);
 
     // Get the sentence dataset
@@ -504,12 +602,19 @@ class TextgenModel: public R {
     std::mt19937 gen(rd());
     std::uniform_real_distribution<Dtype> dist(Dtype(0), Dtype(1));
 
+    // A sentence is predicted at a time: run with a batch size of 1
+    uint32_t batch_size = Parent::BatchSize();
+    Parent::SetBatchSize(1);
+
     while (!data_layer_->TestingDone()) {
+      // Clear the initial state
+      Parent::ClearPrevState();
+
       // Load the data
       data_layer_->Forward(state);
 
       std::string sentence;
-      while (true) {
+      for (uint32_t step = 0; ; ++step) {
         uint32_t index;
         if (sentence.empty())  {
           index = 0;
@@ -517,16 +622,22 @@ class TextgenModel: public R {
           index = dataset.LetterToIndex(sentence[sentence.length() - 1]);
         }
 
+        // The sentence is longer than the graph: carry on from the start
+        if (step == Parent::MaxStep()) {
+          Parent::CarryState(step - 1);
+          step = 0;
+        }
+
         // Inference
-        Create(index);
-        Parent::Forward(state);
+        Parent::SetInput(step, index);
+        Parent::ForwardStep(state, step, step + 1);
 
         // Pseudo-randomly choose an index
         index      = 0;
         Dtype r    = dist(gen);
         Dtype x    = Dtype(0);
-        Dtype* out = prob_->Data();
-        for (uint32_t i = 0; i < prob_->Size(); ++i) {
+        Dtype* out = prob_[step]->Data();
+        for (uint32_t i = 0; i < prob_[step]->size[0]; ++i) {
           x += out[i];
           if (x > r) {
             break;
@@ -552,6 +663,9 @@ class TextgenModel: public R {
              data_layer_->PredictionIndex(), sentence.c_str());
     }
 
+    // Back to the training batch size
+    Parent::SetBatchSize(batch_size);
+
     return Dtype(1);
   }
 };
@@ -572,10 +686,14 @@ int main(int argc, char* argv[]) {
   const char* model_type   = arg.Arg("-model");
   const char* model_name   = arg.Arg("-name");
   const char* solver_type  = arg.Arg("-solver");
+  const char* profile_path = arg.Arg("-profilefile");
+  bool        profile      = arg.ArgExists("-profile");
+  bool        counters     = arg.ArgExists("-counters");
+  const char* trace_path   = arg.Arg("-trace");
   Dtype learning_rate, decay_rate, momentum, reg,
         clip, lr_scale, temperature, range;
   uint32_t batch_size, num_step, print_each, test_each, save_each,
-           lr_scale_each, num_predict, embed_size, hs;
+           lr_scale_each, num_predict, embed_size, hs, num_thread;
   arg.Arg<uint32_t>("-batchsize"  , 128         , &batch_size);
   arg.Arg<Dtype>   ("-lr"         , Dtype(0.001), &learning_rate);
   arg.Arg<Dtype>   ("-decayrate"  , Dtype(0.999), &decay_rate);
@@ -593,6 +711,7 @@ int main(int argc, char* argv[]) {
   arg.Arg<uint32_t>("-embedsize"  , 5           , &embed_size);
   arg.Arg<uint32_t>("-hs"         , 20          , &hs);
   arg.Arg<Dtype>   ("-range"      , Dtype(0.2)  , &range);
+  arg.Arg<uint32_t>("-threads"    , 0           , &num_thread);
 
   if (!dataset_path || arg.ArgExists("-h")) {
     Report(kInfo, "Usage: %s -dataset <path/to/text/file> "
@@ -630,6 +749,18 @@ int main(int argc, char* argv[]) {
   Report(kInfo, "Hidden size             : %d", hs);
   Report(kInfo, "Value range             : %f", range);
 
+  // Threads
+  if (num_thread) {
+    ThreadPool::SetNumThread(num_thread);
+  }
+  Report(kInfo, "Number of threads       : %d", ThreadPool::NumThread());
+
+  // Trace the run (see Trace)
+  if (trace_path) {
+    Trace::Enable();
+    Trace::SetThreadName("main");
+  }
+
   // Create either a RNN or LSTM based recurrent model
   Model<Dtype>* model;
   if (!std::strcmp(model_type, "rnn")) {
@@ -663,11 +794,22 @@ int main(int argc, char* argv[]) {
     return -1;
   }
 
+  // Time the layers (the table is printed every print_each steps),
+  // optionally reading the hardware performance counters
+  if (profile || profile_path || counters) {
+    solver->EnableProfiler(profile_path, counters);
+  }
+
   // Train the model
   if (!solver->Train(model, num_step, learning_rate)) {
     return -1;
   }
 
+  // Write the trace of the run
+  if (trace_path && Trace::Write(trace_path)) {
+    Report(kInfo, "Writing trace '%s'", trace_path);
+  }
+
   // Clean
   delete model;
   delete solver;